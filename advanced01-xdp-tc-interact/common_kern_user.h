@@ -0,0 +1,48 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+/* Size of cpu_map, which is indexed by CPU id */
+#define CPUMAP_MAX_CPUS		256
+
+/* Per-CPU counters of the second-stage cpumap program */
+struct cpu_stage2_rec {
+	__u64 packets;
+	__u64 bytes;
+};
+
+#define SUBSCRIBER_MAX		65536
+
+/* IPv4 subscribers are stored IPv4-mapped (::ffff:a.b.c.d), with 96 added
+ * to the prefix length.
+ */
+struct subscriber_key {
+	__u32 prefixlen;
+	__be32 addr[4];
+};
+
+/* Where a subscriber's traffic is handled: the CPU it is redirected to,
+ * which is also the TX queue it leaves on, and its HTB class. The major
+ * number of classid must be that of the HTB qdisc on TX queue cpu, i.e.
+ * cpu + 1 with the setup from cpumap_tc_setup.sh.
+ */
+struct subscriber_info {
+	__u32 cpu;
+	__u32 classid;	/* TC_H_MAKE(major << 16, minor) */
+};
+
+/* Classification handed from XDP to TC ingress in the packet's metadata
+ * area. Its size must be a multiple of 4.
+ */
+#define XDP_TC_META_MAGIC	0xc1a5
+
+struct xdp_tc_meta {
+	__u32 class_id;		/* becomes skb->mark and skb->priority */
+	__u32 flow_hash;	/* becomes skb->hash */
+	__u16 l4_off;		/* L4 header offset, 0 if none */
+	__u16 magic;		/* XDP_TC_META_MAGIC */
+};
+
+#endif /* __COMMON_KERN_USER_H */
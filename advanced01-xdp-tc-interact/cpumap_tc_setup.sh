@@ -0,0 +1,104 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# Sets up the XDP CPU-redirect plus TC shaping example on two testenv
+# environments. Traffic from the cpumap-in namespace to subscribers in the
+# cpumap-out namespace is redirected to its subscriber's CPU by XDP on the
+# host side of cpumap-in, and shaped by that CPU's HTB qdisc on the host
+# side of cpumap-out.
+#
+# Usage: cpumap_tc_setup.sh setup [<ncpus>]
+#        cpumap_tc_setup.sh add <ipv4addr>[/<len>] <cpu> <minor> <rate>
+#        cpumap_tc_setup.sh teardown
+#
+# <minor> is the hex minor number of the subscriber's HTB class, at least 10.
+# Run from the lesson directory after make, as root.
+
+set -e
+
+TESTENV=../testenv/testenv.sh
+IN=cpumap-in
+OUT=cpumap-out
+PIN_DIR=/sys/fs/bpf/tc/globals
+
+die()
+{
+    echo "$1" >&2
+    exit 1
+}
+
+# Prints a 32-bit value as little-endian bytes, for bpftool
+le32()
+{
+    local v=$1
+    echo $((v & 255)) $((v >> 8 & 255)) $((v >> 16 & 255)) $((v >> 24 & 255))
+}
+
+setup()
+{
+    local ncpus=${1:-$(nproc)}
+    local cpus=() q major
+
+    $TESTENV --name=$IN --legacy-ip --queues=$ncpus setup
+    $TESTENV --name=$OUT --legacy-ip --queues=$ncpus setup
+    sysctl -w net.ipv4.conf.all.forwarding=1 net.ipv6.conf.all.forwarding=1 >/dev/null
+
+    # One HTB qdisc per TX queue; the one on TX queue n is only used by
+    # CPU n and has major number n + 1.
+    tc qdisc replace dev $OUT root handle 7fff: mq
+    for ((q = 0; q < ncpus; q++)); do
+        major=$(printf %x $((q + 1)))
+        tc qdisc add dev $OUT parent 7fff:$major handle $major: htb default 2
+        tc class add dev $OUT parent $major: classid $major:1 htb rate 10gbit
+        tc class add dev $OUT parent $major:1 classid $major:2 htb rate 10gbit
+        # XPS would override the TX queue picked by the TC program
+        echo 0 > /sys/class/net/$OUT/queues/tx-$q/xps_cpus 2>/dev/null || true
+        cpus+=(--cpu $q)
+    done
+
+    # The TC side creates subscriber_map, the XDP side reuses it
+    tc qdisc add dev $OUT clsact
+    tc filter add dev $OUT egress bpf da obj tc_cpumap_tc_kern.o sec tc
+
+    ./xdp_cpumap_user --dev $IN --filename xdp_cpumap_tc_kern.o \
+        --progname xdp_cpumap_tc_func --pin-path $PIN_DIR "${cpus[@]}"
+}
+
+add()
+{
+    local prefix=$1 cpu=$2 minor=$3 rate=$4
+    local addr=${prefix%/*} len=32 major a b c d
+
+    [ -n "$rate" ] || die "Usage: $0 add <ipv4addr>[/<len>] <cpu> <minor> <rate>"
+    [[ "$prefix" == */* ]] && len=${prefix#*/}
+    major=$(printf %x $((cpu + 1)))
+
+    tc class replace dev $OUT parent $major:1 classid $major:$minor \
+        htb rate $rate ceil $rate
+
+    # struct subscriber_key (IPv4-mapped) and struct subscriber_info
+    IFS=. read -r a b c d <<< "$addr"
+    bpftool map update pinned $PIN_DIR/subscriber_map \
+        key $(le32 $((len + 96))) 0 0 0 0 0 0 0 0 0 0 0xff 0xff $a $b $c $d \
+        value $(le32 $cpu) $(le32 $(((cpu + 1) << 16 | 0x$minor)))
+}
+
+teardown()
+{
+    $TESTENV --name=$IN teardown || true
+    $TESTENV --name=$OUT teardown || true
+    # xdp_stats_queue_map only exists when built with XDP_STATS_QUEUES
+    rm -f $PIN_DIR/subscriber_map $PIN_DIR/cpu_map $PIN_DIR/xdp_stats_map \
+        $PIN_DIR/xdp_stats_queue_map
+}
+
+case "$1" in
+    setup|add|teardown)
+        cmd=$1
+        shift
+        $cmd "$@"
+        ;;
+    *)
+        die "Usage: $0 setup [<ncpus>] | add <ipv4addr>[/<len>] <cpu> <minor> <rate> | teardown"
+        ;;
+esac
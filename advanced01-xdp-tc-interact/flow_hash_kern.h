@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used *ONLY* by BPF-prog running kernel side. */
+#ifndef __FLOW_HASH_KERN_H
+#define __FLOW_HASH_KERN_H
+
+/* Flow parsing and hashing shared by the XDP programs of this lesson.
+ * Include parsing_helpers.h first.
+ */
+
+/* from include/net/ip.h */
+#define IP_MF		0x2000
+#define IP_OFFSET	0x1fff
+
+struct flow_info {
+	__u32 hash;
+	__u16 l4_off;	/* from the start of the packet, 0 if no L4 header */
+	__be16 dport;
+	__u8 proto;
+};
+
+/* __jhash_final() from include/linux/jhash.h */
+static __always_inline __u32 rol32(__u32 word, unsigned int shift)
+{
+	return (word << shift) | (word >> ((-shift) & 31));
+}
+
+static __always_inline __u32 flow_hash(__u32 a, __u32 b, __u32 c)
+{
+	a += 0xdeadbeef;
+	b += 0xdeadbeef;
+	c += 0xdeadbeef;
+
+	c ^= b; c -= rol32(b, 14);
+	a ^= c; a -= rol32(c, 11);
+	b ^= a; b -= rol32(a, 25);
+	c ^= b; c -= rol32(b, 16);
+	a ^= c; a -= rol32(c, 4);
+	b ^= a; b -= rol32(a, 14);
+	c ^= b; c -= rol32(b, 24);
+	return c;
+}
+
+/* Parses the IPv4/IPv6 header at the cursor and folds its addresses into
+ * saddr and daddr. Returns the L4 protocol, or -1 for non-IP or truncated
+ * packets; saddr, daddr and is_frag are only set on success.
+ */
+static __always_inline int flow_parse_ip(struct hdr_cursor *nh, void *data_end,
+					 int eth_type, __u32 *saddr,
+					 __u32 *daddr, int *is_frag)
+{
+	struct ipv6_frag_info frag;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	int ip_type;
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(nh, data_end, &iph);
+		if (ip_type < 0)
+			return -1;
+		*saddr = iph->saddr;
+		*daddr = iph->daddr;
+		*is_frag = !!(iph->frag_off & bpf_htons(IP_MF | IP_OFFSET));
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr_ext(nh, data_end, &ip6h, &frag);
+		if (ip_type < 0)
+			return -1;
+		*saddr = ip6h->saddr.in6_u.u6_addr32[0] ^
+			 ip6h->saddr.in6_u.u6_addr32[1] ^
+			 ip6h->saddr.in6_u.u6_addr32[2] ^
+			 ip6h->saddr.in6_u.u6_addr32[3];
+		*daddr = ip6h->daddr.in6_u.u6_addr32[0] ^
+			 ip6h->daddr.in6_u.u6_addr32[1] ^
+			 ip6h->daddr.in6_u.u6_addr32[2] ^
+			 ip6h->daddr.in6_u.u6_addr32[3];
+		*is_frag = frag.is_frag;
+	} else {
+		return -1;
+	}
+
+	return ip_type;
+}
+
+static __always_inline int __xdp_flow_parse(struct xdp_md *ctx,
+					    struct flow_info *flow, int inner)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	__u32 saddr, daddr, ports = 0;
+	int eth_type, ip_type, is_frag;
+	struct ethhdr *inner_eth;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+	struct ethhdr *eth;
+	int inner_type;
+	void *l4;
+
+	__builtin_memset(flow, 0, sizeof(*flow));
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	ip_type = flow_parse_ip(&nh, data_end, eth_type, &saddr, &daddr,
+				&is_frag);
+	if (ip_type < 0)
+		return -1;
+	if (is_frag)
+		goto out;
+
+	if (inner) {
+		/* A malformed tunnel, or inner packet, only hashes the outer
+		 * addresses
+		 */
+		inner_type = parse_tunnel(&nh, data_end, ip_type, &inner_eth);
+		if (inner_type < 0)
+			goto out;
+		if (inner_type > 0) {
+			inner_type = flow_parse_ip(&nh, data_end, inner_type,
+						   &saddr, &daddr, &is_frag);
+			if (inner_type < 0)
+				goto out;
+			ip_type = inner_type;
+			if (is_frag)
+				goto out;
+		}
+	}
+
+	l4 = nh.pos;
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(&nh, data_end, &tcph) < 0)
+			goto out;
+		ports = (__u32)tcph->source << 16 | tcph->dest;
+		flow->dport = tcph->dest;
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udph) < 0)
+			goto out;
+		ports = (__u32)udph->source << 16 | udph->dest;
+		flow->dport = udph->dest;
+	} else {
+		goto out;
+	}
+	flow->l4_off = l4 - data;
+
+out:
+	flow->proto = ip_type;
+	flow->hash = flow_hash(saddr, daddr, ports ^ ip_type);
+	return 0;
+}
+
+/* Parses the packet and hashes its addresses and, if there are any, its
+ * ports. Fragments only hash the addresses, so they stay with the rest of
+ * their packet. Returns -1 for non-IP packets.
+ */
+static __always_inline int xdp_flow_parse(struct xdp_md *ctx,
+					  struct flow_info *flow)
+{
+	return __xdp_flow_parse(ctx, flow, 0);
+}
+
+/* Like xdp_flow_parse(), but for IPIP, GRE, VXLAN and GENEVE packets it
+ * describes the inner flow. Traffic between two tunnel endpoints otherwise
+ * hashes to the same value.
+ */
+static __always_inline int xdp_flow_parse_inner(struct xdp_md *ctx,
+						struct flow_info *flow)
+{
+	return __xdp_flow_parse(ctx, flow, 1);
+}
+
+#endif /* __FLOW_HASH_KERN_H */
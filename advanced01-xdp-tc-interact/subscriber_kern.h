@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used *ONLY* by BPF-prog running kernel side. */
+#ifndef __SUBSCRIBER_KERN_H
+#define __SUBSCRIBER_KERN_H
+
+/*
+ * Subscriber table shared by xdp_cpumap_tc_kern.c and tc_cpumap_tc_kern.c.
+ * Both look up the destination address of a packet: XDP to pick the CPU
+ * that handles the subscriber, TC egress to pick its TX queue and HTB
+ * class on that CPU. iproute2 pins it under /sys/fs/bpf/tc/globals, so the
+ * XDP side must be loaded with that pin path.
+ */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct subscriber_key);
+	__type(value, struct subscriber_info);
+	__uint(max_entries, SUBSCRIBER_MAX);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} subscriber_map SEC(".maps");
+
+/* Looks up the subscriber owning the destination address of a packet whose
+ * Ethernet header starts at data. Returns NULL for unknown destinations and
+ * non-IP packets.
+ */
+static __always_inline struct subscriber_info *subscriber_lookup(void *data,
+								 void *data_end)
+{
+	struct subscriber_key key = { .prefixlen = 128 };
+	struct hdr_cursor nh = { .pos = data };
+	struct ipv6hdr *ip6h;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	int eth_type;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		if (parse_iphdr(&nh, data_end, &iph) < 0)
+			return NULL;
+		key.addr[2] = bpf_htonl(0xffff);
+		key.addr[3] = iph->daddr;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		if (parse_ip6hdr(&nh, data_end, &ip6h) < 0)
+			return NULL;
+		__builtin_memcpy(key.addr, &ip6h->daddr, sizeof(key.addr));
+	} else {
+		return NULL;
+	}
+
+	return bpf_map_lookup_elem(&subscriber_map, &key);
+}
+
+#endif /* __SUBSCRIBER_KERN_H */
@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+
+#include <linux/if_ether.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include <linux/pkt_cls.h>
+
+#include "../common/parsing_helpers.h"
+
+#include "common_kern_user.h"
+#include "subscriber_kern.h"
+
+/*
+ * Second half of the XDP CPU-redirect plus TC shaping setup, see
+ * xdp_cpumap_tc_kern.c. Runs as a TC egress filter on the interface
+ * towards the subscribers, which has an MQ root qdisc with one HTB qdisc
+ * per TX queue:
+ *
+ *   tc qdisc add dev eth1 clsact
+ *   tc filter add dev eth1 egress bpf da obj tc_cpumap_tc_kern.o sec tc
+ *
+ * Every subscriber is sent on the TX queue of the CPU its traffic was
+ * redirected to, so each HTB qdisc (and its lock) is only ever used from
+ * one CPU. skb->priority then selects the subscriber's class within it.
+ */
+
+SEC("tc")
+int tc_cpumap_tc_egress(struct __sk_buff *skb)
+{
+	void *data_end = (void *)(long)skb->data_end;
+	void *data = (void *)(long)skb->data;
+	struct subscriber_info *sub;
+
+	sub = subscriber_lookup(data, data_end);
+	if (!sub)
+		return TC_ACT_OK;
+
+	/* Forwarded packets have no socket to pick their TX queue, and the
+	 * stack takes queue_mapping as the recorded RX queue plus one, so
+	 * this selects TX queue sub->cpu (with XPS disabled).
+	 */
+	skb->queue_mapping = sub->cpu + 1;
+	skb->priority = sub->classid;
+
+	return TC_ACT_OK;
+}
+
+char _license[] SEC("license") = "GPL";
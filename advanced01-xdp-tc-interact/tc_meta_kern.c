@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+
+#include <bpf/bpf_helpers.h>
+#include <linux/pkt_cls.h>
+
+#include "common_kern_user.h"
+
+/*
+ * TC ingress half of xdp_meta_kern.c: applies the classification XDP left
+ * in the metadata area to the SKB, so later layers can match on the mark
+ * and priority and RPS/RFS reuse the hash instead of computing their own.
+ *
+ *   tc qdisc add dev eth0 clsact
+ *   tc filter add dev eth0 ingress bpf da obj tc_meta_kern.o sec tc
+ */
+
+SEC("tc")
+int tc_meta_ingress(struct __sk_buff *skb)
+{
+	void *data = (void *)(long)skb->data;
+	struct xdp_tc_meta *meta = (void *)(long)skb->data_meta;
+
+	/* No metadata when the XDP program is not loaded or the driver
+	 * does not support it
+	 */
+	if ((void *)(meta + 1) > data || meta->magic != XDP_TC_META_MAGIC)
+		return TC_ACT_OK;
+
+	if (meta->class_id) {
+		skb->mark = meta->class_id;
+		skb->priority = meta->class_id;
+	}
+	bpf_set_hash(skb, meta->flow_hash);
+
+	return TC_ACT_OK;
+}
+
+char _license[] SEC("license") = "GPL";
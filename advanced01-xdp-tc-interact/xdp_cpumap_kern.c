@@ -0,0 +1,105 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+#include "common_kern_user.h"
+#include "flow_hash_kern.h"
+
+/*
+ * Spreads flows over a set of CPUs with a CPUMAP redirect. The packets of
+ * a flow all go to the same CPU, where the kernel then builds the SKB and
+ * runs the network stack; the RX CPU only does this program.
+ *
+ * The CPU set is cpus_count entries of cpus_available, written by
+ * xdp_cpumap_user, which also sets the queue size and second-stage program
+ * of each cpu_map entry.
+ */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CPUMAP);
+	__type(key, __u32);
+	__type(value, struct bpf_cpumap_val);
+	__uint(max_entries, CPUMAP_MAX_CPUS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} cpu_map SEC(".maps");
+
+/* Index to CPU id */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, CPUMAP_MAX_CPUS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} cpus_available SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, 1);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} cpus_count SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct cpu_stage2_rec);
+	__uint(max_entries, 1);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} cpu_stage2_stats SEC(".maps");
+
+SEC("xdp_cpu_spread")
+int xdp_cpu_spread_func(struct xdp_md *ctx)
+{
+	__u32 *cpu_count, *cpu, idx, key = 0;
+	int action = XDP_PASS;
+	struct flow_info flow;
+
+	cpu_count = bpf_map_lookup_elem(&cpus_count, &key);
+	if (!cpu_count || !*cpu_count)
+		goto out;
+
+	/* Non-IP packets all go to the first CPU. Tunnelled packets are
+	 * spread by their inner flow.
+	 */
+	xdp_flow_parse_inner(ctx, &flow);
+	idx = flow.hash % *cpu_count;
+	cpu = bpf_map_lookup_elem(&cpus_available, &idx);
+	if (!cpu)
+		goto out;
+
+	/* Falls back to XDP_PASS on this CPU if the entry is not set up */
+	action = bpf_redirect_map(&cpu_map, *cpu, XDP_PASS);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+/* Optional second stage, run on the destination CPU before the SKB is
+ * built. This one only counts what each CPU receives.
+ */
+SEC("xdp/cpumap")
+int xdp_cpu_stage2_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct cpu_stage2_rec *rec;
+	__u32 key = 0;
+
+	rec = bpf_map_lookup_elem(&cpu_stage2_stats, &key);
+	if (rec) {
+		rec->packets++;
+		rec->bytes += data_end - data;
+	}
+	return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
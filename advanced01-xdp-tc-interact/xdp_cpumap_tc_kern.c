@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+#include "common_kern_user.h"
+#include "subscriber_kern.h"
+
+/*
+ * First half of the XDP CPU-redirect plus TC shaping setup: redirects each
+ * subscriber's traffic to the CPU that owns it, so all of it is forwarded,
+ * and shaped by tc_cpumap_tc_kern.c, on that one CPU. cpu_map is set up by
+ * xdp_cpumap_user.
+ */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_CPUMAP);
+	__type(key, __u32);
+	__type(value, struct bpf_cpumap_val);
+	__uint(max_entries, CPUMAP_MAX_CPUS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} cpu_map SEC(".maps");
+
+SEC("xdp_cpumap_tc")
+int xdp_cpumap_tc_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct subscriber_info *sub;
+	int action = XDP_PASS;
+
+	sub = subscriber_lookup(data, data_end);
+	if (sub)
+		action = bpf_redirect_map(&cpu_map, sub->cpu, XDP_PASS);
+
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
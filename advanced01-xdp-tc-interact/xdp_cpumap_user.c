@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "XDP CPUMAP flow spreading loader\n"
+	" - Attaches xdp_cpu_spread_func (or --progname) to --dev and sets up\n"
+	"   cpu_map for the --cpu list, with an optional second-stage program\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+
+#include "common_kern_user.h"
+
+#define DEFAULT_QSIZE 2048
+
+static const char *default_filename = "xdp_cpumap_kern.o";
+static const char *default_progname = "xdp_cpu_spread_func";
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",        no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",         required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"skb-mode",    no_argument,		NULL, 'S' },
+	 "Install XDP program in SKB (AKA generic) mode"},
+
+	{{"native-mode", no_argument,		NULL, 'N' },
+	 "Install XDP program in native mode"},
+
+	{{"auto-mode",   no_argument,		NULL, 'A' },
+	 "Auto-detect SKB or native mode"},
+
+	{{"cpu",         required_argument,	NULL, 'c' },
+	 "Spread flows to CPU <id> (repeat for each CPU)", "<id>", true},
+
+	{{"qsize",       required_argument,	NULL, 'Q' },
+	 "Queue size per CPU (default 2048)", "<packets>"},
+
+	{{"stage2",      required_argument,	NULL, 's' },
+	 "Run program <name> on the CPUs before the SKB is built", "<name>"},
+
+	{{"pin-path",    required_argument,	NULL, 'p' },
+	 "Pin maps under <dir> (default /sys/fs/bpf/<ifname>)", "<dir>"},
+
+	{{"quiet",       no_argument,		NULL, 'q' },
+	 "Quiet mode (no output)"},
+
+	{{"filename",    required_argument,	NULL,  1  },
+	 "Load program from <file>", "<file>"},
+
+	{{"progname",    required_argument,	NULL,  2  },
+	 "Load program from function <name> in the ELF file", "<name>"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+struct cpumap_cmd {
+	struct config cfg;
+	__u32 cpus[CPUMAP_MAX_CPUS];
+	int num_cpus;
+	__u32 qsize;
+	char stage2[32];
+};
+
+static void parse_args(int argc, char **argv, struct cpumap_cmd *cmd)
+{
+	struct option long_opts[sizeof(long_options) / sizeof(long_options[0])];
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+	int i, opt, cpu;
+
+	for (i = 0; long_options[i].option.name; i++)
+		long_opts[i] = long_options[i].option;
+	memset(&long_opts[i], 0, sizeof(long_opts[i]));
+
+	while ((opt = getopt_long(argc, argv, "hd:SNAc:Q:s:p:q",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --dev name too long\n");
+				goto error;
+			}
+			cmd->cfg.ifname = cmd->cfg.ifname_buf;
+			strncpy(cmd->cfg.ifname, optarg, IF_NAMESIZE);
+			cmd->cfg.ifindex = if_nametoindex(cmd->cfg.ifname);
+			if (cmd->cfg.ifindex == 0) {
+				fprintf(stderr,
+					"ERR: --dev name unknown err(%d):%s\n",
+					errno, strerror(errno));
+				goto error;
+			}
+			break;
+		case 'S':
+			cmd->cfg.attach_mode = XDP_MODE_SKB;
+			break;
+		case 'N':
+			cmd->cfg.attach_mode = XDP_MODE_NATIVE;
+			break;
+		case 'A':
+			cmd->cfg.attach_mode = XDP_MODE_UNSPEC;
+			break;
+		case 'c':
+			cpu = atoi(optarg);
+			if (cpu < 0 || cpu >= ncpus || cpu >= CPUMAP_MAX_CPUS) {
+				fprintf(stderr, "ERR: bad --cpu %s\n", optarg);
+				goto error;
+			}
+			if (cmd->num_cpus >= CPUMAP_MAX_CPUS) {
+				fprintf(stderr, "ERR: too many CPUs\n");
+				goto error;
+			}
+			cmd->cpus[cmd->num_cpus++] = cpu;
+			break;
+		case 'Q':
+			cmd->qsize = atoi(optarg);
+			if (!cmd->qsize) {
+				fprintf(stderr, "ERR: bad --qsize %s\n", optarg);
+				goto error;
+			}
+			break;
+		case 's':
+			strncpy(cmd->stage2, optarg, sizeof(cmd->stage2) - 1);
+			break;
+		case 'p':
+			strncpy(cmd->cfg.pin_dir, optarg,
+				sizeof(cmd->cfg.pin_dir) - 1);
+			break;
+		case 'q':
+			verbose = false;
+			break;
+		case 1: /* --filename */
+			strncpy(cmd->cfg.filename, optarg,
+				sizeof(cmd->cfg.filename) - 1);
+			break;
+		case 2: /* --progname */
+			strncpy(cmd->cfg.progname, optarg,
+				sizeof(cmd->cfg.progname) - 1);
+			break;
+		case 'h':
+			usage(argv[0], __doc__, long_options, true);
+			exit(EXIT_OK);
+		default:
+			goto error;
+		}
+	}
+
+	if (cmd->cfg.ifindex <= 0 || !cmd->num_cpus) {
+		fprintf(stderr, "ERR: required option --dev or --cpu missing\n\n");
+		goto error;
+	}
+	return;
+
+error:
+	usage(argv[0], __doc__, long_options, (argc == 1));
+	exit(EXIT_FAIL_OPTION);
+}
+
+/* Like load_bpf_and_xdp_attach(), but with the pinned maps shared under
+ * cfg->pin_dir, e.g. with TC programs loaded by iproute2
+ */
+static struct xdp_program *load_and_attach(struct config *cfg)
+{
+	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts,
+			    .pin_root_path = cfg->pin_dir);
+	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts,
+			    .open_filename = cfg->filename,
+			    .prog_name = cfg->progname,
+			    .opts = &opts);
+	struct xdp_program *prog;
+	char errmsg[1024];
+	int err;
+
+	prog = xdp_program__create(&xdp_opts);
+	err = libxdp_get_error(prog);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "ERR: loading program: %s\n", errmsg);
+		return NULL;
+	}
+
+	err = xdp_program__attach(prog, cfg->ifindex, cfg->attach_mode, 0);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "ERR: attaching program: %s\n", errmsg);
+		xdp_program__close(prog);
+		return NULL;
+	}
+	return prog;
+}
+
+/* Sets up cpu_map for the CPUs in the list and removes the other entries.
+ * Programs that spread flows themselves also get the list, in
+ * cpus_available and cpus_count.
+ */
+static int cpumap_setup(struct bpf_object *obj, struct cpumap_cmd *cmd,
+			int stage2_fd)
+{
+	struct bpf_cpumap_val val = {
+		.qsize = cmd->qsize,
+		.bpf_prog.fd = stage2_fd,
+	};
+	int cpumap_fd, avail_fd = -1, count_fd = -1;
+	__u32 i, key = 0, count = 0;
+	bool used[CPUMAP_MAX_CPUS] = {};
+	struct bpf_map *map;
+
+	map = bpf_object__find_map_by_name(obj, "cpu_map");
+	if (!map) {
+		fprintf(stderr, "ERR: no cpu_map in %s\n", cmd->cfg.filename);
+		return -1;
+	}
+	cpumap_fd = bpf_map__fd(map);
+
+	map = bpf_object__find_map_by_name(obj, "cpus_available");
+	if (map)
+		avail_fd = bpf_map__fd(map);
+	map = bpf_object__find_map_by_name(obj, "cpus_count");
+	if (map)
+		count_fd = bpf_map__fd(map);
+
+	for (i = 0; i < (__u32)cmd->num_cpus; i++) {
+		/* Allocates the CPU's queue and starts its kthread */
+		if (bpf_map_update_elem(cpumap_fd, &cmd->cpus[i], &val, 0)) {
+			fprintf(stderr, "ERR: adding CPU %u to cpu_map: %s\n",
+				cmd->cpus[i], strerror(errno));
+			return -1;
+		}
+		if (used[cmd->cpus[i]])
+			continue;
+		used[cmd->cpus[i]] = true;
+
+		if (avail_fd >= 0 &&
+		    bpf_map_update_elem(avail_fd, &count, &cmd->cpus[i], 0))
+			return -1;
+		count++;
+	}
+
+	/* Written last, so the program never picks an unset index */
+	if (count_fd >= 0 && bpf_map_update_elem(count_fd, &key, &count, 0))
+		return -1;
+
+	for (i = 0; i < CPUMAP_MAX_CPUS; i++)
+		if (!used[i])
+			bpf_map_delete_elem(cpumap_fd, &i);
+
+	if (verbose) {
+		printf(" - Set up %u CPUs in cpu_map, qsize %u", count,
+		       cmd->qsize);
+		if (stage2_fd > 0)
+			printf(", second stage %s", cmd->stage2);
+		printf("\n");
+	}
+	return 0;
+}
+
+const char *pin_basedir =  "/sys/fs/bpf";
+
+int main(int argc, char **argv)
+{
+	struct cpumap_cmd cmd = {
+		.cfg = {
+			.attach_mode = XDP_MODE_NATIVE,
+			.ifindex     = -1,
+		},
+		.qsize = DEFAULT_QSIZE,
+	};
+	struct bpf_program *stage2;
+	struct xdp_program *program;
+	struct bpf_object *obj;
+	int len, stage2_fd = 0;
+
+	strncpy(cmd.cfg.filename, default_filename, sizeof(cmd.cfg.filename));
+	strncpy(cmd.cfg.progname, default_progname, sizeof(cmd.cfg.progname));
+	parse_args(argc, argv, &cmd);
+
+	if (!cmd.cfg.pin_dir[0]) {
+		len = snprintf(cmd.cfg.pin_dir, sizeof(cmd.cfg.pin_dir),
+			       "%s/%s", pin_basedir, cmd.cfg.ifname);
+		if (len < 0) {
+			fprintf(stderr, "ERR: creating pin dirname\n");
+			return EXIT_FAIL_OPTION;
+		}
+	}
+
+	/* Loads every program in the file, the second stage included */
+	program = load_and_attach(&cmd.cfg);
+	if (!program)
+		return EXIT_FAIL_BPF;
+	obj = xdp_program__bpf_obj(program);
+
+	if (cmd.stage2[0]) {
+		stage2 = bpf_object__find_program_by_name(obj, cmd.stage2);
+		if (!stage2) {
+			fprintf(stderr, "ERR: no program %s in %s\n",
+				cmd.stage2, cmd.cfg.filename);
+			goto err;
+		}
+		stage2_fd = bpf_program__fd(stage2);
+	}
+
+	if (cpumap_setup(obj, &cmd, stage2_fd))
+		goto err;
+
+	if (verbose)
+		printf("Success: Loaded %s on %s(ifindex:%d)\n",
+		       cmd.cfg.progname, cmd.cfg.ifname, cmd.cfg.ifindex);
+	return EXIT_OK;
+
+err:
+	xdp_program__detach(program, cmd.cfg.ifindex, cmd.cfg.attach_mode, 0);
+	return EXIT_FAIL_BPF;
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+#include "common_kern_user.h"
+#include "flow_hash_kern.h"
+
+/*
+ * Classifies packets in XDP and stores the result in front of the packet
+ * with bpf_xdp_adjust_meta(), for tc_meta_kern.c to apply to the SKB.
+ */
+
+/* Destination port (host byte order) to class id, see struct xdp_tc_meta */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, __u16);
+	__type(value, __u32);
+	__uint(max_entries, 1024);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} meta_class_map SEC(".maps");
+
+SEC("xdp_meta")
+int xdp_meta_func(struct xdp_md *ctx)
+{
+	struct xdp_tc_meta *meta;
+	struct flow_info flow;
+	__u32 *class_id;
+	void *data;
+	__u16 port;
+
+	if (xdp_flow_parse(ctx, &flow))
+		goto out;
+
+	/* Not all drivers support metadata; the packet goes on without */
+	if (bpf_xdp_adjust_meta(ctx, -(int)sizeof(*meta)))
+		goto out;
+
+	data = (void *)(long)ctx->data;
+	meta = (void *)(long)ctx->data_meta;
+	if ((void *)(meta + 1) > data)
+		goto out;
+
+	port = bpf_ntohs(flow.dport);
+	class_id = flow.l4_off ? bpf_map_lookup_elem(&meta_class_map, &port) :
+				 NULL;
+
+	meta->class_id = class_id ? *class_id : 0;
+	meta->flow_hash = flow.hash;
+	meta->l4_off = flow.l4_off;
+	meta->magic = XDP_TC_META_MAGIC;
+
+out:
+	return xdp_stats_record_action(ctx, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,55 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+/* Size of each VIP's Maglev lookup table. Must be prime, and should be well
+ * above 100 times the number of backends for an even spread.
+ */
+#define LB_MAGLEV_SIZE		65537
+#define LB_MAX_VIPS		32
+#define LB_MAX_BACKENDS		4096
+#define LB_CONN_MAX		262144
+
+/* lb_vip_meta.flags */
+#define LB_F_GUE		(1U << 0) /* GUE instead of IPIP/IP6IP6 */
+
+/* IPv4 addresses use addr[0] only, the rest is zero */
+struct lb_vip_key {
+	__be32 addr[4];
+	__be16 port;
+	__u8 proto;
+	__u8 family;
+};
+
+struct lb_vip_meta {
+	__u32 vip_idx;	/* selects the VIP's part of lb_maglev_map */
+	__u32 flags;
+};
+
+/* A free slot in lb_backend_map has family 0 */
+struct lb_backend {
+	__be32 addr[4];
+	__u8 family;
+	__u8 pad[3];
+};
+
+/* Outer source addresses for the encapsulated packets */
+struct lb_config {
+	__be32 saddr4;
+	__be32 saddr6[4];
+};
+
+/* Key of lb_conn_map, which keeps established flows on their backend */
+struct lb_flow_key {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 proto;
+	__u8 family;
+	__u16 pad;
+};
+
+#endif /* __COMMON_KERN_USER_H */
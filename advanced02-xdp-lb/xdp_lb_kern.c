@@ -0,0 +1,277 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+#include "common_kern_user.h"
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+
+/* from include/net/ip.h */
+#define IP_MF		0x2000
+#define IP_OFFSET	0x1fff
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct lb_vip_key);
+	__type(value, struct lb_vip_meta);
+	__uint(max_entries, LB_MAX_VIPS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} lb_vip_map SEC(".maps");
+
+/* LB_MAGLEV_SIZE backend ids per VIP, indexed by vip_idx * LB_MAGLEV_SIZE +
+ * flow hash % LB_MAGLEV_SIZE
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, LB_MAX_VIPS * LB_MAGLEV_SIZE);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} lb_maglev_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct lb_backend);
+	__uint(max_entries, LB_MAX_BACKENDS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} lb_backend_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct lb_flow_key);
+	__type(value, __u32);
+	__uint(max_entries, LB_CONN_MAX);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} lb_conn_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct lb_config);
+	__uint(max_entries, 1);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} lb_config_map SEC(".maps");
+
+/* jhash2() from include/linux/jhash.h */
+#define JHASH_INITVAL		0xdeadbeef
+
+static __always_inline __u32 rol32(__u32 word, unsigned int shift)
+{
+	return (word << shift) | (word >> ((-shift) & 31));
+}
+
+#define __jhash_mix(a, b, c)			\
+{						\
+	a -= c;  a ^= rol32(c, 4);  c += b;	\
+	b -= a;  b ^= rol32(a, 6);  a += c;	\
+	c -= b;  c ^= rol32(b, 8);  b += a;	\
+	a -= c;  a ^= rol32(c, 16); c += b;	\
+	b -= a;  b ^= rol32(a, 19); a += c;	\
+	c -= b;  c ^= rol32(b, 4);  b += a;	\
+}
+
+#define __jhash_final(a, b, c)			\
+{						\
+	c ^= b; c -= rol32(b, 14);		\
+	a ^= c; a -= rol32(c, 11);		\
+	b ^= a; b -= rol32(a, 25);		\
+	c ^= b; c -= rol32(b, 16);		\
+	a ^= c; a -= rol32(c, 4);		\
+	b ^= a; b -= rol32(a, 14);		\
+	c ^= b; c -= rol32(b, 24);		\
+}
+
+/* The flow key is 10 words: three mix rounds and one word for the final */
+static __always_inline __u32 lb_flow_hash(const struct lb_flow_key *flow)
+{
+	const __u32 *k = (const __u32 *)flow;
+	__u32 len = sizeof(*flow) / sizeof(__u32);
+	__u32 a, b, c;
+	int i;
+
+	a = b = c = JHASH_INITVAL + (len << 2);
+
+	#pragma unroll
+	for (i = 0; i < 3; i++) {
+		a += k[0];
+		b += k[1];
+		c += k[2];
+		__jhash_mix(a, b, c);
+		k += 3;
+	}
+	a += k[0];
+	__jhash_final(a, b, c);
+
+	return c;
+}
+
+/* Picks the backend for a flow: the one it used before if it is still
+ * there, otherwise the one Maglev assigns to it. Returns NULL if the VIP has
+ * no usable backend.
+ */
+static __always_inline struct lb_backend *lb_pick_backend(struct lb_flow_key *flow,
+							  struct lb_vip_meta *vip,
+							  __u32 hash)
+{
+	struct lb_backend *be;
+	__u32 *be_id, slot;
+
+	be_id = bpf_map_lookup_elem(&lb_conn_map, flow);
+	if (be_id) {
+		be = bpf_map_lookup_elem(&lb_backend_map, be_id);
+		if (be && be->family)
+			return be;
+	}
+
+	if (vip->vip_idx >= LB_MAX_VIPS)
+		return NULL;
+
+	slot = vip->vip_idx * LB_MAGLEV_SIZE + hash % LB_MAGLEV_SIZE;
+	be_id = bpf_map_lookup_elem(&lb_maglev_map, &slot);
+	if (!be_id)
+		return NULL;
+
+	be = bpf_map_lookup_elem(&lb_backend_map, be_id);
+	if (!be || !be->family)
+		return NULL;
+
+	bpf_map_update_elem(&lb_conn_map, flow, be_id, BPF_ANY);
+	return be;
+}
+
+static __always_inline int lb_encap(struct xdp_md *ctx, struct lb_config *cfg,
+				    struct lb_vip_meta *vip,
+				    struct lb_backend *be, __u32 hash)
+{
+	/* The source port carries flow entropy for ECMP/RSS on the way */
+	__be16 sport = bpf_htons((hash & 0x3fff) | 0xc000);
+
+	if (be->family == AF_INET) {
+		if (vip->flags & LB_F_GUE)
+			return gue_encap_ipv4(ctx, cfg->saddr4, be->addr[0],
+					      sport);
+		return ipip_encap(ctx, cfg->saddr4, be->addr[0]);
+	}
+
+	if (vip->flags & LB_F_GUE)
+		return gue_encap_ipv6(ctx, (struct in6_addr *)cfg->saddr6,
+				      (struct in6_addr *)be->addr, sport);
+	return ip6ip6_encap(ctx, (struct in6_addr *)cfg->saddr6,
+			    (struct in6_addr *)be->addr);
+}
+
+SEC("xdp_lb")
+int xdp_lb_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct lb_flow_key flow = {};
+	struct lb_vip_key vip_key = {};
+	struct ipv6_frag_info frag;
+	struct lb_vip_meta *vip;
+	struct lb_backend *be;
+	struct lb_config *cfg;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+	struct iphdr *iph;
+	struct ethhdr *eth;
+	int action = XDP_PASS;
+	int eth_type, ip_type;
+	__u32 key = 0, hash;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+		if (ip_type < 0)
+			goto out;
+		/* Fragments would hash differently from the rest of the flow */
+		if (iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+			goto out;
+
+		flow.family = AF_INET;
+		flow.saddr[0] = iph->saddr;
+		flow.daddr[0] = iph->daddr;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ip6h, &frag);
+		if (ip_type < 0 || frag.is_frag)
+			goto out;
+
+		flow.family = AF_INET6;
+		__builtin_memcpy(flow.saddr, &ip6h->saddr, sizeof(flow.saddr));
+		__builtin_memcpy(flow.daddr, &ip6h->daddr, sizeof(flow.daddr));
+	} else {
+		goto out;
+	}
+
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(&nh, data_end, &tcph) < 0)
+			goto out;
+		flow.sport = tcph->source;
+		flow.dport = tcph->dest;
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udph) < 0)
+			goto out;
+		flow.sport = udph->source;
+		flow.dport = udph->dest;
+	} else {
+		goto out;
+	}
+	flow.proto = ip_type;
+
+	__builtin_memcpy(vip_key.addr, flow.daddr, sizeof(vip_key.addr));
+	vip_key.port = flow.dport;
+	vip_key.proto = flow.proto;
+	vip_key.family = flow.family;
+
+	vip = bpf_map_lookup_elem(&lb_vip_map, &vip_key);
+	if (!vip)
+		goto out;
+
+	cfg = bpf_map_lookup_elem(&lb_config_map, &key);
+	if (!cfg)
+		goto out;
+
+	hash = lb_flow_hash(&flow);
+	be = lb_pick_backend(&flow, vip, hash);
+	if (!be) {
+		action = XDP_DROP;
+		goto out;
+	}
+
+	if (lb_encap(ctx, cfg, vip, be, hash)) {
+		action = XDP_DROP;
+		goto out;
+	}
+
+	/* Send it back where it came from, i.e. to the router */
+	data_end = (void *)(long)ctx->data_end;
+	eth = (void *)(long)ctx->data;
+	if (eth + 1 > data_end) {
+		action = XDP_DROP;
+		goto out;
+	}
+	swap_src_dst_mac(eth);
+	action = XDP_TX;
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
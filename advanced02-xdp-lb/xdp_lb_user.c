@@ -0,0 +1,672 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "XDP load balancer control\n"
+	" - Configures a VIP and its backends, rebuilding the Maglev table\n"
+	" - Run again with a new backend list to change it; flows to the\n"
+	"   remaining backends are not moved\n"
+	" - --delete removes the VIP, or with --backend only those backends\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+
+#include "common_kern_user.h"
+
+#define MAX_VIP_BACKENDS 256
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",        no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",         required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"vip",         required_argument,	NULL, 'v' },
+	 "Virtual IPv4/IPv6 address", "<addr>", true},
+
+	{{"port",        required_argument,	NULL, 'p' },
+	 "Virtual port", "<port>", true},
+
+	{{"udp",         no_argument,		NULL, 'u' },
+	 "VIP is UDP (default TCP)"},
+
+	{{"backend",     required_argument,	NULL, 'b' },
+	 "Backend address (repeat for each backend)", "<addr>"},
+
+	{{"gue",         no_argument,		NULL, 'g' },
+	 "Encapsulate in GUE instead of IPIP/IP6IP6"},
+
+	{{"src",         required_argument,	NULL, 's' },
+	 "Outer source address (IPv4 and/or IPv6)", "<addr>"},
+
+	{{"delete",      no_argument,		NULL, 'D' },
+	 "Remove the VIP, or only the given backends"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+struct lb_cmd {
+	struct config cfg;
+	struct lb_vip_key vip;
+	struct lb_backend backends[MAX_VIP_BACKENDS];
+	int num_backends;
+	struct lb_config lb_cfg;
+	bool have_src4;
+	bool have_src6;
+	bool gue;
+	bool delete;
+};
+
+struct lb_maps {
+	int vip_fd;
+	int maglev_fd;
+	int backend_fd;
+	int conn_fd;
+	int config_fd;
+};
+
+static int parse_addr(const char *str, __be32 addr[4], __u8 *family)
+{
+	memset(addr, 0, 4 * sizeof(__be32));
+
+	if (inet_pton(AF_INET6, str, addr) == 1) {
+		*family = AF_INET6;
+		return 0;
+	}
+	if (inet_pton(AF_INET, str, addr) == 1) {
+		*family = AF_INET;
+		return 0;
+	}
+	return -1;
+}
+
+static void parse_args(int argc, char **argv, struct lb_cmd *cmd)
+{
+	struct option long_opts[sizeof(long_options) / sizeof(long_options[0])];
+	struct lb_backend *be;
+	__be32 addr[4];
+	__u8 family;
+	int i, opt;
+	char *end;
+	long port;
+
+	for (i = 0; long_options[i].option.name; i++)
+		long_opts[i] = long_options[i].option;
+	memset(&long_opts[i], 0, sizeof(long_opts[i]));
+
+	cmd->vip.proto = IPPROTO_TCP;
+
+	while ((opt = getopt_long(argc, argv, "hd:v:p:ub:gs:D",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --dev name too long\n");
+				goto error;
+			}
+			cmd->cfg.ifname = cmd->cfg.ifname_buf;
+			strncpy(cmd->cfg.ifname, optarg, IF_NAMESIZE);
+			cmd->cfg.ifindex = if_nametoindex(cmd->cfg.ifname);
+			if (cmd->cfg.ifindex == 0) {
+				fprintf(stderr,
+					"ERR: --dev name unknown err(%d):%s\n",
+					errno, strerror(errno));
+				goto error;
+			}
+			break;
+		case 'v':
+			if (parse_addr(optarg, cmd->vip.addr, &cmd->vip.family)) {
+				fprintf(stderr, "ERR: bad VIP %s\n", optarg);
+				goto error;
+			}
+			break;
+		case 'p':
+			errno = 0;
+			port = strtol(optarg, &end, 10);
+			if (errno || end == optarg || *end ||
+			    port < 1 || port > 65535) {
+				fprintf(stderr, "ERR: bad port %s\n", optarg);
+				goto error;
+			}
+			cmd->vip.port = htons(port);
+			break;
+		case 'u':
+			cmd->vip.proto = IPPROTO_UDP;
+			break;
+		case 'b':
+			if (cmd->num_backends >= MAX_VIP_BACKENDS) {
+				fprintf(stderr, "ERR: too many backends\n");
+				goto error;
+			}
+			be = &cmd->backends[cmd->num_backends++];
+			if (parse_addr(optarg, be->addr, &be->family)) {
+				fprintf(stderr, "ERR: bad backend %s\n", optarg);
+				goto error;
+			}
+			break;
+		case 'g':
+			cmd->gue = true;
+			break;
+		case 's':
+			if (parse_addr(optarg, addr, &family)) {
+				fprintf(stderr, "ERR: bad source %s\n", optarg);
+				goto error;
+			}
+			if (family == AF_INET) {
+				cmd->lb_cfg.saddr4 = addr[0];
+				cmd->have_src4 = true;
+			} else {
+				memcpy(cmd->lb_cfg.saddr6, addr, sizeof(addr));
+				cmd->have_src6 = true;
+			}
+			break;
+		case 'D':
+			cmd->delete = true;
+			break;
+		case 'h':
+			usage(argv[0], __doc__, long_options, true);
+			exit(EXIT_OK);
+		default:
+			goto error;
+		}
+	}
+
+	if (cmd->cfg.ifindex <= 0 || !cmd->vip.family || !cmd->vip.port) {
+		fprintf(stderr, "ERR: required option --dev, --vip or --port missing\n\n");
+		goto error;
+	}
+	if (!cmd->delete && !cmd->num_backends) {
+		fprintf(stderr, "ERR: at least one --backend is required\n\n");
+		goto error;
+	}
+	return;
+
+error:
+	usage(argv[0], __doc__, long_options, (argc == 1));
+	exit(EXIT_FAIL_OPTION);
+}
+
+/* FNV-1a, seeded; only used to derive the Maglev permutations */
+static __u64 maglev_hash(const void *data, size_t len, __u64 seed)
+{
+	const __u8 *p = data;
+	__u64 h = 0xcbf29ce484222325ULL ^ seed;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+/*
+ * Populates table with backend ids, following "Maglev: A Fast and Reliable
+ * Software Network Load Balancer" (NSDI '16), section 3.4. Each backend
+ * walks its own permutation of the table, derived from its address only,
+ * and claims the next free slot in turn. The permutations do not depend on
+ * the other backends, so adding or removing one only moves a small share of
+ * the slots.
+ */
+static void maglev_build(const struct lb_backend *backends, const __u32 *ids,
+			 int n, __u32 *table)
+{
+	__u32 offset[MAX_VIP_BACKENDS], skip[MAX_VIP_BACKENDS];
+	__u32 next[MAX_VIP_BACKENDS];
+	__u32 filled = 0, c;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		offset[i] = maglev_hash(backends[i].addr,
+					sizeof(backends[i].addr), 0) %
+			    LB_MAGLEV_SIZE;
+		skip[i] = maglev_hash(backends[i].addr,
+				      sizeof(backends[i].addr), 1) %
+			  (LB_MAGLEV_SIZE - 1) + 1;
+		next[i] = 0;
+	}
+
+	memset(table, 0xff, LB_MAGLEV_SIZE * sizeof(*table));
+
+	while (1) {
+		for (i = 0; i < n; i++) {
+			do {
+				c = (offset[i] + (__u64)next[i] * skip[i]) %
+				    LB_MAGLEV_SIZE;
+				next[i]++;
+			} while (table[c] != (__u32)-1);
+
+			table[c] = ids[i];
+			if (++filled == LB_MAGLEV_SIZE)
+				return;
+		}
+	}
+}
+
+static int open_maps(const char *pin_dir, struct lb_maps *maps)
+{
+	maps->vip_fd = open_bpf_map_file(pin_dir, "lb_vip_map", NULL);
+	maps->maglev_fd = open_bpf_map_file(pin_dir, "lb_maglev_map", NULL);
+	maps->backend_fd = open_bpf_map_file(pin_dir, "lb_backend_map", NULL);
+	maps->conn_fd = open_bpf_map_file(pin_dir, "lb_conn_map", NULL);
+	maps->config_fd = open_bpf_map_file(pin_dir, "lb_config_map", NULL);
+
+	if (maps->vip_fd < 0 || maps->maglev_fd < 0 || maps->backend_fd < 0 ||
+	    maps->conn_fd < 0 || maps->config_fd < 0)
+		return -1;
+	return 0;
+}
+
+/* Returns the existing backend id for the address, or a newly filled slot */
+static int backend_get_id(int fd, const struct lb_backend *be, __u32 *id)
+{
+	struct lb_backend cur;
+	__u32 i, free_id = (__u32)-1;
+
+	for (i = 0; i < LB_MAX_BACKENDS; i++) {
+		if (bpf_map_lookup_elem(fd, &i, &cur))
+			return -1;
+		if (!cur.family) {
+			if (free_id == (__u32)-1)
+				free_id = i;
+			continue;
+		}
+		if (cur.family == be->family &&
+		    !memcmp(cur.addr, be->addr, sizeof(cur.addr))) {
+			*id = i;
+			return 0;
+		}
+	}
+
+	if (free_id == (__u32)-1) {
+		fprintf(stderr, "ERR: no free backend slots\n");
+		return -1;
+	}
+	if (bpf_map_update_elem(fd, &free_id, be, 0))
+		return -1;
+	*id = free_id;
+	return 0;
+}
+
+/* Reads the VIP's part of lb_maglev_map into table */
+static int maglev_read(int fd, __u32 vip_idx, __u32 *table)
+{
+	__u32 i, key;
+
+	for (i = 0; i < LB_MAGLEV_SIZE; i++) {
+		key = vip_idx * LB_MAGLEV_SIZE + i;
+		if (bpf_map_lookup_elem(fd, &key, &table[i]))
+			return -1;
+	}
+	return 0;
+}
+
+/*
+ * Replaces the n backends in backends[] with the ones the VIP's table uses,
+ * less those n, in id order, and fills in their ids. Returns the number of
+ * backends left, or -1 if one of the n is not a backend of the VIP.
+ */
+static int vip_backends_remove(int fd, const __u32 *table,
+			       struct lb_backend *backends, int n, __u32 *ids)
+{
+	struct lb_backend del[MAX_VIP_BACKENDS], be;
+	int i, found = 0, left = 0;
+	__u32 id, slot;
+	bool *used;
+
+	used = calloc(LB_MAX_BACKENDS, sizeof(*used));
+	if (!used)
+		return -1;
+	memcpy(del, backends, n * sizeof(*backends));
+
+	for (slot = 0; slot < LB_MAGLEV_SIZE; slot++)
+		if (table[slot] < LB_MAX_BACKENDS)
+			used[table[slot]] = true;
+
+	for (id = 0; id < LB_MAX_BACKENDS; id++) {
+		if (!used[id])
+			continue;
+		if (bpf_map_lookup_elem(fd, &id, &be))
+			goto err;
+
+		for (i = 0; i < n; i++)
+			if (del[i].family == be.family &&
+			    !memcmp(del[i].addr, be.addr, sizeof(be.addr)))
+				break;
+		if (i < n) {
+			found++;
+			continue;
+		}
+
+		if (left == MAX_VIP_BACKENDS)
+			goto err;
+		backends[left] = be;
+		ids[left++] = id;
+	}
+	free(used);
+
+	if (found < n) {
+		fprintf(stderr, "ERR: not all --backend are backends of the VIP\n");
+		return -1;
+	}
+	return left;
+
+err:
+	free(used);
+	return -1;
+}
+
+/* Finds the VIP's index, or the lowest unused one for a new VIP */
+static int vip_get_idx(int fd, const struct lb_vip_key *vip, __u32 *idx,
+		       bool *exists)
+{
+	bool used[LB_MAX_VIPS] = {};
+	struct lb_vip_key key, *prev = NULL;
+	struct lb_vip_meta meta;
+	__u32 i;
+
+	*exists = false;
+	while (!bpf_map_get_next_key(fd, prev, &key)) {
+		prev = &key;
+		if (bpf_map_lookup_elem(fd, &key, &meta))
+			continue;
+		if (meta.vip_idx < LB_MAX_VIPS)
+			used[meta.vip_idx] = true;
+		if (!memcmp(&key, vip, sizeof(key))) {
+			*idx = meta.vip_idx;
+			*exists = true;
+			return 0;
+		}
+	}
+
+	for (i = 0; i < LB_MAX_VIPS; i++) {
+		if (!used[i]) {
+			*idx = i;
+			return 0;
+		}
+	}
+	fprintf(stderr, "ERR: no free VIP slots\n");
+	return -1;
+}
+
+/*
+ * Writes the new table over the VIP's part of lb_maglev_map, touching only
+ * slots that change, so in-flight lookups see either the old or the new
+ * backend for a slot. Fills removed[] with the old backend ids that are no
+ * longer used.
+ */
+static int maglev_update(int fd, __u32 vip_idx, const __u32 *table,
+			 bool *removed)
+{
+	__u32 base = vip_idx * LB_MAGLEV_SIZE;
+	__u32 i, key, cur, changed = 0;
+	bool *kept = calloc(LB_MAX_BACKENDS, sizeof(*kept));
+
+	if (!kept)
+		return -1;
+
+	for (i = 0; i < LB_MAGLEV_SIZE; i++)
+		if (table[i] < LB_MAX_BACKENDS)
+			kept[table[i]] = true;
+
+	for (i = 0; i < LB_MAGLEV_SIZE; i++) {
+		key = base + i;
+		if (bpf_map_lookup_elem(fd, &key, &cur))
+			goto err;
+		if (cur < LB_MAX_BACKENDS && !kept[cur])
+			removed[cur] = true;
+		if (cur == table[i])
+			continue;
+		if (bpf_map_update_elem(fd, &key, &table[i], 0))
+			goto err;
+		changed++;
+	}
+
+	if (verbose)
+		printf("Maglev table: %u of %u slots changed\n",
+		       changed, LB_MAGLEV_SIZE);
+	free(kept);
+	return 0;
+
+err:
+	free(kept);
+	return -1;
+}
+
+/* Drops the connection entries of the VIP (of any VIP if vip is NULL) that
+ * point at a removed backend, so those flows are rehashed; all other flows
+ * keep their backend.
+ */
+static void conn_flush_removed(int fd, const struct lb_vip_key *vip,
+			       const bool *removed)
+{
+	struct lb_flow_key key, next;
+	bool have_key = false;
+	int flushed = 0;
+	__u32 be_id;
+
+	while (!bpf_map_get_next_key(fd, have_key ? &key : NULL, &next)) {
+		if ((!vip ||
+		     (next.family == vip->family && next.proto == vip->proto &&
+		      next.dport == vip->port &&
+		      !memcmp(next.daddr, vip->addr, sizeof(next.daddr)))) &&
+		    !bpf_map_lookup_elem(fd, &next, &be_id) &&
+		    be_id < LB_MAX_BACKENDS && removed[be_id]) {
+			/* Deleting next would break the iteration from it */
+			bpf_map_delete_elem(fd, &next);
+			flushed++;
+			continue;
+		}
+		key = next;
+		have_key = true;
+	}
+
+	if (verbose && flushed)
+		printf("Flushed %d connections to removed backends\n", flushed);
+}
+
+/*
+ * Frees the lb_backend_map slots that no VIP's table refers to any more, so
+ * backend_get_id() can hand out their ids again, and drops the connection
+ * entries still pointing at them. table is only used as scratch space.
+ */
+static int backend_gc(const struct lb_maps *maps, __u32 *table)
+{
+	struct lb_vip_key key, *prev = NULL;
+	struct lb_backend be, empty = {};
+	struct lb_vip_meta meta;
+	bool *used, *freed_ids;
+	int freed = 0, err = -1;
+	__u32 i;
+
+	used = calloc(LB_MAX_BACKENDS, sizeof(*used));
+	freed_ids = calloc(LB_MAX_BACKENDS, sizeof(*freed_ids));
+	if (!used || !freed_ids)
+		goto out;
+
+	while (!bpf_map_get_next_key(maps->vip_fd, prev, &key)) {
+		prev = &key;
+		if (bpf_map_lookup_elem(maps->vip_fd, &key, &meta) ||
+		    meta.vip_idx >= LB_MAX_VIPS)
+			continue;
+		if (maglev_read(maps->maglev_fd, meta.vip_idx, table))
+			goto out;
+		for (i = 0; i < LB_MAGLEV_SIZE; i++)
+			if (table[i] < LB_MAX_BACKENDS)
+				used[table[i]] = true;
+	}
+
+	/* A cleared slot already stops the conn entries from being used */
+	for (i = 0; i < LB_MAX_BACKENDS; i++) {
+		if (used[i] || bpf_map_lookup_elem(maps->backend_fd, &i, &be) ||
+		    !be.family)
+			continue;
+		if (bpf_map_update_elem(maps->backend_fd, &i, &empty, 0))
+			goto out;
+		freed_ids[i] = true;
+		freed++;
+	}
+
+	if (freed) {
+		conn_flush_removed(maps->conn_fd, NULL, freed_ids);
+		if (verbose)
+			printf("Freed %d backend slots\n", freed);
+	}
+	err = 0;
+
+out:
+	free(used);
+	free(freed_ids);
+	return err;
+}
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+const char *pin_basedir =  "/sys/fs/bpf";
+
+int main(int argc, char **argv)
+{
+	struct lb_cmd cmd = { .cfg = { .ifindex = -1 } };
+	__u32 ids[MAX_VIP_BACKENDS], vip_idx, key = 0;
+	struct lb_config lb_cfg;
+	struct lb_vip_meta meta;
+	char pin_dir[PATH_MAX];
+	struct lb_maps maps;
+	bool *removed = NULL;
+	__u32 *table = NULL;
+	int i, len, err = EXIT_FAIL_BPF;
+	bool exists;
+
+	parse_args(argc, argv, &cmd);
+
+	len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, cmd.cfg.ifname);
+	if (len < 0) {
+		fprintf(stderr, "ERR: creating pin dirname\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (open_maps(pin_dir, &maps))
+		return EXIT_FAIL_BPF;
+
+	if (vip_get_idx(maps.vip_fd, &cmd.vip, &vip_idx, &exists))
+		return EXIT_FAIL_BPF;
+
+	if (cmd.delete && !exists) {
+		fprintf(stderr, "ERR: no such VIP\n");
+		return EXIT_FAIL;
+	}
+
+	table = malloc(LB_MAGLEV_SIZE * sizeof(*table));
+	removed = calloc(LB_MAX_BACKENDS, sizeof(*removed));
+	if (!table || !removed) {
+		err = EXIT_FAIL;
+		goto out;
+	}
+
+	if (cmd.delete && !cmd.num_backends) {
+		if (bpf_map_delete_elem(maps.vip_fd, &cmd.vip)) {
+			fprintf(stderr, "ERR: deleting VIP: %s\n", strerror(errno));
+			goto out;
+		}
+		/* No packet gets to the VIP's table now, so empty it */
+		memset(table, 0xff, LB_MAGLEV_SIZE * sizeof(*table));
+		goto update;
+	}
+
+	/* Outer source addresses are shared by all VIPs */
+	if (cmd.have_src4 || cmd.have_src6) {
+		if (bpf_map_lookup_elem(maps.config_fd, &key, &lb_cfg))
+			goto out;
+		if (cmd.have_src4)
+			lb_cfg.saddr4 = cmd.lb_cfg.saddr4;
+		if (cmd.have_src6)
+			memcpy(lb_cfg.saddr6, cmd.lb_cfg.saddr6,
+			       sizeof(lb_cfg.saddr6));
+		if (bpf_map_update_elem(maps.config_fd, &key, &lb_cfg, 0))
+			goto out;
+	}
+
+	if (cmd.delete) {
+		if (maglev_read(maps.maglev_fd, vip_idx, table)) {
+			fprintf(stderr, "ERR: reading Maglev table: %s\n",
+				strerror(errno));
+			goto out;
+		}
+		cmd.num_backends = vip_backends_remove(maps.backend_fd, table,
+						       cmd.backends,
+						       cmd.num_backends, ids);
+		if (cmd.num_backends < 0)
+			goto out;
+		if (!cmd.num_backends) {
+			fprintf(stderr, "ERR: that leaves no backends,"
+				" use --delete without --backend\n");
+			err = EXIT_FAIL;
+			goto out;
+		}
+	} else {
+		for (i = 0; i < cmd.num_backends; i++) {
+			if (backend_get_id(maps.backend_fd, &cmd.backends[i],
+					   &ids[i])) {
+				fprintf(stderr, "ERR: adding backend %d\n", i);
+				goto out;
+			}
+		}
+	}
+
+	maglev_build(cmd.backends, ids, cmd.num_backends, table);
+
+update:
+	/* The table is complete before a new VIP becomes visible */
+	if (maglev_update(maps.maglev_fd, vip_idx, table, removed)) {
+		fprintf(stderr, "ERR: updating Maglev table: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	/* Removing backends keeps the VIP, and its flags, as they are */
+	if (!cmd.delete) {
+		meta.vip_idx = vip_idx;
+		meta.flags = cmd.gue ? LB_F_GUE : 0;
+		if (bpf_map_update_elem(maps.vip_fd, &cmd.vip, &meta, 0)) {
+			fprintf(stderr, "ERR: updating VIP: %s\n",
+				strerror(errno));
+			goto out;
+		}
+	}
+
+	if (exists)
+		conn_flush_removed(maps.conn_fd, &cmd.vip, removed);
+
+	if (backend_gc(&maps, table)) {
+		fprintf(stderr, "ERR: freeing unused backends: %s\n",
+			strerror(errno));
+		goto out;
+	}
+
+	if (verbose && cmd.num_backends)
+		printf("VIP slot %u: %d backends\n", vip_idx, cmd.num_backends);
+	err = EXIT_OK;
+
+out:
+	free(table);
+	free(removed);
+	return err;
+}
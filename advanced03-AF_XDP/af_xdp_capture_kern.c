@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <linux/bpf.h>
+
+#include <bpf/bpf_helpers.h>
+
+#include "../common/xdp_filter_kern_user.h"
+#include "../common/xdp_filter_kern.h"
+
+#include "common_kern_user.h"
+
+struct {
+	__uint(type, BPF_MAP_TYPE_XSKMAP);
+	__type(key, __u32);
+	__type(value, __u32);
+	__uint(max_entries, CAPTURE_MAX_QUEUES);
+} xsks_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct capture_config);
+	__uint(max_entries, 1);
+} capture_config_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct capture_stats);
+	__uint(max_entries, 1);
+} capture_stats_map SEC(".maps");
+
+/* Steers the packets that pass the capture filter into the AF_XDP socket of
+ * their RX queue. Everything else goes on to the network stack.
+ */
+SEC("xdp")
+int xdp_capture_prog(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	__u32 index = ctx->rx_queue_index;
+	struct capture_config *cfg;
+	struct capture_stats *stats;
+	__u32 key = 0;
+
+	cfg = bpf_map_lookup_elem(&capture_config_map, &key);
+	stats = bpf_map_lookup_elem(&capture_stats_map, &key);
+	if (!cfg || !stats || !cfg->enabled)
+		return XDP_PASS;
+
+	if (!xdp_filter_match(data, data_end, cfg->nr_rules))
+		return XDP_PASS;
+	stats->matched++;
+
+	if (!bpf_map_lookup_elem(&xsks_map, &index)) {
+		stats->no_socket++;
+		return XDP_PASS;
+	}
+	return bpf_redirect_map(&xsks_map, index, 0);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,555 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <xdp/xsk.h>
+#include <xdp/libxdp.h>
+
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+#include "../common/xdp_filter_user.h"
+
+#include "common_kern_user.h"
+
+static const char *__doc__ = "AF_XDP capture to pcap\n"
+	" - Captures the packets that match the filter expression after the\n"
+	"   options on --queues RX queues, and writes them to a pcap file:\n"
+	XDP_FILTER_USAGE;
+
+#define NUM_FRAMES         4096
+#define FRAME_SIZE         XSK_UMEM__DEFAULT_FRAME_SIZE
+#define RX_BATCH_SIZE      256 /* 2 iovecs each, well within IOV_MAX */
+
+/* pcap file format with nanosecond timestamps */
+#define PCAP_MAGIC_NSEC    0xa1b23c4d
+#define PCAP_LINKTYPE_ETHERNET 1
+
+struct pcap_file_hdr {
+	__u32 magic;
+	__u16 version_major;
+	__u16 version_minor;
+	__s32 thiszone;
+	__u32 sigfigs;
+	__u32 snaplen;
+	__u32 linktype;
+};
+
+struct pcap_rec_hdr {
+	__u32 ts_sec;
+	__u32 ts_nsec;
+	__u32 caplen;
+	__u32 len;
+};
+
+/* One AF_XDP socket per RX queue, each with its own UMEM, drained by its own
+ * thread. A batch of frames goes to the file with a single writev(), straight
+ * from the UMEM, and the frames go back on the fill ring right after.
+ */
+struct capture_queue {
+	pthread_t thread;
+	int queue_id;
+	void *buffer;
+	struct xsk_umem *umem;
+	struct xsk_ring_prod fq;
+	struct xsk_ring_cons cq;
+	struct xsk_ring_cons rx;
+	struct xsk_socket *xsk;
+
+	__u64 packets;
+	__u64 bytes;
+	__u64 write_errors;	/* packets lost to write errors */
+
+	struct pcap_rec_hdr hdrs[RX_BATCH_SIZE];
+	struct iovec iov[2 * RX_BATCH_SIZE];
+};
+
+static struct config cfg = {
+	.ifindex   = -1,
+};
+static struct xdp_filter_rule rules[XDP_FILTER_RULES_MAX];
+static struct capture_config capture_cfg;
+static struct capture_queue *queues;
+static int nr_queues = 1;
+static struct xdp_program *prog;
+static volatile bool global_exit;
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static int out_fd = -1;
+
+static const char *default_filename = "capture.pcap";
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",	 no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",	 required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"queues",	 required_argument,	NULL, 'Q' },
+	 "Capture on RX queues 0 to <n>-1, default=1", "<n>"},
+
+	{{"skb-mode",	 no_argument,		NULL, 'S' },
+	 "Install XDP program in SKB (AKA generic) mode"},
+
+	{{"native-mode", no_argument,		NULL, 'N' },
+	 "Install XDP program in native mode"},
+
+	{{"copy",        no_argument,		NULL, 'c' },
+	 "Force copy mode"},
+
+	{{"zero-copy",	 no_argument,		NULL, 'z' },
+	 "Force zero-copy mode"},
+
+	{{"filename",    required_argument,	NULL,  1  },
+	 "Write the capture to <file>", "<file>"},
+
+	{{"quiet",	 no_argument,		NULL, 'q' },
+	 "Quiet mode (no output)"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+static void parse_args(int argc, char **argv)
+{
+	struct option long_opts[sizeof(long_options) / sizeof(long_options[0])];
+	int i, opt;
+
+	for (i = 0; long_options[i].option.name; i++)
+		long_opts[i] = long_options[i].option;
+	memset(&long_opts[i], 0, sizeof(long_opts[i]));
+
+	while ((opt = getopt_long(argc, argv, "hd:Q:SNczq",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --dev name too long\n");
+				goto error;
+			}
+			cfg.ifname = cfg.ifname_buf;
+			strncpy(cfg.ifname, optarg, IF_NAMESIZE);
+			cfg.ifindex = if_nametoindex(cfg.ifname);
+			if (cfg.ifindex == 0) {
+				fprintf(stderr,
+					"ERR: --dev name unknown err(%d):%s\n",
+					errno, strerror(errno));
+				goto error;
+			}
+			break;
+		case 'Q':
+			nr_queues = atoi(optarg);
+			if (nr_queues < 1 || nr_queues > CAPTURE_MAX_QUEUES) {
+				fprintf(stderr, "ERR: --queues must be 1-%d\n",
+					CAPTURE_MAX_QUEUES);
+				goto error;
+			}
+			break;
+		case 'S':
+			cfg.attach_mode = XDP_MODE_SKB;
+			cfg.xsk_bind_flags &= ~XDP_ZEROCOPY;
+			cfg.xsk_bind_flags |= XDP_COPY;
+			break;
+		case 'N':
+			cfg.attach_mode = XDP_MODE_NATIVE;
+			break;
+		case 'c':
+			cfg.xsk_bind_flags &= ~XDP_ZEROCOPY;
+			cfg.xsk_bind_flags |= XDP_COPY;
+			break;
+		case 'z':
+			cfg.xsk_bind_flags &= ~XDP_COPY;
+			cfg.xsk_bind_flags |= XDP_ZEROCOPY;
+			break;
+		case 1: /* --filename */
+			strncpy(cfg.filename, optarg, sizeof(cfg.filename) - 1);
+			break;
+		case 'q':
+			verbose = false;
+			break;
+		case 'h':
+			usage(argv[0], __doc__, long_options, true);
+			exit(EXIT_OK);
+		default:
+			goto error;
+		}
+	}
+
+	if (cfg.ifindex == -1) {
+		fprintf(stderr, "ERR: required option --dev missing\n");
+		goto error;
+	}
+
+	capture_cfg.nr_rules = xdp_filter_compile(argv + optind, argc - optind,
+						  rules);
+	if ((int)capture_cfg.nr_rules < 0)
+		exit(EXIT_FAIL_OPTION);
+	return;
+
+error:
+	usage(argv[0], __doc__, long_options, (argc == 1));
+	exit(EXIT_FAIL_OPTION);
+}
+
+static int write_pcap_header(void)
+{
+	struct pcap_file_hdr hdr = {
+		.magic = PCAP_MAGIC_NSEC,
+		.version_major = 2,
+		.version_minor = 4,
+		.snaplen = FRAME_SIZE,
+		.linktype = PCAP_LINKTYPE_ETHERNET,
+	};
+
+	return write(out_fd, &hdr, sizeof(hdr)) == sizeof(hdr) ? 0 : -1;
+}
+
+/* writev() the whole iovec, picking up after short writes */
+static int writev_all(int fd, struct iovec *iov, int cnt)
+{
+	ssize_t n;
+
+	while (cnt) {
+		n = writev(fd, iov, cnt);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (cnt && (size_t)n >= iov->iov_len) {
+			n -= iov->iov_len;
+			iov++;
+			cnt--;
+		}
+		if (cnt) {
+			iov->iov_base = (char *)iov->iov_base + n;
+			iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+static int setup_queue(struct capture_queue *q, int xsks_map_fd)
+{
+	struct xsk_umem_config umem_cfg = {
+		.fill_size = NUM_FRAMES,
+		.comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.frame_size = FRAME_SIZE,
+		.frame_headroom = XSK_UMEM__DEFAULT_FRAME_HEADROOM,
+	};
+	struct xsk_socket_config xsk_cfg = {
+		.rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+		.libbpf_flags = XSK_LIBBPF_FLAGS__INHIBIT_PROG_LOAD,
+		.bind_flags = cfg.xsk_bind_flags | XDP_USE_NEED_WAKEUP,
+	};
+	__u32 idx, i;
+	int ret;
+
+	if (posix_memalign(&q->buffer, getpagesize(), NUM_FRAMES * FRAME_SIZE))
+		return -ENOMEM;
+
+	ret = xsk_umem__create(&q->umem, q->buffer, NUM_FRAMES * FRAME_SIZE,
+			       &q->fq, &q->cq, &umem_cfg);
+	if (ret)
+		return ret;
+
+	/* Capture only, so there is no TX ring */
+	ret = xsk_socket__create(&q->xsk, cfg.ifname, q->queue_id, q->umem,
+				 &q->rx, NULL, &xsk_cfg);
+	if (ret)
+		return ret;
+
+	ret = xsk_socket__update_xskmap(q->xsk, xsks_map_fd);
+	if (ret)
+		return ret;
+
+	/* The whole UMEM goes on the fill ring, and every frame comes back
+	 * to it as soon as it is written out
+	 */
+	if (xsk_ring_prod__reserve(&q->fq, NUM_FRAMES, &idx) != NUM_FRAMES)
+		return -ENOSPC;
+	for (i = 0; i < NUM_FRAMES; i++)
+		*xsk_ring_prod__fill_addr(&q->fq, idx++) = i * FRAME_SIZE;
+	xsk_ring_prod__submit(&q->fq, NUM_FRAMES);
+
+	return 0;
+}
+
+static void capture_batch(struct capture_queue *q, __u32 idx_rx, __u32 rcvd)
+{
+	const struct xdp_desc *desc;
+	struct timespec ts;
+	__u32 i, idx_fq;
+
+	/* AF_XDP frames carry no timestamp, so the batch shares one */
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	for (i = 0; i < rcvd; i++) {
+		desc = xsk_ring_cons__rx_desc(&q->rx, idx_rx + i);
+
+		q->hdrs[i].ts_sec = ts.tv_sec;
+		q->hdrs[i].ts_nsec = ts.tv_nsec;
+		q->hdrs[i].caplen = desc->len;
+		q->hdrs[i].len = desc->len;
+
+		q->iov[2 * i].iov_base = &q->hdrs[i];
+		q->iov[2 * i].iov_len = sizeof(q->hdrs[i]);
+		q->iov[2 * i + 1].iov_base = xsk_umem__get_data(q->buffer,
+								desc->addr);
+		q->iov[2 * i + 1].iov_len = desc->len;
+		q->bytes += desc->len;
+	}
+	q->packets += rcvd;
+
+	pthread_mutex_lock(&out_lock);
+	if (writev_all(out_fd, q->iov, 2 * rcvd))
+		q->write_errors += rcvd;
+	pthread_mutex_unlock(&out_lock);
+
+	/* The frames are in the page cache now, hand them back */
+	while (xsk_ring_prod__reserve(&q->fq, rcvd, &idx_fq) != rcvd)
+		;
+	for (i = 0; i < rcvd; i++) {
+		desc = xsk_ring_cons__rx_desc(&q->rx, idx_rx + i);
+		*xsk_ring_prod__fill_addr(&q->fq, idx_fq++) =
+			desc->addr & ~((__u64)FRAME_SIZE - 1);
+	}
+	xsk_ring_prod__submit(&q->fq, rcvd);
+	xsk_ring_cons__release(&q->rx, rcvd);
+}
+
+static void *capture_thread(void *arg)
+{
+	struct capture_queue *q = arg;
+	struct pollfd pfd = {
+		.fd = xsk_socket__fd(q->xsk),
+		.events = POLLIN,
+	};
+	__u32 idx_rx, rcvd;
+
+	while (!global_exit) {
+		rcvd = xsk_ring_cons__peek(&q->rx, RX_BATCH_SIZE, &idx_rx);
+		if (rcvd) {
+			capture_batch(q, idx_rx, rcvd);
+			continue;
+		}
+
+		/* Kick the driver if it ran out of fill buffers, and sleep
+		 * until packets arrive
+		 */
+		if (xsk_ring_prod__needs_wakeup(&q->fq))
+			recvfrom(pfd.fd, NULL, 0, MSG_DONTWAIT, NULL, NULL);
+		poll(&pfd, 1, 100);
+	}
+	return NULL;
+}
+
+static int start_threads(void)
+{
+	sigset_t set, old;
+	int i, err = 0;
+
+	/* The threads inherit the blocked signals, leaving them to main() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < nr_queues; i++) {
+		err = pthread_create(&queues[i].thread, NULL, capture_thread,
+				     &queues[i]);
+		if (err) {
+			fprintf(stderr, "ERR: pthread_create: %s\n",
+				strerror(err));
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return err ? -1 : 0;
+}
+
+static void print_stats(int stats_map_fd)
+{
+	int i, nr_cpus = libbpf_num_possible_cpus();
+	struct capture_stats values[nr_cpus], sum = {};
+	socklen_t optlen;
+	struct xdp_statistics xs;
+	struct capture_queue *q;
+	__u32 key = 0;
+
+	if (nr_cpus > 0 && !bpf_map_lookup_elem(stats_map_fd, &key, values)) {
+		for (i = 0; i < nr_cpus; i++) {
+			sum.matched += values[i].matched;
+			sum.no_socket += values[i].no_socket;
+		}
+	}
+	printf("%llu packets matched, %llu on queues without a socket\n",
+	       sum.matched, sum.no_socket);
+
+	for (i = 0; i < nr_queues; i++) {
+		q = &queues[i];
+		memset(&xs, 0, sizeof(xs));
+		optlen = sizeof(xs);
+		if (q->xsk)
+			getsockopt(xsk_socket__fd(q->xsk), SOL_XDP,
+				   XDP_STATISTICS, &xs, &optlen);
+
+		printf("queue %d: %llu packets %llu bytes written, dropped: "
+		       "%llu ring full %llu fill ring empty %llu other %llu write errors\n",
+		       q->queue_id, q->packets - q->write_errors, q->bytes,
+		       xs.rx_ring_full, xs.rx_fill_ring_empty_descs,
+		       xs.rx_dropped, q->write_errors);
+	}
+}
+
+static void exit_application(int signal)
+{
+	global_exit = true;
+}
+
+int main(int argc, char **argv)
+{
+	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts);
+	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
+	struct rlimit rlim = {RLIM_INFINITY, RLIM_INFINITY};
+	int xsks_map_fd, cfg_fd, filter_fd, stats_map_fd;
+	char progname[] = "xdp_capture_prog";
+	struct bpf_object *obj;
+	char errmsg[1024];
+	int i, err;
+	__u32 key = 0;
+
+	strncpy(cfg.filename, default_filename, sizeof(cfg.filename));
+
+	/* Cmdline options can change these */
+	parse_args(argc, argv);
+
+	/* Allow unlimited locking of memory, for the UMEMs */
+	if (setrlimit(RLIMIT_MEMLOCK, &rlim)) {
+		fprintf(stderr, "ERROR: setrlimit(RLIMIT_MEMLOCK) \"%s\"\n",
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	out_fd = open(cfg.filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0 || write_pcap_header()) {
+		fprintf(stderr, "ERROR: writing %s: %s\n", cfg.filename,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	xdp_opts.open_filename = "af_xdp_capture_kern.o";
+	xdp_opts.prog_name = progname;
+	xdp_opts.opts = &opts;
+
+	prog = xdp_program__create(&xdp_opts);
+	err = libxdp_get_error(prog);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "ERR: loading program: %s\n", errmsg);
+		return err;
+	}
+
+	err = xdp_program__attach(prog, cfg.ifindex, cfg.attach_mode, 0);
+	if (err) {
+		libxdp_strerror(err, errmsg, sizeof(errmsg));
+		fprintf(stderr, "Couldn't attach XDP program on iface '%s' : %s (%d)\n",
+			cfg.ifname, errmsg, err);
+		return err;
+	}
+
+	obj = xdp_program__bpf_obj(prog);
+	xsks_map_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xsks_map"));
+	cfg_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "capture_config_map"));
+	filter_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xdp_filter_map"));
+	stats_map_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "capture_stats_map"));
+	if (xsks_map_fd < 0 || cfg_fd < 0 || filter_fd < 0 || stats_map_fd < 0) {
+		fprintf(stderr, "ERROR: finding the maps in obj file failed\n");
+		goto out;
+	}
+
+	/* The program passes everything until enabled is set, so load the
+	 * filter before any socket can receive packets
+	 */
+	if (xdp_filter_load(filter_fd, rules, capture_cfg.nr_rules))
+		goto out;
+
+	queues = calloc(nr_queues, sizeof(*queues));
+	if (!queues)
+		goto out;
+
+	for (i = 0; i < nr_queues; i++) {
+		queues[i].queue_id = i;
+		err = setup_queue(&queues[i], xsks_map_fd);
+		if (err) {
+			fprintf(stderr, "ERROR: Can't setup AF_XDP socket on queue %d \"%s\"\n",
+				i, strerror(-err));
+			goto out;
+		}
+	}
+
+	signal(SIGINT, exit_application);
+	signal(SIGTERM, exit_application);
+
+	err = start_threads();
+	if (err)
+		goto out_threads;
+
+	/* Capturing starts once every socket has a thread reading it */
+	capture_cfg.enabled = 1;
+	err = bpf_map_update_elem(cfg_fd, &key, &capture_cfg, 0);
+	if (err) {
+		fprintf(stderr, "ERR: writing capture config: %s\n",
+			strerror(errno));
+		goto out_threads;
+	}
+
+	while (!global_exit)
+		sleep(1);
+
+	/* Let packets reach the stack again before the threads stop */
+	capture_cfg.enabled = 0;
+	bpf_map_update_elem(cfg_fd, &key, &capture_cfg, 0);
+
+out_threads:
+	global_exit = true;
+	for (i = 0; i < nr_queues; i++)
+		if (queues[i].thread)
+			pthread_join(queues[i].thread, NULL);
+
+	xdp_program__detach(prog, cfg.ifindex, cfg.attach_mode, 0);
+	close(out_fd);
+	if (verbose)
+		print_stats(stats_map_fd);
+
+	for (i = 0; i < nr_queues; i++) {
+		xsk_socket__delete(queues[i].xsk);
+		xsk_umem__delete(queues[i].umem);
+	}
+	return err ? EXIT_FAIL : EXIT_OK;
+
+out:
+	xdp_program__detach(prog, cfg.ifindex, cfg.attach_mode, 0);
+	return EXIT_FAIL;
+}
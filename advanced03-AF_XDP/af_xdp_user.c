@@ -29,6 +29,7 @@
 #include "../common/common_params.h"
 #include "../common/common_user_bpf_xdp.h"
 #include "../common/common_libbpf.h"
+#include "../common/csum_helpers.h"
 
 #define NUM_FRAMES         4096
 #define FRAME_SIZE         XSK_UMEM__DEFAULT_FRAME_SIZE
@@ -258,24 +259,6 @@ static void complete_tx(struct xsk_socket_info *xsk)
 	}
 }
 
-static inline __sum16 csum16_add(__sum16 csum, __be16 addend)
-{
-	uint16_t res = (uint16_t)csum;
-
-	res += (__u16)addend;
-	return (__sum16)(res + (res < (__u16)addend));
-}
-
-static inline __sum16 csum16_sub(__sum16 csum, __be16 addend)
-{
-	return csum16_add(csum, ~addend);
-}
-
-static inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
-{
-	*sum = ~csum16_add(csum16_sub(~(*sum), old), new);
-}
-
 static bool process_packet(struct xsk_socket_info *xsk,
 			   uint64_t addr, uint32_t len)
 {
@@ -0,0 +1,22 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+/* Size of the XSKMAP, i.e. the highest RX queue that can be captured + 1 */
+#define CAPTURE_MAX_QUEUES	64
+
+/* Single entry of capture_config_map, written by userspace */
+struct capture_config {
+	__u32 enabled;		/* 0 = pass everything, e.g. during setup */
+	__u32 nr_rules;		/* rules in xdp_filter_map, 0 = match all */
+};
+
+/* Per-CPU counters in capture_stats_map */
+struct capture_stats {
+	__u64 matched;		/* packets that passed the filter */
+	__u64 no_socket;	/* matches on a queue without a socket */
+};
+
+#endif /* __COMMON_KERN_USER_H */
@@ -0,0 +1,41 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+#define BLOCK_MAX_PREFIXES	(1 << 20)
+
+/* The bloom filters hold source addresses truncated to these lengths; a
+ * blocked prefix is inserted as every truncated address it covers, so one
+ * probe tells whether the LPM trie needs to be consulted.
+ */
+#define BLOCK_BLOOM_PREFIX4	16
+#define BLOCK_BLOOM_PREFIX6	32
+
+/* Prefixes shorter than this are not expanded into the bloom filter (it
+ * would take more than 256 entries); their presence disables the filter
+ * for that family instead.
+ */
+#define BLOCK_BLOOM_EXPAND_MAX	8
+
+/* block_config.flags */
+#define BLOCK_F_NO_BLOOM4	(1U << 0)
+#define BLOCK_F_NO_BLOOM6	(1U << 1)
+
+struct block_config {
+	__u32 flags;
+};
+
+/* LPM trie keys: prefixlen first, then the address in network byte order */
+struct block_key4 {
+	__u32 prefixlen;
+	__be32 addr;
+};
+
+struct block_key6 {
+	__u32 prefixlen;
+	__be32 addr[4];
+};
+
+#endif /* __COMMON_KERN_USER_H */
@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+/* Defines the xdp_rl_* maps */
+#include "../common/xdp_ratelimit_kern_user.h"
+#include "../common/xdp_ratelimit_kern.h"
+
+#include "common_kern_user.h"
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct block_key4);
+	__type(value, __u8);
+	__uint(max_entries, BLOCK_MAX_PREFIXES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} block_v4 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct block_key6);
+	__type(value, __u8);
+	__uint(max_entries, BLOCK_MAX_PREFIXES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} block_v6 SEC(".maps");
+
+/* Truncated source addresses, see BLOCK_BLOOM_PREFIX4/6 */
+struct {
+	__uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+	__type(value, __be32);
+	__uint(max_entries, BLOCK_MAX_PREFIXES);
+	__uint(map_extra, 3); /* number of hash functions */
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} block_bloom4 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_BLOOM_FILTER);
+	__type(value, __be32);
+	__uint(max_entries, BLOCK_MAX_PREFIXES);
+	__uint(map_extra, 3);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} block_bloom6 SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct block_config);
+	__uint(max_entries, 1);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} block_config_map SEC(".maps");
+
+static __always_inline __be32 bloom_key(__be32 addr, int prefixlen)
+{
+	return addr & bpf_htonl(~0U << (32 - prefixlen));
+}
+
+static __always_inline int blocked_v4(struct block_config *cfg, __be32 saddr)
+{
+	struct block_key4 key = { .prefixlen = 32, .addr = saddr };
+	__be32 bkey = bloom_key(saddr, BLOCK_BLOOM_PREFIX4);
+
+	/* Definitely not in the blocklist: the common case */
+	if (!(cfg->flags & BLOCK_F_NO_BLOOM4) &&
+	    bpf_map_peek_elem(&block_bloom4, &bkey))
+		return 0;
+
+	return !!bpf_map_lookup_elem(&block_v4, &key);
+}
+
+static __always_inline int blocked_v6(struct block_config *cfg,
+				      struct in6_addr *saddr)
+{
+	struct block_key6 key = { .prefixlen = 128 };
+	__be32 bkey = bloom_key(saddr->in6_u.u6_addr32[0],
+				BLOCK_BLOOM_PREFIX6);
+
+	if (!(cfg->flags & BLOCK_F_NO_BLOOM6) &&
+	    bpf_map_peek_elem(&block_bloom6, &bkey))
+		return 0;
+
+	__builtin_memcpy(key.addr, saddr, sizeof(key.addr));
+	return !!bpf_map_lookup_elem(&block_v6, &key);
+}
+
+SEC("xdp_blocklist")
+int xdp_blocklist_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct block_config *cfg;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	struct ethhdr *eth;
+	int action = XDP_PASS;
+	int eth_type;
+	__u32 key = 0;
+
+	cfg = bpf_map_lookup_elem(&block_config_map, &key);
+	if (!cfg)
+		goto out;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		if (parse_iphdr(&nh, data_end, &iph) < 0)
+			goto out;
+		if (blocked_v4(cfg, iph->saddr))
+			action = XDP_DROP;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		if (parse_ip6hdr(&nh, data_end, &ip6h) < 0)
+			goto out;
+		if (blocked_v6(cfg, &ip6h->saddr))
+			action = XDP_DROP;
+	}
+
+	/* Sources that are not blocked can still be rate limited */
+	if (action == XDP_PASS)
+		action = xdp_ratelimit_check(ctx);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
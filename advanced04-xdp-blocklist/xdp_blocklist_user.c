@@ -0,0 +1,369 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "XDP blocklist loader\n"
+	" - Syncs the IPv4/IPv6 prefix blocklists with a file, one prefix per\n"
+	"   line (addr or addr/len, '#' starts a comment)\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+
+#include "common_kern_user.h"
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",        no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",         required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"filename",    required_argument,	NULL,  1  },
+	 "Blocklist file <file>", "<file>", true},
+
+	{{"quiet",       no_argument,		NULL, 'q' },
+	 "Quiet mode (no output)"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+struct prefix_list {
+	void *keys;
+	size_t key_size;
+	size_t cnt;
+	size_t cap;
+};
+
+static int list_add(struct prefix_list *l, const void *key)
+{
+	void *keys;
+
+	if (l->cnt == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		keys = realloc(l->keys, l->cap * l->key_size);
+		if (!keys)
+			return -1;
+		l->keys = keys;
+	}
+	memcpy((char *)l->keys + l->cnt * l->key_size, key, l->key_size);
+	l->cnt++;
+	return 0;
+}
+
+/* Keys are compared as bytes; only used for sorting and lookup */
+static size_t cmp_key_size;
+
+static int cmp_key(const void *a, const void *b)
+{
+	return memcmp(a, b, cmp_key_size);
+}
+
+static void list_sort(struct prefix_list *l)
+{
+	cmp_key_size = l->key_size;
+	qsort(l->keys, l->cnt, l->key_size, cmp_key);
+}
+
+static bool list_has(struct prefix_list *l, const void *key)
+{
+	cmp_key_size = l->key_size;
+	return bsearch(key, l->keys, l->cnt, l->key_size, cmp_key);
+}
+
+/* Clears the host bits, as the LPM trie would otherwise keep them */
+static void mask_addr(__be32 *addr, int words, __u32 prefixlen)
+{
+	int i, bits;
+
+	for (i = 0; i < words; i++) {
+		bits = (int)prefixlen - i * 32;
+		if (bits >= 32)
+			continue;
+		addr[i] = bits <= 0 ? 0 : addr[i] & htonl(~0U << (32 - bits));
+	}
+}
+
+static int parse_file(const char *filename, struct prefix_list *v4,
+		      struct prefix_list *v6)
+{
+	struct block_key4 key4;
+	struct block_key6 key6;
+	char line[256], *p, *slash, *end;
+	int lineno = 0;
+	long len;
+	FILE *f;
+
+	f = fopen(filename, "r");
+	if (!f) {
+		fprintf(stderr, "ERR: opening %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		p = strtok(line, " \t\r\n");
+		if (!p)
+			continue;
+
+		len = -1;
+		slash = strchr(p, '/');
+		if (slash) {
+			*slash = '\0';
+			errno = 0;
+			len = strtol(slash + 1, &end, 10);
+			if (errno || end == slash + 1 || *end || len < 0) {
+				fprintf(stderr, "ERR: %s:%d: bad prefix length\n",
+					filename, lineno);
+				goto err_close;
+			}
+		}
+
+		memset(&key4, 0, sizeof(key4));
+		memset(&key6, 0, sizeof(key6));
+		if (inet_pton(AF_INET, p, &key4.addr) == 1 &&
+		    len <= 32) {
+			key4.prefixlen = len < 0 ? 32 : len;
+			mask_addr(&key4.addr, 1, key4.prefixlen);
+			if (list_add(v4, &key4))
+				goto err;
+		} else if (inet_pton(AF_INET6, p, key6.addr) == 1 &&
+			   len <= 128) {
+			key6.prefixlen = len < 0 ? 128 : len;
+			mask_addr(key6.addr, 4, key6.prefixlen);
+			if (list_add(v6, &key6))
+				goto err;
+		} else {
+			fprintf(stderr, "ERR: %s:%d: bad prefix\n",
+				filename, lineno);
+			goto err_close;
+		}
+	}
+
+	fclose(f);
+	return 0;
+
+err:
+	fprintf(stderr, "ERR: out of memory\n");
+err_close:
+	fclose(f);
+	return -1;
+}
+
+static int update_keys(int fd, struct prefix_list *l)
+{
+	__u32 count = l->cnt;
+	__u8 *values;
+	size_t i;
+	int err;
+
+	values = calloc(l->cnt ? l->cnt : 1, sizeof(*values));
+	if (!values)
+		return -1;
+	memset(values, 1, l->cnt);
+
+	err = bpf_map_update_batch(fd, l->keys, values, &count, NULL);
+	if (err && (errno == EINVAL || errno == EOPNOTSUPP ||
+		    errno == ENOTSUP)) {
+		/* Older kernels lack batch ops for the LPM trie */
+		err = 0;
+		for (i = 0; i < l->cnt && !err; i++)
+			err = bpf_map_update_elem(fd, (char *)l->keys +
+						  i * l->key_size,
+						  &values[i], 0);
+	}
+
+	free(values);
+	return err;
+}
+
+/* Deletes the prefixes in the trie that are not in the list */
+static int delete_stale(int fd, struct prefix_list *l, size_t *deleted)
+{
+	char key[sizeof(struct block_key6)], next[sizeof(struct block_key6)];
+	bool have_key = false;
+
+	*deleted = 0;
+	while (!bpf_map_get_next_key(fd, have_key ? key : NULL, next)) {
+		if (!list_has(l, next)) {
+			/* Carry on from the last kept key, which is
+			 * still in the trie
+			 */
+			if (bpf_map_delete_elem(fd, next))
+				return -1;
+			(*deleted)++;
+			continue;
+		}
+		memcpy(key, next, l->key_size);
+		have_key = true;
+	}
+	return 0;
+}
+
+/* Inserts the truncated addresses covered by each prefix into the bloom
+ * filter. Returns the BLOCK_F_NO_BLOOM* flag when a prefix is too short to
+ * expand, 0 otherwise, or -1 on error.
+ */
+static int update_bloom(int fd, struct prefix_list *l, int bloom_len,
+			__u32 no_bloom_flag)
+{
+	__be32 *addr, base, val;
+	__u32 prefixlen, n, j;
+	size_t i;
+
+	for (i = 0; i < l->cnt; i++) {
+		prefixlen = *(__u32 *)((char *)l->keys + i * l->key_size);
+		addr = (__be32 *)((char *)l->keys + i * l->key_size +
+				  sizeof(__u32));
+
+		if (prefixlen + BLOCK_BLOOM_EXPAND_MAX < (__u32)bloom_len)
+			return no_bloom_flag;
+
+		base = ntohl(addr[0]);
+		if (prefixlen < (__u32)bloom_len) {
+			n = 1U << (bloom_len - prefixlen);
+			base &= prefixlen ? ~0U << (32 - prefixlen) : 0;
+		} else {
+			n = 1;
+		}
+
+		for (j = 0; j < n; j++) {
+			val = htonl((base & (~0U << (32 - bloom_len))) +
+				    (j << (32 - bloom_len)));
+			if (bpf_map_update_elem(fd, NULL, &val, BPF_ANY))
+				return -1;
+		}
+	}
+	return 0;
+}
+
+static int sync_family(const char *pin_dir, const char *trie_name,
+		       const char *bloom_name, struct prefix_list *l,
+		       int bloom_len, __u32 no_bloom_flag,
+		       int cfg_fd, struct block_config *cfg)
+{
+	int trie_fd, bloom_fd, ret;
+	size_t deleted;
+	__u32 key = 0;
+
+	trie_fd = open_bpf_map_file(pin_dir, trie_name, NULL);
+	bloom_fd = open_bpf_map_file(pin_dir, bloom_name, NULL);
+	if (trie_fd < 0 || bloom_fd < 0)
+		return -1;
+
+	list_sort(l);
+
+	/* The bloom filter must know about a prefix before the trie has it,
+	 * or the prefix would be skipped by the fast path.
+	 */
+	ret = update_bloom(bloom_fd, l, bloom_len, no_bloom_flag);
+	if (ret < 0) {
+		fprintf(stderr, "ERR: updating %s: %s\n", bloom_name,
+			strerror(errno));
+		return -1;
+	}
+
+	/* Prefixes too short for the bloom filter must not be hidden by it,
+	 * so disable it before they go in. The bloom filter cannot forget
+	 * entries either, so the flag stays until the program is reloaded.
+	 */
+	if (ret && !(cfg->flags & ret)) {
+		cfg->flags |= ret;
+		if (bpf_map_update_elem(cfg_fd, &key, cfg, 0))
+			return -1;
+	}
+
+	if (l->cnt && update_keys(trie_fd, l)) {
+		fprintf(stderr, "ERR: updating %s: %s\n", trie_name,
+			strerror(errno));
+		return -1;
+	}
+
+	if (delete_stale(trie_fd, l, &deleted)) {
+		fprintf(stderr, "ERR: deleting from %s: %s\n", trie_name,
+			strerror(errno));
+		return -1;
+	}
+
+	if (verbose)
+		printf("%s: %zu prefixes, %zu removed%s\n", trie_name, l->cnt,
+		       deleted, ret ? " (bloom filter disabled)" : "");
+	return 0;
+}
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+const char *pin_basedir =  "/sys/fs/bpf";
+
+int main(int argc, char **argv)
+{
+	struct prefix_list v4 = { .key_size = sizeof(struct block_key4) };
+	struct prefix_list v6 = { .key_size = sizeof(struct block_key6) };
+	struct block_config block_cfg;
+	char pin_dir[PATH_MAX];
+	int cfg_fd, len, err = EXIT_FAIL_BPF;
+	__u32 key = 0;
+
+	struct config cfg = {
+		.ifindex   = -1,
+	};
+
+	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
+
+	if (cfg.ifindex == -1 || !cfg.filename[0]) {
+		fprintf(stderr, "ERR: required option --dev or --filename missing\n\n");
+		usage(argv[0], __doc__, long_options, (argc == 1));
+		return EXIT_FAIL_OPTION;
+	}
+
+	len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, cfg.ifname);
+	if (len < 0) {
+		fprintf(stderr, "ERR: creating pin dirname\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	if (parse_file(cfg.filename, &v4, &v6)) {
+		err = EXIT_FAIL;
+		goto out;
+	}
+
+	cfg_fd = open_bpf_map_file(pin_dir, "block_config_map", NULL);
+	if (cfg_fd < 0)
+		goto out;
+	if (bpf_map_lookup_elem(cfg_fd, &key, &block_cfg))
+		goto out;
+
+	if (sync_family(pin_dir, "block_v4", "block_bloom4", &v4,
+			BLOCK_BLOOM_PREFIX4, BLOCK_F_NO_BLOOM4,
+			cfg_fd, &block_cfg))
+		goto out;
+
+	if (sync_family(pin_dir, "block_v6", "block_bloom6", &v6,
+			BLOCK_BLOOM_PREFIX6, BLOCK_F_NO_BLOOM6,
+			cfg_fd, &block_cfg))
+		goto out;
+
+	err = EXIT_OK;
+out:
+	free(v4.keys);
+	free(v6.keys);
+	return err;
+}
@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+/* from include/net/ip.h and include/net/tcp.h */
+#ifndef IP_DF
+#define IP_DF		0x4000
+#endif
+#define TCPOPT_MSS	2
+#define TCPOLEN_MSS	4
+
+/* The SYN-ACK carries only an MSS option, as that is all the cookie encodes */
+#define SYNACK_TCP_LEN	(sizeof(struct tcphdr) + TCPOLEN_MSS)
+#define SYNACK_TTL	64
+#define SYNACK_WINDOW	65535
+
+/* Destination ports (host byte order) to answer SYNs for */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, __u16);
+	__type(value, __u8);
+	__uint(max_entries, 64);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} syncookie_ports SEC(".maps");
+
+/* Turns the SYN's TCP header into the SYN-ACK's; the caller has made sure
+ * SYNACK_TCP_LEN bytes are available. The checksum is left to the caller.
+ */
+static __always_inline void tcp_synack_fill(struct tcphdr *th, __u32 cookie,
+					    __u16 mss)
+{
+	__be32 *opt = (void *)(th + 1);
+	__be16 port = th->source;
+
+	th->source = th->dest;
+	th->dest = port;
+	th->ack_seq = bpf_htonl(bpf_ntohl(th->seq) + 1);
+	th->seq = bpf_htonl(cookie);
+
+	/* Clear all flags and the reserved bits, then set SYN and ACK */
+	*((__be16 *)th + 6) = 0;
+	th->doff = SYNACK_TCP_LEN >> 2;
+	th->syn = 1;
+	th->ack = 1;
+
+	th->window = bpf_htons(SYNACK_WINDOW);
+	th->check = 0;
+	th->urg_ptr = 0;
+
+	*opt = bpf_htonl((TCPOPT_MSS << 24) | (TCPOLEN_MSS << 16) | mss);
+}
+
+/* Resizes the packet to hold only the SYN-ACK headers */
+static __always_inline int synack_resize(struct xdp_md *ctx, int l3_len)
+{
+	int len = ctx->data_end - ctx->data;
+	int new_len = sizeof(struct ethhdr) + l3_len + SYNACK_TCP_LEN;
+
+	if (new_len == len)
+		return 0;
+	return bpf_xdp_adjust_tail(ctx, new_len - len);
+}
+
+static __always_inline int synack_ipv4(struct xdp_md *ctx, __s64 cookie)
+{
+	void *data_end, *data;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	struct tcphdr *th;
+
+	if (synack_resize(ctx, sizeof(*iph)))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	data = (void *)(long)ctx->data;
+	eth = data;
+	iph = (void *)(eth + 1);
+	th = (void *)(iph + 1);
+	if ((void *)th + SYNACK_TCP_LEN > data_end)
+		return -1;
+
+	swap_src_dst_mac(eth);
+	swap_src_dst_ipv4(iph);
+
+	iph->tot_len = bpf_htons(sizeof(*iph) + SYNACK_TCP_LEN);
+	iph->id = 0;
+	iph->frag_off = bpf_htons(IP_DF);
+	iph->ttl = SYNACK_TTL;
+	iph->check = 0;
+	iph->check = ipv4_hdr_csum(iph);
+
+	tcp_synack_fill(th, (__u32)cookie, (__u16)(cookie >> 32));
+	th->check = csum_tcpudp_magic(iph->saddr, iph->daddr, SYNACK_TCP_LEN,
+				      IPPROTO_TCP,
+				      csum_words(th, SYNACK_TCP_LEN / 2, 0));
+	return 0;
+}
+
+/* The SYN-ACK leaves out any extension headers of the SYN, so its TCP header
+ * is copied to right after the IPv6 header.
+ */
+static __always_inline int synack_ipv6(struct xdp_md *ctx,
+				       const struct tcphdr *syn, __s64 cookie)
+{
+	void *data_end, *data;
+	struct ipv6hdr *ip6h;
+	struct ethhdr *eth;
+	struct tcphdr *th;
+	struct tcphdr tcp;
+
+	__builtin_memcpy(&tcp, syn, sizeof(tcp));
+
+	if (synack_resize(ctx, sizeof(*ip6h)))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	data = (void *)(long)ctx->data;
+	eth = data;
+	ip6h = (void *)(eth + 1);
+	th = (void *)(ip6h + 1);
+	if ((void *)th + SYNACK_TCP_LEN > data_end)
+		return -1;
+
+	swap_src_dst_mac(eth);
+	swap_src_dst_ipv6(ip6h);
+
+	ip6h->payload_len = bpf_htons(SYNACK_TCP_LEN);
+	ip6h->nexthdr = IPPROTO_TCP;
+	ip6h->hop_limit = SYNACK_TTL;
+
+	__builtin_memcpy(th, &tcp, sizeof(tcp));
+	tcp_synack_fill(th, (__u32)cookie, (__u16)(cookie >> 32));
+	th->check = csum_ipv6_magic(ip6h->saddr.in6_u.u6_addr32,
+				    ip6h->daddr.in6_u.u6_addr32,
+				    SYNACK_TCP_LEN, IPPROTO_TCP,
+				    csum_words(th, SYNACK_TCP_LEN / 2, 0));
+	return 0;
+}
+
+/* An ACK is let through if it belongs to an existing connection, or if it
+ * completes a handshake with a valid cookie.
+ */
+static __always_inline int ack_ok_ipv4(struct xdp_md *ctx, struct iphdr *iph,
+				       struct tcphdr *th)
+{
+	struct bpf_sock_tuple tup = {};
+	struct bpf_sock *sk;
+	__u32 state;
+
+	tup.ipv4.saddr = iph->saddr;
+	tup.ipv4.daddr = iph->daddr;
+	tup.ipv4.sport = th->source;
+	tup.ipv4.dport = th->dest;
+
+	sk = bpf_skc_lookup_tcp(ctx, &tup, sizeof(tup.ipv4),
+				BPF_F_CURRENT_NETNS, 0);
+	if (sk) {
+		state = sk->state;
+		bpf_sk_release(sk);
+		if (state != BPF_TCP_LISTEN)
+			return 1;
+	}
+
+	return !bpf_tcp_raw_check_syncookie_ipv4(iph, th);
+}
+
+static __always_inline int ack_ok_ipv6(struct xdp_md *ctx,
+				       struct ipv6hdr *ip6h, struct tcphdr *th)
+{
+	struct bpf_sock_tuple tup = {};
+	struct bpf_sock *sk;
+	__u32 state;
+
+	__builtin_memcpy(tup.ipv6.saddr, &ip6h->saddr, sizeof(tup.ipv6.saddr));
+	__builtin_memcpy(tup.ipv6.daddr, &ip6h->daddr, sizeof(tup.ipv6.daddr));
+	tup.ipv6.sport = th->source;
+	tup.ipv6.dport = th->dest;
+
+	sk = bpf_skc_lookup_tcp(ctx, &tup, sizeof(tup.ipv6),
+				BPF_F_CURRENT_NETNS, 0);
+	if (sk) {
+		state = sk->state;
+		bpf_sk_release(sk);
+		if (state != BPF_TCP_LISTEN)
+			return 1;
+	}
+
+	return !bpf_tcp_raw_check_syncookie_ipv6(ip6h, th);
+}
+
+SEC("xdp_syncookie")
+int xdp_syncookie_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct ipv6_frag_info frag = {};
+	struct ipv6hdr *ip6h = NULL;
+	struct iphdr *iph = NULL;
+	int action = XDP_PASS;
+	struct tcphdr *th;
+	struct ethhdr *eth;
+	int eth_type, ip_type;
+	__u32 th_len;
+	__s64 cookie;
+	__u16 port;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	/* The SYN-ACK is built at fixed offsets, so no VLAN tags */
+	if (nh.pos != (void *)(eth + 1))
+		goto out;
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+		if (ip_type != IPPROTO_TCP || iph->ihl != 5)
+			goto out;
+		/* Leave fragments, whose TCP header may be cut short, to the stack */
+		if (iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+			goto out;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		/* Later fragments have no TCP header to look at */
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ip6h, &frag);
+		if (ip_type != IPPROTO_TCP || frag.offset)
+			goto out;
+	} else {
+		goto out;
+	}
+
+	if (parse_tcphdr(&nh, data_end, &th) < 0) {
+		action = XDP_DROP;
+		goto out;
+	}
+
+	port = bpf_ntohs(th->dest);
+	if (!bpf_map_lookup_elem(&syncookie_ports, &port))
+		goto out;
+
+	if (th->rst || th->fin)
+		goto out;
+
+	if (th->syn && !th->ack) {
+		/* A SYN never needs fragmenting, and the stack would answer
+		 * one after reassembly, bypassing the cookies
+		 */
+		if (frag.is_frag) {
+			action = XDP_DROP;
+			goto out;
+		}
+
+		/* The helpers want the TCP header with its options */
+		th_len = th->doff * 4;
+		if (th_len > 60 || (void *)th + th_len > data_end) {
+			action = XDP_DROP;
+			goto out;
+		}
+
+		if (iph)
+			cookie = bpf_tcp_raw_gen_syncookie_ipv4(iph, th, th_len);
+		else
+			cookie = bpf_tcp_raw_gen_syncookie_ipv6(ip6h, th, th_len);
+		if (cookie < 0) {
+			action = XDP_DROP;
+			goto out;
+		}
+
+		if (iph ? synack_ipv4(ctx, cookie) :
+			  synack_ipv6(ctx, th, cookie))
+			action = XDP_DROP;
+		else
+			action = XDP_TX;
+	} else if (th->ack && !th->syn) {
+		if (iph ? !ack_ok_ipv4(ctx, iph, th) :
+			  !ack_ok_ipv6(ctx, ip6h, th))
+			action = XDP_DROP;
+	}
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
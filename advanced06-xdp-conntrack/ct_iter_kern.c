@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "../common/xdp_conntrack_kern_user.h"
+
+/* BPF iterator over xdp_ct_map. The map is chosen when userspace attaches
+ * the program, and each entry is written out as a struct xdp_ct_dump_rec,
+ * so reading the iterator fd returns an array of them.
+ */
+
+/* The iterator context, from the kernel's BTF */
+struct bpf_iter_meta {
+	struct seq_file *seq;
+	__u64 session_id;
+	__u64 seq_num;
+} __attribute__((preserve_access_index));
+
+struct bpf_iter__bpf_map_elem {
+	struct bpf_iter_meta *meta;
+	struct bpf_map *map;
+	void *key;
+	void *value;
+} __attribute__((preserve_access_index));
+
+SEC("iter/bpf_map_elem")
+int dump_xdp_ct(struct bpf_iter__bpf_map_elem *ctx)
+{
+	struct seq_file *seq = ctx->meta->seq;
+	struct xdp_ct_entry *ct = ctx->value;
+	struct xdp_ct_key *key = ctx->key;
+	struct xdp_ct_dump_rec rec;
+
+	/* Called once more with NULL key and value at the end */
+	if (!key || !ct)
+		return 0;
+
+	__builtin_memcpy(&rec.key, key, sizeof(rec.key));
+	rec.created = ct->created;
+	rec.last_seen = ct->last_seen;
+	__builtin_memcpy(rec.dir, ct->dir, sizeof(rec.dir));
+	rec.flags = ct->flags;
+	rec.tcp_state = ct->tcp_state;
+
+	bpf_seq_write(seq, &rec, sizeof(rec));
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,63 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+/* Defines xdp_ct_map */
+#include "../common/xdp_conntrack_kern_user.h"
+#include "../common/xdp_conntrack_kern.h"
+
+/* Tracks every IP flow and passes the packets on. Packets to a port listed
+ * in ct_block_new_ports (host byte order) are dropped unless they are
+ * replies of a flow that was started from this side, or belong to a TCP
+ * connection picked up while already established.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, __u16);
+	__type(value, __u8);
+	__uint(max_entries, 64);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} ct_block_new_ports SEC(".maps");
+
+SEC("xdp_conntrack")
+int xdp_conntrack_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct xdp_ct_entry *ct;
+	int action = XDP_PASS;
+	struct ethhdr *eth;
+	struct tcphdr *tcph;
+	struct iphdr *iph;
+	__u16 port;
+	int dir;
+
+	ct = xdp_ct_track_packet(ctx, &dir);
+	if (!ct || dir == XDP_CT_DIR_REPLY)
+		goto out;
+
+	/* Only IPv4 TCP is filtered, to keep the example short */
+	if (parse_ethhdr(&nh, data_end, &eth) != bpf_htons(ETH_P_IP) ||
+	    parse_iphdr(&nh, data_end, &iph) != IPPROTO_TCP ||
+	    parse_tcphdr(&nh, data_end, &tcph) < 0)
+		goto out;
+
+	port = bpf_ntohs(tcph->dest);
+	if (bpf_map_lookup_elem(&ct_block_new_ports, &port) &&
+	    ct->tcp_state != XDP_CT_TCP_ESTABLISHED)
+		action = XDP_DROP;
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "XDP conntrack dumper\n"
+	" - Lists the flows in the pinned xdp_ct_map, read through a BPF iterator\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+#include "../common/xdp_conntrack_kern_user.h"
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",        no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",         required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"filename",    required_argument,	NULL,  1  },
+	 "Load iterator program from <file>", "<file>"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+static const char *tcp_state_names[XDP_CT_TCP_MAX] = {
+	[XDP_CT_TCP_NONE]		= "",
+	[XDP_CT_TCP_SYN_SENT]		= "SYN_SENT",
+	[XDP_CT_TCP_SYN_RECV]		= "SYN_RECV",
+	[XDP_CT_TCP_ESTABLISHED]	= "ESTABLISHED",
+	[XDP_CT_TCP_FIN_WAIT]		= "FIN_WAIT",
+	[XDP_CT_TCP_CLOSE]		= "CLOSE",
+};
+
+static const char *proto_name(__u8 proto)
+{
+	static char buf[8];
+
+	switch (proto) {
+	case IPPROTO_TCP:	return "tcp";
+	case IPPROTO_UDP:	return "udp";
+	case IPPROTO_ICMP:	return "icmp";
+	case IPPROTO_ICMPV6:	return "icmpv6";
+	}
+	snprintf(buf, sizeof(buf), "%u", proto);
+	return buf;
+}
+
+static void format_endpoint(char *buf, size_t size, __u8 family,
+			    const __be32 *addr, __be16 port)
+{
+	char str[INET6_ADDRSTRLEN];
+
+	inet_ntop(family, addr, str, sizeof(str));
+	if (family == AF_INET6)
+		snprintf(buf, size, "[%s]:%u", str, ntohs(port));
+	else
+		snprintf(buf, size, "%s:%u", str, ntohs(port));
+}
+
+/* Same clock as bpf_ktime_get_ns() */
+static __u64 gettime(void)
+{
+	struct timespec t;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &t) < 0) {
+		fprintf(stderr, "ERR: clock_gettime failed: %s\n", strerror(errno));
+		exit(EXIT_FAIL);
+	}
+	return (__u64) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static void print_rec(const struct xdp_ct_dump_rec *rec, __u64 now)
+{
+	const struct xdp_ct_key *key = &rec->key;
+	const struct xdp_ct_counters *orig = &rec->dir[XDP_CT_DIR_ORIG];
+	const struct xdp_ct_counters *reply = &rec->dir[XDP_CT_DIR_REPLY];
+	char lo[INET6_ADDRSTRLEN + 8], hi[INET6_ADDRSTRLEN + 8];
+	const char *state = "";
+
+	format_endpoint(lo, sizeof(lo), key->family, key->addr_lo, key->port_lo);
+	format_endpoint(hi, sizeof(hi), key->family, key->addr_hi, key->port_hi);
+	if (rec->tcp_state < XDP_CT_TCP_MAX)
+		state = tcp_state_names[rec->tcp_state];
+
+	/* Print the flow in the direction of its first packet */
+	printf("%-6s %s -> %s %s\n", proto_name(key->proto),
+	       rec->flags & XDP_CT_F_ORIG_HI ? hi : lo,
+	       rec->flags & XDP_CT_F_ORIG_HI ? lo : hi, state);
+	printf("       orig %llu pkts %llu bytes, reply %llu pkts %llu bytes,"
+	       " age %.1fs idle %.1fs\n",
+	       orig->packets, orig->bytes, reply->packets, reply->bytes,
+	       (double)(now - rec->created) / 1000000000,
+	       (double)(now - rec->last_seen) / 1000000000);
+}
+
+/* Runs the iterator over the map and prints every record it returns */
+static int dump_ct(struct bpf_program *prog, int map_fd)
+{
+	union bpf_iter_link_info linfo = {};
+	struct xdp_ct_dump_rec rec;
+	DECLARE_LIBBPF_OPTS(bpf_iter_attach_opts, opts,
+			    .link_info = &linfo,
+			    .link_info_len = sizeof(linfo));
+	struct bpf_link *link;
+	size_t have = 0;
+	int iter_fd, err = 0;
+	__u64 now, count = 0;
+	ssize_t len;
+
+	linfo.map.map_fd = map_fd;
+	link = bpf_program__attach_iter(prog, &opts);
+	if (libbpf_get_error(link)) {
+		fprintf(stderr, "ERR: attaching iterator: %s\n", strerror(errno));
+		return -1;
+	}
+
+	iter_fd = bpf_iter_create(bpf_link__fd(link));
+	if (iter_fd < 0) {
+		fprintf(stderr, "ERR: creating iterator: %s\n", strerror(errno));
+		bpf_link__destroy(link);
+		return -1;
+	}
+
+	now = gettime();
+	/* Records may be split over read() calls */
+	while ((len = read(iter_fd, (char *)&rec + have, sizeof(rec) - have)) > 0) {
+		have += len;
+		if (have < sizeof(rec))
+			continue;
+		print_rec(&rec, now);
+		count++;
+		have = 0;
+	}
+	if (len < 0) {
+		fprintf(stderr, "ERR: reading iterator: %s\n", strerror(errno));
+		err = -1;
+	}
+
+	printf("%llu flows\n", count);
+
+	close(iter_fd);
+	bpf_link__destroy(link);
+	return err;
+}
+
+#ifndef PATH_MAX
+#define PATH_MAX 4096
+#endif
+
+const char *pin_basedir =  "/sys/fs/bpf";
+
+int main(int argc, char **argv)
+{
+	struct bpf_program *prog;
+	struct bpf_object *obj;
+	char pin_dir[PATH_MAX];
+	int map_fd, len, err = EXIT_FAIL_BPF;
+
+	struct config cfg = {
+		.ifindex   = -1,
+		.filename  = "ct_iter_kern.o",
+	};
+
+	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
+
+	if (cfg.ifindex == -1) {
+		fprintf(stderr, "ERR: required option --dev missing\n\n");
+		usage(argv[0], __doc__, long_options, (argc == 1));
+		return EXIT_FAIL_OPTION;
+	}
+
+	len = snprintf(pin_dir, PATH_MAX, "%s/%s", pin_basedir, cfg.ifname);
+	if (len < 0) {
+		fprintf(stderr, "ERR: creating pin dirname\n");
+		return EXIT_FAIL_OPTION;
+	}
+
+	map_fd = open_bpf_map_file(pin_dir, "xdp_ct_map", NULL);
+	if (map_fd < 0)
+		return EXIT_FAIL_BPF;
+
+	obj = bpf_object__open_file(cfg.filename, NULL);
+	if (libbpf_get_error(obj)) {
+		fprintf(stderr, "ERR: opening file %s\n", cfg.filename);
+		return EXIT_FAIL_BPF;
+	}
+
+	if (bpf_object__load(obj)) {
+		fprintf(stderr, "ERR: loading %s: %s\n", cfg.filename,
+			strerror(errno));
+		goto out;
+	}
+
+	prog = bpf_object__find_program_by_name(obj, "dump_xdp_ct");
+	if (!prog) {
+		fprintf(stderr, "ERR: no dump_xdp_ct program in %s\n",
+			cfg.filename);
+		goto out;
+	}
+
+	if (!dump_ct(prog, map_fd))
+		err = EXIT_OK;
+out:
+	bpf_object__close(obj);
+	return err;
+}
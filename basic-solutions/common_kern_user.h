@@ -0,0 +1,13 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+/* Per-CPU run-time of one profiled program, in prof_stats of xdp_prof_kern */
+struct prof_rec {
+	__u64 run_cnt;
+	__u64 run_time_ns;
+};
+
+#endif /* __COMMON_KERN_USER_H */
@@ -0,0 +1,588 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+static const char *__doc__ = "XDP program profiler\n"
+	" - Reports runs/s, ns/pkt and the CPU and softirq time share of the XDP\n"
+	"   programs on --dev, from the kernel BPF run-time stats. With --fentry\n"
+	"   each libxdp dispatcher slot is also timed with fentry/fexit\n";
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <signal.h>
+
+#include <locale.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <bpf/bpf.h>
+#include <bpf/btf.h>
+#include <bpf/libbpf.h>
+#include <xdp/libxdp.h>
+
+#include <net/if.h>
+#include <linux/if_link.h> /* depend on kernel-headers installed */
+
+#include "../common/common_params.h"
+#include "../common/common_user_bpf_xdp.h"
+
+#include "common_kern_user.h"
+
+#define PROF_MAX_PROGS 11 /* dispatcher + 10 slots */
+
+static const char *default_filename = "xdp_prof_kern.o";
+static const char *stats_sysctl = "/proc/sys/kernel/bpf_stats_enabled";
+
+static struct config cfg = {
+	.ifindex   = -1,
+};
+static int interval = 1;
+static bool use_fentry;
+static volatile bool global_exit;
+
+static const struct option_wrapper long_options[] = {
+
+	{{"help",	 no_argument,		NULL, 'h' },
+	 "Show help", false},
+
+	{{"dev",	 required_argument,	NULL, 'd' },
+	 "Operate on device <ifname>", "<ifname>", true},
+
+	{{"interval",	 required_argument,	NULL, 'i' },
+	 "Report every <sec> seconds, default=1", "<sec>"},
+
+	{{"fentry",	 no_argument,		NULL, 'F' },
+	 "Time each dispatcher slot with fentry/fexit"},
+
+	{{"filename",    required_argument,	NULL,  1  },
+	 "Load the fentry/fexit programs from <file>", "<file>"},
+
+	{{"quiet",	 no_argument,		NULL, 'q' },
+	 "Quiet mode (no output)"},
+
+	{{0, 0, NULL,  0 }, NULL, false}
+};
+
+/* One profiled program. The main program (dispatcher, or the only program
+ * for legacy attach) has slot -1; its run-time comes from the kernel stats.
+ * The programs in the dispatcher slots run as freplace extensions, which the
+ * kernel does not account, so they are only timed with --fentry.
+ */
+struct prof_prog {
+	__u32 id;
+	int slot;
+	int run_prio;
+	char name[128];
+	struct bpf_object *obj;		/* fentry/fexit, NULL if not timed */
+	struct bpf_link *entry_link;
+	struct bpf_link *exit_link;
+	int stats_fd;
+	struct prof_rec cur;
+	struct prof_rec prev;
+};
+
+struct prof_state {
+	struct prof_prog progs[PROF_MAX_PROGS];
+	int nr_progs;
+	__u32 main_id;
+	__u32 xdp_flags;
+	__u64 timestamp;
+	__u64 softirq_ns;
+};
+
+static void parse_args(int argc, char **argv)
+{
+	struct option long_opts[sizeof(long_options) / sizeof(long_options[0])];
+	int i, opt;
+
+	for (i = 0; long_options[i].option.name; i++)
+		long_opts[i] = long_options[i].option;
+	memset(&long_opts[i], 0, sizeof(long_opts[i]));
+
+	while ((opt = getopt_long(argc, argv, "hd:i:Fq",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --dev name too long\n");
+				goto error;
+			}
+			cfg.ifname = cfg.ifname_buf;
+			strncpy(cfg.ifname, optarg, IF_NAMESIZE);
+			cfg.ifindex = if_nametoindex(cfg.ifname);
+			if (cfg.ifindex == 0) {
+				fprintf(stderr,
+					"ERR: --dev name unknown err(%d):%s\n",
+					errno, strerror(errno));
+				goto error;
+			}
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			if (interval < 1) {
+				fprintf(stderr, "ERR: --interval must be >= 1\n");
+				goto error;
+			}
+			break;
+		case 'F':
+			use_fentry = true;
+			break;
+		case 1: /* --filename */
+			strncpy(cfg.filename, optarg, sizeof(cfg.filename) - 1);
+			break;
+		case 'q':
+			verbose = false;
+			break;
+		case 'h':
+			usage(argv[0], __doc__, long_options, true);
+			exit(EXIT_OK);
+		default:
+			goto error;
+		}
+	}
+
+	if (cfg.ifindex == -1) {
+		fprintf(stderr, "ERR: required option --dev missing\n");
+		goto error;
+	}
+	return;
+
+error:
+	usage(argv[0], __doc__, long_options, (argc == 1));
+	exit(EXIT_FAIL_OPTION);
+}
+
+#define NANOSEC_PER_SEC 1000000000 /* 10^9 */
+static __u64 gettime(void)
+{
+	struct timespec t;
+	int res;
+
+	res = clock_gettime(CLOCK_MONOTONIC, &t);
+	if (res < 0) {
+		fprintf(stderr, "Error with gettimeofday! (%i)\n", res);
+		exit(EXIT_FAIL);
+	}
+	return (__u64) t.tv_sec * NANOSEC_PER_SEC + t.tv_nsec;
+}
+
+/* Total softirq time of all CPUs, from the "cpu" line of /proc/stat. It is
+ * only exact with CONFIG_IRQ_TIME_ACCOUNTING, else it is sampled on ticks.
+ */
+static __u64 softirq_time_ns(void)
+{
+	unsigned long long v[7] = {};
+	long hz = sysconf(_SC_CLK_TCK);
+	FILE *f;
+
+	f = fopen("/proc/stat", "r");
+	if (!f)
+		return 0;
+	/* user nice system idle iowait irq softirq */
+	if (fscanf(f, "cpu %llu %llu %llu %llu %llu %llu %llu", &v[0], &v[1],
+		   &v[2], &v[3], &v[4], &v[5], &v[6]) != 7)
+		v[6] = 0;
+	fclose(f);
+
+	return hz > 0 ? v[6] * (NANOSEC_PER_SEC / hz) : 0;
+}
+
+static int read_sysctl(const char *path)
+{
+	char buf[16] = {};
+	FILE *f;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	if (!fgets(buf, sizeof(buf), f))
+		buf[0] = '\0';
+	fclose(f);
+	return atoi(buf);
+}
+
+static int write_sysctl(const char *path, int val)
+{
+	FILE *f;
+	int err;
+
+	f = fopen(path, "w");
+	if (!f)
+		return -1;
+	err = fprintf(f, "%d\n", val) < 0;
+	return fclose(f) || err ? -1 : 0;
+}
+
+/* Turns on the run_cnt/run_time_ns accounting. BPF_ENABLE_STATS keeps it on
+ * for as long as the returned fd is open, so it ends with the process. Older
+ * kernels only have the sysctl; *restore is set if it must be turned off
+ * again. Returns the fd, or -1 when the sysctl is used.
+ */
+static int enable_run_stats(bool *restore)
+{
+	int fd;
+
+	*restore = false;
+	fd = bpf_enable_stats(BPF_STATS_RUN_TIME);
+	if (fd >= 0)
+		return fd;
+
+	if (read_sysctl(stats_sysctl) > 0)
+		return -1;
+
+	if (write_sysctl(stats_sysctl, 1)) {
+		fprintf(stderr, "ERR: enabling %s: %s\n", stats_sysctl,
+			strerror(errno));
+		exit(EXIT_FAIL);
+	}
+	*restore = true;
+	return -1;
+}
+
+/* The kernel truncates program names to BPF_OBJ_NAME_LEN, but fentry needs
+ * the full name of the function, which is in the BTF of the program.
+ */
+static int prog_func_name(int prog_fd, char *buf, size_t len)
+{
+	struct bpf_func_info finfo = {};
+	struct bpf_prog_info info = {};
+	__u32 info_len = sizeof(info);
+	const struct btf_type *t;
+	struct btf *btf;
+	int err = -1;
+
+	info.nr_func_info = 1;
+	info.func_info_rec_size = sizeof(finfo);
+	info.func_info = (__u64)(unsigned long)&finfo;
+
+	if (bpf_obj_get_info_by_fd(prog_fd, &info, &info_len))
+		return -1;
+	if (!info.btf_id || !info.nr_func_info) {
+		snprintf(buf, len, "%s", info.name);
+		return 0;
+	}
+
+	btf = btf__load_from_kernel_by_id(info.btf_id);
+	if (libbpf_get_error(btf))
+		return -1;
+
+	t = btf__type_by_id(btf, finfo.type_id);
+	if (t) {
+		snprintf(buf, len, "%s", btf__name_by_offset(btf, t->name_off));
+		err = 0;
+	}
+	btf__free(btf);
+	return err;
+}
+
+/* Loads fentry/fexit programs that time the program behind prog_fd */
+static int prof_attach_fentry(struct prof_prog *p, int prog_fd)
+{
+	struct bpf_link *entry_link = NULL, *exit_link;
+	struct bpf_program *entry, *leave;
+	struct bpf_object *obj;
+	int err;
+
+	obj = bpf_object__open_file(cfg.filename, NULL);
+	err = libbpf_get_error(obj);
+	if (err)
+		return err;
+
+	entry = bpf_object__find_program_by_name(obj, "prof_entry");
+	leave = bpf_object__find_program_by_name(obj, "prof_exit");
+	if (!entry || !leave) {
+		err = -ENOENT;
+		goto err;
+	}
+
+	err = bpf_program__set_attach_target(entry, prog_fd, p->name);
+	if (!err)
+		err = bpf_program__set_attach_target(leave, prog_fd, p->name);
+	if (!err)
+		err = bpf_object__load(obj);
+	if (err)
+		goto err;
+
+	/* Closing the object does not detach the programs, the links do */
+	entry_link = bpf_program__attach(entry);
+	err = libbpf_get_error(entry_link);
+	if (err) {
+		entry_link = NULL;
+		goto err;
+	}
+	exit_link = bpf_program__attach(leave);
+	err = libbpf_get_error(exit_link);
+	if (err)
+		goto err;
+
+	p->stats_fd = bpf_object__find_map_fd_by_name(obj, "prof_stats");
+	p->obj = obj;
+	p->entry_link = entry_link;
+	p->exit_link = exit_link;
+	return 0;
+
+err:
+	bpf_link__destroy(entry_link);
+	bpf_object__close(obj);
+	return err;
+}
+
+static void prof_add(struct prof_state *st, struct xdp_program *prog,
+		     int slot)
+{
+	struct prof_prog *p;
+	int err;
+
+	if (st->nr_progs >= PROF_MAX_PROGS)
+		return;
+
+	p = &st->progs[st->nr_progs++];
+	memset(p, 0, sizeof(*p));
+	p->id = xdp_program__id(prog);
+	p->slot = slot;
+	p->run_prio = xdp_program__run_prio(prog);
+	p->stats_fd = -1;
+	if (prog_func_name(xdp_program__fd(prog), p->name, sizeof(p->name)))
+		snprintf(p->name, sizeof(p->name), "%s",
+			 xdp_program__name(prog));
+
+	if (slot < 0 || !use_fentry)
+		return;
+
+	err = prof_attach_fentry(p, xdp_program__fd(prog));
+	if (err)
+		fprintf(stderr, "WARN: can't time %s with fentry: %s\n",
+			p->name, strerror(-err));
+}
+
+static void prof_release(struct prof_state *st)
+{
+	int i;
+
+	for (i = 0; i < st->nr_progs; i++) {
+		bpf_link__destroy(st->progs[i].exit_link);
+		bpf_link__destroy(st->progs[i].entry_link);
+		bpf_object__close(st->progs[i].obj);
+	}
+	st->nr_progs = 0;
+}
+
+/* Finds the programs on the interface. Returns -ENOENT if there are none. */
+static int prof_setup(struct prof_state *st)
+{
+	struct xdp_program *prog, *main_prog;
+	struct xdp_multiprog *mp;
+	int err, slot = 0;
+
+	memset(st, 0, sizeof(*st));
+
+	mp = xdp_multiprog__get_from_ifindex(cfg.ifindex);
+	err = libxdp_get_error(mp);
+	if (err)
+		return err;
+
+	main_prog = xdp_multiprog__main_prog(mp);
+	if (!main_prog) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	switch (xdp_multiprog__attach_mode(mp)) {
+	case XDP_MODE_SKB:
+		st->xdp_flags = XDP_FLAGS_SKB_MODE;
+		break;
+	case XDP_MODE_HW:
+		st->xdp_flags = XDP_FLAGS_HW_MODE;
+		break;
+	default:
+		st->xdp_flags = XDP_FLAGS_DRV_MODE;
+		break;
+	}
+
+	st->main_id = xdp_program__id(main_prog);
+	prof_add(st, main_prog, -1);
+
+	if (!xdp_multiprog__is_legacy(mp)) {
+		for (prog = xdp_multiprog__next_prog(NULL, mp); prog;
+		     prog = xdp_multiprog__next_prog(prog, mp))
+			prof_add(st, prog, slot++);
+	}
+
+out:
+	xdp_multiprog__close(mp);
+	return err;
+}
+
+static int prof_collect(struct prof_state *st)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	struct prof_rec values[nr_cpus];
+	struct bpf_prog_info info;
+	__u32 info_len;
+	__u32 key = 0;
+	int i, j, fd;
+
+	st->timestamp = gettime();
+	st->softirq_ns = softirq_time_ns();
+
+	for (i = 0; i < st->nr_progs; i++) {
+		struct prof_prog *p = &st->progs[i];
+
+		p->prev = p->cur;
+
+		if (p->slot < 0) {
+			fd = bpf_prog_get_fd_by_id(p->id);
+			if (fd < 0)
+				return -errno;
+			memset(&info, 0, sizeof(info));
+			info_len = sizeof(info);
+			if (bpf_obj_get_info_by_fd(fd, &info, &info_len)) {
+				close(fd);
+				return -errno;
+			}
+			close(fd);
+			p->cur.run_cnt = info.run_cnt;
+			p->cur.run_time_ns = info.run_time_ns;
+		} else if (p->stats_fd >= 0) {
+			if (bpf_map_lookup_elem(p->stats_fd, &key, values))
+				continue;
+			memset(&p->cur, 0, sizeof(p->cur));
+			for (j = 0; j < nr_cpus; j++) {
+				p->cur.run_cnt     += values[j].run_cnt;
+				p->cur.run_time_ns += values[j].run_time_ns;
+			}
+		}
+	}
+	return 0;
+}
+
+static void prof_print(struct prof_state *st, __u64 period_ns,
+		       __u64 softirq_ns)
+{
+	char *fmt = "%-7u %-24s %-5s %-5s %'12.0f %'9.1f %7.2f %8s\n";
+	double period = (double)period_ns / NANOSEC_PER_SEC;
+	char slot[8], prio[8], share[16];
+	__u64 runs, time_ns;
+	int i;
+
+	printf("%-7s %-24s %-5s %-5s %12s %9s %7s %8s\n", "ID", "NAME",
+	       "SLOT", "PRIO", "runs/s", "ns/pkt", "%cpu", "%softirq");
+
+	for (i = 0; i < st->nr_progs; i++) {
+		struct prof_prog *p = &st->progs[i];
+
+		if (p->slot < 0) {
+			snprintf(slot, sizeof(slot), "main");
+			snprintf(prio, sizeof(prio), "-");
+		} else {
+			snprintf(slot, sizeof(slot), "%d", p->slot);
+			snprintf(prio, sizeof(prio), "%d", p->run_prio);
+		}
+
+		if (p->slot >= 0 && p->stats_fd < 0) {
+			printf("%-7u %-24s %-5s %-5s %12s %9s %7s %8s\n",
+			       p->id, p->name, slot, prio, "-", "-", "-", "-");
+			continue;
+		}
+
+		runs    = p->cur.run_cnt     - p->prev.run_cnt;
+		time_ns = p->cur.run_time_ns - p->prev.run_time_ns;
+
+		if (softirq_ns)
+			snprintf(share, sizeof(share), "%.2f",
+				 100.0 * time_ns / softirq_ns);
+		else
+			snprintf(share, sizeof(share), "-");
+
+		/* %cpu is of a single CPU, like top */
+		printf(fmt, p->id, p->name, slot, prio, runs / period,
+		       runs ? (double)time_ns / runs : 0.0,
+		       100.0 * time_ns / period_ns, share);
+	}
+	printf("\n");
+}
+
+static bool prof_changed(struct prof_state *st)
+{
+	__u32 id = 0;
+
+	if (bpf_xdp_query_id(cfg.ifindex, st->xdp_flags, &id))
+		return true;
+	return id != st->main_id;
+}
+
+static void exit_application(int signal)
+{
+	global_exit = true;
+}
+
+int main(int argc, char **argv)
+{
+	struct prof_state st;
+	__u64 prev_ts, prev_softirq;
+	bool restore_sysctl;
+	int stats_fd, err = EXIT_OK;
+
+	strncpy(cfg.filename, default_filename, sizeof(cfg.filename));
+
+	/* Cmdline options can change these */
+	parse_args(argc, argv);
+
+	stats_fd = enable_run_stats(&restore_sysctl);
+
+	signal(SIGINT, exit_application);
+	signal(SIGTERM, exit_application);
+
+	/* Trick to pretty printf with thousands separators use %' */
+	setlocale(LC_NUMERIC, "en_US");
+
+	while (!global_exit) {
+		err = prof_setup(&st);
+		if (err) {
+			fprintf(stderr, "ERR: no XDP program on %s: %s\n",
+				cfg.ifname, strerror(-err));
+			err = EXIT_FAIL_BPF;
+			break;
+		}
+
+		err = prof_collect(&st);
+
+		while (!err && !global_exit) {
+			prev_ts = st.timestamp;
+			prev_softirq = st.softirq_ns;
+			sleep(interval);
+			if (global_exit || prof_changed(&st))
+				break;
+
+			err = prof_collect(&st);
+			if (err)
+				break;
+			prof_print(&st, st.timestamp - prev_ts,
+				   st.softirq_ns - prev_softirq);
+			fflush(stdout);
+		}
+
+		/* A program that went away fails the collection too; any
+		 * other error would only repeat after a restart
+		 */
+		if (err && !prof_changed(&st)) {
+			fprintf(stderr, "ERR: reading program stats: %s\n",
+				strerror(-err));
+			prof_release(&st);
+			err = EXIT_FAIL_BPF;
+			break;
+		}
+		err = EXIT_OK;
+
+		if (!global_exit)
+			printf("XDP programs on %s changed, restarting\n",
+			       cfg.ifname);
+		prof_release(&st);
+	}
+
+	if (stats_fd >= 0)
+		close(stats_fd);
+	if (restore_sysctl)
+		write_sysctl(stats_sysctl, 0);
+	return err;
+}
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+
+#include "common_kern_user.h"
+
+/* Times one XDP program from fentry to fexit. xdp_prof loads a copy of this
+ * object per profiled program, and points both programs at it with
+ * bpf_program__set_attach_target() before loading, so "func" is only a
+ * placeholder.
+ */
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, __u64);
+	__uint(max_entries, 1);
+} prof_start SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct prof_rec);
+	__uint(max_entries, 1);
+} prof_stats SEC(".maps");
+
+SEC("fentry/func")
+int BPF_PROG(prof_entry)
+{
+	__u32 key = 0;
+	__u64 *start;
+
+	start = bpf_map_lookup_elem(&prof_start, &key);
+	if (start)
+		*start = bpf_ktime_get_ns();
+	return 0;
+}
+
+SEC("fexit/func")
+int BPF_PROG(prof_exit)
+{
+	struct prof_rec *rec;
+	__u32 key = 0;
+	__u64 *start;
+
+	/* XDP programs do not nest on a CPU, so one start time per CPU will do */
+	start = bpf_map_lookup_elem(&prof_start, &key);
+	if (!start || !*start)
+		return 0;
+
+	rec = bpf_map_lookup_elem(&prof_stats, &key);
+	if (rec) {
+		rec->run_cnt++;
+		rec->run_time_ns += bpf_ktime_get_ns() - *start;
+	}
+	*start = 0;
+	return 0;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -1,6 +1,9 @@
 /* SPDX-License-Identifier: GPL-2.0 */
 static const char *__doc__ = "XDP stats program\n"
-	" - Finding xdp_stats_map via --dev name info\n";
+	" - Finding xdp_stats_map via --dev name info\n"
+	" - Reads it via mmap when the BPF-prog uses the XDP_STATS_MMAP layout\n"
+	" - Optionally breaks the packets down per CPU, and per RX queue when\n"
+	"   the BPF-prog is built with XDP_STATS_QUEUES\n";
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -11,6 +14,7 @@ static const char *__doc__ = "XDP stats program\n"
 #include <locale.h>
 #include <unistd.h>
 #include <time.h>
+#include <sys/mman.h>
 
 #include <bpf/bpf.h>
 /* Lesson#1: this prog does not need to #include <bpf/libbpf.h> as it only uses
@@ -32,12 +36,86 @@ static const struct option_wrapper long_options[] = {
 	{{"dev",         required_argument,	NULL, 'd' },
 	 "Operate on device <ifname>", "<ifname>", true},
 
+	{{"interval",    required_argument,	NULL, 'i' },
+	 "Report every <ms> milliseconds, default=2000", "<ms>"},
+
+	{{"per-cpu",     no_argument,		NULL, 'C' },
+	 "Also show the packets per CPU"},
+
+	{{"per-queue",   no_argument,		NULL, 'Q' },
+	 "Also show the packets per RX queue"},
+
 	{{"quiet",       no_argument,		NULL, 'q' },
 	 "Quiet mode (no output)"},
 
 	{{0, 0, NULL,  0 }}
 };
 
+static struct config cfg = {
+	.ifindex   = -1,
+	.do_unload = false,
+};
+static int interval_ms = 2000;
+static bool per_cpu;
+static bool per_queue;
+
+static void parse_args(int argc, char **argv)
+{
+	struct option long_opts[sizeof(long_options) / sizeof(long_options[0])];
+	int i, opt;
+
+	for (i = 0; long_options[i].option.name; i++)
+		long_opts[i] = long_options[i].option;
+	memset(&long_opts[i], 0, sizeof(long_opts[i]));
+
+	while ((opt = getopt_long(argc, argv, "hd:i:CQq",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --dev name too long\n");
+				goto error;
+			}
+			cfg.ifname = cfg.ifname_buf;
+			strncpy(cfg.ifname, optarg, IF_NAMESIZE);
+			cfg.ifindex = if_nametoindex(cfg.ifname);
+			if (cfg.ifindex == 0) {
+				fprintf(stderr,
+					"ERR: --dev name unknown err(%d):%s\n",
+					errno, strerror(errno));
+				goto error;
+			}
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			if (interval_ms < 1) {
+				fprintf(stderr, "ERR: --interval must be >= 1\n");
+				goto error;
+			}
+			break;
+		case 'C':
+			per_cpu = true;
+			break;
+		case 'Q':
+			per_queue = true;
+			break;
+		case 'q':
+			verbose = false;
+			break;
+		case 'h':
+			usage(argv[0], __doc__, long_options, true);
+			exit(EXIT_OK);
+		default:
+			goto error;
+		}
+	}
+	return;
+
+error:
+	usage(argv[0], __doc__, long_options, (argc == 1));
+	exit(EXIT_FAIL_OPTION);
+}
+
 #define NANOSEC_PER_SEC 1000000000 /* 10^9 */
 static __u64 gettime(void)
 {
@@ -57,8 +135,31 @@ struct record {
 	struct datarec total; /* defined in common_kern_user.h */
 };
 
+/* The per-CPU and per-queue records are summed over all actions, and share
+ * the timestamps of the stats records.
+ */
 struct stats_record {
 	struct record stats[XDP_ACTION_MAX];
+	struct datarec cpu[XDP_STATS_MAX_CPUS];
+	struct datarec queue[XDP_STATS_MAX_QUEUES];
+};
+
+/* The pinned xdp_stats_map, and its mmap when it has the XDP_STATS_MMAP
+ * layout. The mapping stays valid for as long as the map exists. The same
+ * goes for xdp_stats_queue_map; without the mmap, it is read with a single
+ * batch lookup into queue_values, or a lookup per queue if the kernel has no
+ * batch ops for it.
+ */
+struct stats_map {
+	int fd;
+	int queue_fd;		/* xdp_stats_queue_map, -1 if not used */
+	struct bpf_map_info info;
+	const volatile struct datarec *recs;
+	size_t mmap_len;
+	const volatile struct datarec *queue_recs;
+	size_t queue_mmap_len;
+	struct datarec *queue_values;
+	bool queue_batch;
 };
 
 static double calc_period(struct record *r, struct record *p)
@@ -119,6 +220,37 @@ static void stats_print(struct stats_record *stats_rec,
 	printf("\n");
 }
 
+/* Prints the rows that saw packets, with their share of all the packets.
+ * An uneven spread over the RX queues or CPUs is what to look for.
+ */
+static void stats_print_rows(const char *name, struct datarec *rows,
+			     struct datarec *prev_rows, int n, double period,
+			     bool last_plus)
+{
+	char *fmt = "%-12s %'11lld pkts (%'10.0f pps) %5.1f%%\n";
+	__u64 packets, sum = 0;
+	char label[32];
+	int i;
+
+	if (period == 0)
+		return;
+
+	for (i = 0; i < n; i++)
+		sum += rows[i].rx_packets - prev_rows[i].rx_packets;
+
+	printf("%-12s\n", name);
+	for (i = 0; i < n; i++) {
+		packets = rows[i].rx_packets - prev_rows[i].rx_packets;
+		if (!packets)
+			continue;
+
+		snprintf(label, sizeof(label), "%s:%d%s", name, i,
+			 last_plus && i == n - 1 ? "+" : "");
+		printf(fmt, label, rows[i].rx_packets, packets / period,
+		       100.0 * packets / sum);
+	}
+	printf("\n");
+}
 
 /* BPF_MAP_TYPE_ARRAY */
 void map_get_value_array(int fd, __u32 key, struct datarec *value)
@@ -129,8 +261,11 @@ void map_get_value_array(int fd, __u32 key, struct datarec *value)
 	}
 }
 
-/* BPF_MAP_TYPE_PERCPU_ARRAY */
-void map_get_value_percpu_array(int fd, __u32 key, struct datarec *value)
+/* BPF_MAP_TYPE_PERCPU_ARRAY, percpu (if set) gets the values of each CPU
+ * added to it
+ */
+void map_get_value_percpu_array(int fd, __u32 key, struct datarec *value,
+				struct datarec *percpu)
 {
 	/* For percpu maps, userspace gets a value per possible CPU */
 	unsigned int nr_cpus = libbpf_num_possible_cpus();
@@ -149,80 +284,347 @@ void map_get_value_percpu_array(int fd, __u32 key, struct datarec *value)
 	for (i = 0; i < nr_cpus; i++) {
 		sum_pkts  += values[i].rx_packets;
 		sum_bytes += values[i].rx_bytes;
+		if (percpu && i < XDP_STATS_MAX_CPUS) {
+			percpu[i].rx_packets += values[i].rx_packets;
+			percpu[i].rx_bytes   += values[i].rx_bytes;
+		}
+	}
+	value->rx_packets = sum_pkts;
+	value->rx_bytes   = sum_bytes;
+}
+
+/* XDP_STATS_MMAP layout, read straight from the mapping */
+void map_get_value_mmap(const volatile struct datarec *recs, __u32 key,
+			struct datarec *value, struct datarec *percpu)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	const volatile struct datarec *rec;
+	__u64 sum_bytes = 0;
+	__u64 sum_pkts = 0;
+	int i;
+
+	if (nr_cpus > XDP_STATS_MAX_CPUS)
+		nr_cpus = XDP_STATS_MAX_CPUS;
+
+	/* Sum values from each CPU */
+	for (i = 0; i < nr_cpus; i++) {
+		rec = &recs[i * XDP_STATS_CPU_STRIDE + key];
+		sum_pkts  += rec->rx_packets;
+		sum_bytes += rec->rx_bytes;
+		if (percpu) {
+			percpu[i].rx_packets += rec->rx_packets;
+			percpu[i].rx_bytes   += rec->rx_bytes;
+		}
 	}
 	value->rx_packets = sum_pkts;
 	value->rx_bytes   = sum_bytes;
 }
 
-static bool map_collect(int fd, __u32 map_type, __u32 key, struct record *rec)
+static bool map_collect(struct stats_map *map, __u32 key, struct record *rec,
+			struct datarec *percpu)
 {
 	struct datarec value;
 
 	/* Get time as close as possible to reading map contents */
 	rec->timestamp = gettime();
 
-	switch (map_type) {
+	if (map->recs) {
+		map_get_value_mmap(map->recs, key, &value, percpu);
+		goto out;
+	}
+
+	switch (map->info.type) {
 	case BPF_MAP_TYPE_ARRAY:
-		map_get_value_array(fd, key, &value);
+		map_get_value_array(map->fd, key, &value);
 		break;
 	case BPF_MAP_TYPE_PERCPU_ARRAY:
-		map_get_value_percpu_array(fd, key, &value);
+		map_get_value_percpu_array(map->fd, key, &value, percpu);
 		break;
 	default:
 		fprintf(stderr, "ERR: Unknown map_type(%u) cannot handle\n",
-			map_type);
+			map->info.type);
 		return false;
 		break;
 	}
 
+out:
 	rec->total.rx_packets = value.rx_packets;
 	rec->total.rx_bytes   = value.rx_bytes;
 	return true;
 }
 
-static void stats_collect(int map_fd, __u32 map_type,
+/* XDP_STATS_MMAP layout of xdp_stats_queue_map, summed over the CPUs */
+static void queue_collect_mmap(const volatile struct datarec *recs,
+			       struct datarec *queue)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	const volatile struct datarec *rec;
+	int i, q;
+
+	if (nr_cpus > XDP_STATS_MAX_CPUS)
+		nr_cpus = XDP_STATS_MAX_CPUS;
+
+	memset(queue, 0, sizeof(*queue) * XDP_STATS_MAX_QUEUES);
+	for (i = 0; i < nr_cpus; i++) {
+		for (q = 0; q < XDP_STATS_MAX_QUEUES; q++) {
+			rec = &recs[i * XDP_STATS_MAX_QUEUES + q];
+			queue[q].rx_packets += rec->rx_packets;
+			queue[q].rx_bytes   += rec->rx_bytes;
+		}
+	}
+}
+
+/* BPF_MAP_TYPE_PERCPU_ARRAY xdp_stats_queue_map, all queues in one syscall.
+ * values has room for the value of every possible CPU, for every queue.
+ */
+static int queue_collect_batch(int fd, struct datarec *values,
+			       struct datarec *queue)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	__u32 keys[XDP_STATS_MAX_QUEUES];
+	__u32 count = XDP_STATS_MAX_QUEUES;
+	struct datarec *value;
+	__u32 out_batch;
+	int err, i, c;
+
+	err = bpf_map_lookup_batch(fd, NULL, &out_batch, keys, values,
+				   &count, NULL);
+	/* ENOENT just says there are no more entries after this batch */
+	if (err && errno != ENOENT)
+		return -errno;
+
+	memset(queue, 0, sizeof(*queue) * XDP_STATS_MAX_QUEUES);
+	for (i = 0; i < count; i++) {
+		if (keys[i] >= XDP_STATS_MAX_QUEUES)
+			continue;
+		value = &values[i * nr_cpus];
+		for (c = 0; c < nr_cpus; c++) {
+			queue[keys[i]].rx_packets += value[c].rx_packets;
+			queue[keys[i]].rx_bytes   += value[c].rx_bytes;
+		}
+	}
+	return 0;
+}
+
+static void stats_collect(struct stats_map *map,
 			  struct stats_record *stats_rec)
 {
 	/* Collect all XDP actions stats  */
+	struct datarec *percpu = per_cpu ? stats_rec->cpu : NULL;
 	__u32 key;
 
+	memset(stats_rec->cpu, 0, sizeof(stats_rec->cpu));
 	for (key = 0; key < XDP_ACTION_MAX; key++) {
-		map_collect(map_fd, map_type, key, &stats_rec->stats[key]);
+		map_collect(map, key, &stats_rec->stats[key], percpu);
+	}
+
+	if (map->queue_fd < 0)
+		return;
+
+	if (map->queue_recs) {
+		queue_collect_mmap(map->queue_recs, stats_rec->queue);
+		return;
 	}
+
+	if (map->queue_batch &&
+	    queue_collect_batch(map->queue_fd, map->queue_values,
+				stats_rec->queue) == 0)
+		return;
+	map->queue_batch = false;
+
+	for (key = 0; key < XDP_STATS_MAX_QUEUES; key++)
+		map_get_value_percpu_array(map->queue_fd, key,
+					   &stats_rec->queue[key], NULL);
 }
 
-static int stats_poll(const char *pin_dir, int map_fd, __u32 id,
-		      __u32 map_type, int interval)
+/* Opening the pin costs syscalls, so the map is kept open and the pin is
+ * only checked for a new map once a second, whatever the interval.
+ */
+static int stats_poll(const char *pin_dir, struct stats_map *map)
 {
 	struct bpf_map_info info = {};
 	struct stats_record prev, record = { 0 };
+	int nr_cpus = libbpf_num_possible_cpus();
+	__u64 now, last_check;
+	int map_fd;
+
+	if (nr_cpus > XDP_STATS_MAX_CPUS)
+		nr_cpus = XDP_STATS_MAX_CPUS;
 
 	/* Trick to pretty printf with thousands separators use %' */
 	setlocale(LC_NUMERIC, "en_US");
 
 	/* Get initial reading quickly */
-	stats_collect(map_fd, map_type, &record);
+	stats_collect(map, &record);
 	usleep(1000000/4);
+	last_check = gettime();
 
 	while (1) {
 		prev = record; /* struct copy */
 
-		map_fd = open_bpf_map_file(pin_dir, "xdp_stats_map", &info);
-		if (map_fd < 0) {
-			return EXIT_FAIL_BPF;
-		} else if (id != info.id) {
-			printf("BPF map xdp_stats_map changed its ID, restarting\n");
+		now = gettime();
+		if (now - last_check >= NANOSEC_PER_SEC) {
+			last_check = now;
+			map_fd = open_bpf_map_file(pin_dir, "xdp_stats_map", &info);
+			if (map_fd < 0)
+				return EXIT_FAIL_BPF;
 			close(map_fd);
-			return 0;
+			if (map->info.id != info.id) {
+				printf("BPF map xdp_stats_map changed its ID, restarting\n");
+				return 0;
+			}
 		}
 
-		stats_collect(map_fd, map_type, &record);
+		stats_collect(map, &record);
 		stats_print(&record, &prev);
-		close(map_fd);
-		sleep(interval);
+		if (per_cpu || map->queue_fd >= 0) {
+			double period = calc_period(&record.stats[0],
+						    &prev.stats[0]);
+
+			if (per_cpu)
+				stats_print_rows("cpu", record.cpu, prev.cpu,
+						 nr_cpus, period, false);
+			if (map->queue_fd >= 0)
+				stats_print_rows("queue", record.queue,
+						 prev.queue, XDP_STATS_MAX_QUEUES,
+						 period, true);
+		}
+		usleep(interval_ms * 1000);
+	}
+
+	return 0;
+}
+
+/* Maps a BPF_F_MMAPABLE array read-only, the length is returned in len */
+static void *stats_mmap(int fd, struct bpf_map_info *info, const char *name,
+			size_t *len)
+{
+	long page_size = sysconf(_SC_PAGESIZE);
+	void *recs;
+
+	*len = (size_t)info->value_size * info->max_entries;
+	*len = (*len + page_size - 1) & ~(page_size - 1);
+	recs = mmap(NULL, *len, PROT_READ, MAP_SHARED, fd, 0);
+	if (recs == MAP_FAILED) {
+		fprintf(stderr, "ERR: mmap of %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	return recs;
+}
+
+static int stats_map_open(const char *pin_dir, struct stats_map *map)
+{
+	struct bpf_map_info map_expect = {
+		.key_size    = sizeof(__u32),
+		.value_size  = sizeof(struct datarec),
+		.max_entries = XDP_ACTION_MAX,
+	};
+	int err;
+
+	memset(map, 0, sizeof(*map));
+	map->queue_fd = -1;
+	map->fd = open_bpf_map_file(pin_dir, "xdp_stats_map", &map->info);
+	if (map->fd < 0)
+		return EXIT_FAIL_BPF;
+
+	if (map->info.map_flags & BPF_F_MMAPABLE) {
+		map_expect.type        = BPF_MAP_TYPE_ARRAY;
+		map_expect.max_entries = XDP_STATS_MMAP_ENTRIES;
+	}
+
+	/* check map info, e.g. datarec is expected size */
+	err = check_map_fd_info(&map->info, &map_expect);
+	if (err) {
+		fprintf(stderr, "ERR: map via FD not compatible\n");
+		goto err;
+	}
+
+	if (map->info.map_flags & BPF_F_MMAPABLE) {
+		map->recs = stats_mmap(map->fd, &map->info, "xdp_stats_map",
+				       &map->mmap_len);
+		if (!map->recs) {
+			err = EXIT_FAIL_BPF;
+			goto err;
+		}
 	}
 
+	if (per_queue) {
+		struct bpf_map_info queue_info = {};
+
+		map->queue_fd = open_bpf_map_file(pin_dir, "xdp_stats_queue_map",
+						  &queue_info);
+		if (map->queue_fd < 0) {
+			fprintf(stderr, "ERR: --per-queue needs a BPF-prog built"
+				" with XDP_STATS_QUEUES\n");
+			err = EXIT_FAIL_BPF;
+			goto err_unmap;
+		}
+
+		if (queue_info.map_flags & BPF_F_MMAPABLE) {
+			map_expect.type        = BPF_MAP_TYPE_ARRAY;
+			map_expect.max_entries = XDP_STATS_QUEUE_MMAP_ENTRIES;
+		} else {
+			map_expect.type        = BPF_MAP_TYPE_PERCPU_ARRAY;
+			map_expect.max_entries = XDP_STATS_MAX_QUEUES;
+		}
+		err = check_map_fd_info(&queue_info, &map_expect);
+		if (err) {
+			fprintf(stderr, "ERR: queue map via FD not compatible\n");
+			goto err_queue;
+		}
+
+		if (queue_info.map_flags & BPF_F_MMAPABLE) {
+			map->queue_recs = stats_mmap(map->queue_fd, &queue_info,
+						     "xdp_stats_queue_map",
+						     &map->queue_mmap_len);
+			if (!map->queue_recs) {
+				err = EXIT_FAIL_BPF;
+				goto err_queue;
+			}
+		} else {
+			map->queue_values = calloc((size_t)libbpf_num_possible_cpus() *
+						   XDP_STATS_MAX_QUEUES,
+						   sizeof(struct datarec));
+			if (!map->queue_values) {
+				err = EXIT_FAIL;
+				goto err_queue;
+			}
+			map->queue_batch = true;
+		}
+	}
+
+	if (verbose) {
+		printf("\nCollecting stats from BPF map%s\n",
+		       map->recs ? " (mmap)" : "");
+		printf(" - BPF map (bpf_map_type:%d) id:%d name:%s"
+		       " key_size:%d value_size:%d max_entries:%d\n",
+		       map->info.type, map->info.id, map->info.name,
+		       map->info.key_size, map->info.value_size,
+		       map->info.max_entries
+		       );
+	}
 	return 0;
+
+err_queue:
+	close(map->queue_fd);
+err_unmap:
+	if (map->recs)
+		munmap((void *)map->recs, map->mmap_len);
+err:
+	close(map->fd);
+	return err;
+}
+
+static void stats_map_close(struct stats_map *map)
+{
+	if (map->recs)
+		munmap((void *)map->recs, map->mmap_len);
+	if (map->queue_recs)
+		munmap((void *)map->queue_recs, map->queue_mmap_len);
+	free(map->queue_values);
+	if (map->queue_fd >= 0)
+		close(map->queue_fd);
+	close(map->fd);
 }
 
 #ifndef PATH_MAX
@@ -233,24 +635,12 @@ const char *pin_basedir =  "/sys/fs/bpf";
 
 int main(int argc, char **argv)
 {
-	const struct bpf_map_info map_expect = {
-		.key_size    = sizeof(__u32),
-		.value_size  = sizeof(struct datarec),
-		.max_entries = XDP_ACTION_MAX,
-	};
-	struct bpf_map_info info = { 0 };
+	struct stats_map map;
 	char pin_dir[PATH_MAX];
-	int stats_map_fd;
-	int interval = 2;
 	int len, err;
 
-	struct config cfg = {
-		.ifindex   = -1,
-		.do_unload = false,
-	};
-
 	/* Cmdline options can change progname */
-	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
+	parse_args(argc, argv);
 
 	/* Required option */
 	if (cfg.ifindex == -1) {
@@ -267,29 +657,12 @@ int main(int argc, char **argv)
 	}
 
 	for ( ;; ) {
-		stats_map_fd = open_bpf_map_file(pin_dir, "xdp_stats_map", &info);
-		if (stats_map_fd < 0) {
-			return EXIT_FAIL_BPF;
-		}
-
-		/* check map info, e.g. datarec is expected size */
-		err = check_map_fd_info(&info, &map_expect);
-		if (err) {
-			fprintf(stderr, "ERR: map via FD not compatible\n");
-			close(stats_map_fd);
+		err = stats_map_open(pin_dir, &map);
+		if (err)
 			return err;
-		}
-		if (verbose) {
-			printf("\nCollecting stats from BPF map\n");
-			printf(" - BPF map (bpf_map_type:%d) id:%d name:%s"
-			       " key_size:%d value_size:%d max_entries:%d\n",
-			       info.type, info.id, info.name,
-			       info.key_size, info.value_size, info.max_entries
-			       );
-		}
 
-		err = stats_poll(pin_dir, stats_map_fd, info.id, info.type, interval);
-		close(stats_map_fd);
+		err = stats_poll(pin_dir, &map);
+		stats_map_close(&map);
 		if (err < 0)
 			return err;
 	}
@@ -0,0 +1,285 @@
+/* SPDX-License-Identifier: (GPL-2.0-or-later OR BSD-2-clause) */
+/*
+ * This file contains Internet checksum (RFC 1071) helpers, shared between the
+ * BPF programs and the userspace programs (e.g. AF_XDP). The functions mirror
+ * the kernel's include/net/checksum.h, so code can move between the two.
+ *
+ * Checksums are computed on 16-bit words in memory order, which makes them
+ * independent of host byte order; values passed in are the raw (network byte
+ * order) header fields.
+ *
+ * When only a few fields of a header change, use the csum_replace*() helpers,
+ * which patch the checksum incrementally as described in RFC 1624:
+ *
+ *     HC' = ~(~HC + ~m + m')
+ *
+ * where HC is the old checksum, and m and m' are the old and new values.
+ */
+
+#ifndef __CSUM_HELPERS_H
+#define __CSUM_HELPERS_H
+
+#include <linux/types.h>
+
+#ifndef __bpf__
+#include <stddef.h>
+#ifdef __x86_64__
+#include <immintrin.h>
+#endif
+#endif
+
+#ifndef __always_inline
+#define __always_inline inline __attribute__((always_inline))
+#endif
+
+/* Loops must be unrolled for BPF; gcc (userspace) does not know the pragma */
+#ifdef __clang__
+#define __csum_unroll _Pragma("unroll")
+#else
+#define __csum_unroll
+#endif
+
+/* UDP uses a zero checksum to mean "no checksum", so a computed checksum of
+ * zero is sent as 0xffff instead (RFC 768).
+ */
+#define CSUM_MANGLED_0 ((__sum16)0xffff)
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define __csum_htonl(x) __builtin_bswap32(x)
+#else
+#define __csum_htonl(x) (x)
+#endif
+
+static __always_inline __u32 csum_add(__u32 csum, __u32 addend)
+{
+	csum += addend;
+	return csum + (csum < addend);
+}
+
+static __always_inline __u32 csum_sub(__u32 csum, __u32 addend)
+{
+	return csum_add(csum, ~addend);
+}
+
+static __always_inline __u16 csum16_add(__u16 csum, __u16 addend)
+{
+	csum += addend;
+	return csum + (csum < addend);
+}
+
+static __always_inline __u16 csum16_sub(__u16 csum, __u16 addend)
+{
+	return csum16_add(csum, ~addend);
+}
+
+/* Folds a 32-bit partial checksum to 16 bits and complements it */
+static __always_inline __sum16 csum_fold(__u32 csum)
+{
+	csum = (csum & 0xffff) + (csum >> 16);
+	csum = (csum & 0xffff) + (csum >> 16);
+	return (__sum16)~csum;
+}
+
+static __always_inline __u32 csum_unfold(__sum16 csum)
+{
+	return (__u32)csum;
+}
+
+/* Sums nwords 16-bit words. Intended for small fixed-size headers, as the
+ * loop is unrolled when nwords is a constant, which the verifier needs.
+ */
+static __always_inline __u32 csum_words(const void *buf, int nwords,
+					__u32 csum)
+{
+	const __u16 *next = buf;
+	int i;
+
+	__csum_unroll
+	for (i = 0; i < nwords; i++)
+		csum += *next++;
+
+	return csum;
+}
+
+/* Checksum of an IPv4 header of ihl 32-bit words, with the checksum field
+ * included as-is (zero it first when computing a new checksum).
+ */
+static __always_inline __sum16 ip_fast_csum(const void *iph, int ihl)
+{
+	return csum_fold(csum_words(iph, ihl * 2, 0));
+}
+
+/* Incrementally updates a checksum for a changed 16-bit field */
+static __always_inline void csum_replace2(__sum16 *sum, __be16 old, __be16 new)
+{
+	*sum = ~csum16_add(csum16_sub(~(*sum), old), new);
+}
+
+/* Incrementally updates a checksum for a changed 32-bit field, e.g. an IPv4
+ * address in both the IP header and the L4 pseudo-header.
+ */
+static __always_inline void csum_replace4(__sum16 *sum, __be32 from, __be32 to)
+{
+	__u32 tmp = csum_sub(~csum_unfold(*sum), from);
+
+	*sum = csum_fold(csum_add(tmp, to));
+}
+
+/* Incrementally updates a checksum for a changed IPv6 address */
+static __always_inline void csum_replace16(__sum16 *sum, const __be32 *from,
+					   const __be32 *to)
+{
+	__u32 tmp = ~csum_unfold(*sum);
+	int i;
+
+	__csum_unroll
+	for (i = 0; i < 4; i++) {
+		tmp = csum_sub(tmp, from[i]);
+		tmp = csum_add(tmp, to[i]);
+	}
+	*sum = csum_fold(tmp);
+}
+
+/* Incrementally updates a checksum by replacing one partial sum with another,
+ * e.g. an IPv4 pseudo-header with an IPv6 one on NAT64.
+ */
+static __always_inline void csum_replace_wsum(__sum16 *sum, __u32 from,
+					      __u32 to)
+{
+	*sum = csum_fold(csum_add(csum_sub(~csum_unfold(*sum), from), to));
+}
+
+/* Partial sum of the IPv4 TCP/UDP pseudo-header (RFC 793/768) */
+static __always_inline __u32 csum_tcpudp_nofold(__be32 saddr, __be32 daddr,
+						__u32 len, __u8 proto,
+						__u32 csum)
+{
+	__u64 s = csum;
+
+	s += saddr;
+	s += daddr;
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	s += (proto + len) << 8;
+#else
+	s += proto + len;
+#endif
+	s = (s & 0xffffffff) + (s >> 32);
+	s = (s & 0xffffffff) + (s >> 32);
+	return (__u32)s;
+}
+
+/* Partial sum of the IPv6 upper-layer pseudo-header (RFC 8200) */
+static __always_inline __u32 csum_ipv6_nofold(const __be32 *saddr,
+					      const __be32 *daddr,
+					      __u32 len, __u8 proto,
+					      __u32 csum)
+{
+	int i;
+
+	__csum_unroll
+	for (i = 0; i < 4; i++) {
+		csum = csum_add(csum, saddr[i]);
+		csum = csum_add(csum, daddr[i]);
+	}
+	csum = csum_add(csum, __csum_htonl(len));
+	csum = csum_add(csum, __csum_htonl((__u32)proto));
+	return csum;
+}
+
+static __always_inline __sum16 csum_tcpudp_magic(__be32 saddr, __be32 daddr,
+						 __u32 len, __u8 proto,
+						 __u32 csum)
+{
+	return csum_fold(csum_tcpudp_nofold(saddr, daddr, len, proto, csum));
+}
+
+static __always_inline __sum16 csum_ipv6_magic(const __be32 *saddr,
+					       const __be32 *daddr,
+					       __u32 len, __u8 proto,
+					       __u32 csum)
+{
+	return csum_fold(csum_ipv6_nofold(saddr, daddr, len, proto, csum));
+}
+
+#ifndef __bpf__
+/*
+ * Full checksum over a buffer, for userspace only; in BPF programs use
+ * bpf_csum_diff() or the fixed-size helpers above.
+ */
+static inline __u32 csum_partial_generic(const void *buf, size_t len,
+					 __u32 csum)
+{
+	const __u8 *p = buf;
+	__u64 sum = csum;
+
+	for (; len >= 4; len -= 4, p += 4)
+		sum += *(const __u32 *)p;
+	if (len >= 2) {
+		sum += *(const __u16 *)p;
+		len -= 2;
+		p += 2;
+	}
+	if (len) {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		sum += *p;
+#else
+		sum += (__u32)*p << 8;
+#endif
+	}
+
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return (__u32)sum;
+}
+
+#ifdef __x86_64__
+/*
+ * AVX2 version of csum_partial_generic(). Each 32-bit lane accumulates the
+ * low and high 16-bit halves of the loaded words separately, so no carries
+ * are lost; lanes are folded into a 64-bit sum before they can overflow.
+ */
+__attribute__((target("avx2")))
+static inline __u32 csum_partial_avx2(const void *buf, size_t len, __u32 csum)
+{
+	/* A lane grows by at most 2 * 0xffff per block */
+	const size_t max_blocks = 0x8000;
+	const __m256i mask = _mm256_set1_epi32(0xffff);
+	const __u8 *p = buf;
+	__u64 sum = csum;
+
+	while (len >= 32) {
+		__m256i acc = _mm256_setzero_si256();
+		__u32 lanes[8];
+		size_t n;
+		int i;
+
+		for (n = 0; n < max_blocks && len >= 32; n++, len -= 32, p += 32) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+			acc = _mm256_add_epi32(acc, _mm256_and_si256(v, mask));
+			acc = _mm256_add_epi32(acc, _mm256_srli_epi32(v, 16));
+		}
+
+		_mm256_storeu_si256((__m256i *)lanes, acc);
+		for (i = 0; i < 8; i++)
+			sum += lanes[i];
+	}
+
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	sum = (sum & 0xffffffff) + (sum >> 32);
+	return csum_partial_generic(p, len, (__u32)sum);
+}
+#endif /* __x86_64__ */
+
+/* Full checksum over a buffer, using AVX2 when the CPU supports it */
+static inline __u32 csum_partial(const void *buf, size_t len, __u32 csum)
+{
+#ifdef __x86_64__
+	if (__builtin_cpu_supports("avx2"))
+		return csum_partial_avx2(buf, len, csum);
+#endif
+	return csum_partial_generic(buf, len, csum);
+}
+#endif /* __bpf__ */
+
+#endif /* __CSUM_HELPERS_H */
@@ -11,9 +11,18 @@
  * (h_proto for Ethernet, nexthdr for IPv6), for ICMP it is the ICMP type field.
  * All return values are in host byte order.
  *
+ * Note that parse_ip6hdr() returns the nexthdr field of the fixed IPv6 header,
+ * which is an extension header type for packets carrying hop-by-hop options,
+ * routing or fragment headers. Use parse_ip6hdr_ext() to also skip over these
+ * and get the upper-layer protocol.
+ *
  * The versions of the functions included here are slightly expanded versions of
  * the functions in the packet01 lesson. For instance, the Ethernet header
  * parsing has support for parsing VLAN tags.
+ *
+ * The tunnel parsers at the end of the file (GRE, VXLAN, GENEVE and IPIP via
+ * parse_tunnel()) move the cursor to the inner headers, so the same helpers
+ * can be used again to parse the inner Ethernet, IP and L4 headers.
  */
 
 #ifndef __PARSING_HELPERS_H
@@ -22,6 +31,7 @@
 #include <stddef.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/in.h>
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/icmp.h>
@@ -65,6 +75,38 @@ struct collect_vlans {
 	__u16 id[VLAN_MAX_DEPTH];
 };
 
+/*
+ *	struct ipv6_frag_hdr - IPv6 fragment extension header
+ *	@nexthdr: type of the header following the fragment header
+ *	@reserved: always zero
+ *	@frag_off: fragment offset (upper 13 bits) and flags
+ *	@identification: fragment identification
+ */
+struct ipv6_frag_hdr {
+	__u8	nexthdr;
+	__u8	reserved;
+	__be16	frag_off;
+	__be32	identification;
+};
+
+#define IPV6_FRAG_OFFSET_MASK	0xfff8 /* Offset in 8-byte units, shifted */
+#define IPV6_FRAG_MORE		0x0001 /* More fragments follow */
+
+/* Allow users of header file to redefine the number of IPv6 extension headers
+ * that are skipped before giving up.
+ */
+#ifndef IPV6_EXT_MAX_CHAIN
+#define IPV6_EXT_MAX_CHAIN 6
+#endif
+
+/* Struct for collecting fragment info after parsing via parse_ip6hdr_ext */
+struct ipv6_frag_info {
+	__u8	is_frag;	/* A fragment header was found */
+	__u8	more_frags;	/* The M flag was set */
+	__u16	offset;		/* Fragment offset in bytes */
+	__be32	id;		/* Fragment identification */
+};
+
 static __always_inline int proto_is_vlan(__u16 h_proto)
 {
 	return !!(h_proto == bpf_htons(ETH_P_8021Q) ||
@@ -148,6 +190,119 @@ static __always_inline int parse_ip6hdr(struct hdr_cursor *nh,
 	return ip6h->nexthdr;
 }
 
+static __always_inline int proto_is_ipv6_ext(__u8 nexthdr)
+{
+	return !!(nexthdr == IPPROTO_HOPOPTS ||
+		  nexthdr == IPPROTO_ROUTING ||
+		  nexthdr == IPPROTO_DSTOPTS ||
+		  nexthdr == IPPROTO_FRAGMENT ||
+		  nexthdr == IPPROTO_AH ||
+		  nexthdr == IPPROTO_MH);
+}
+
+/*
+ * skip_ip6hdrext: skip over up to IPV6_EXT_MAX_CHAIN IPv6 extension headers,
+ * starting at nh->pos with the header type next_hdr_type. On success nh->pos
+ * points to the upper-layer header, whose protocol number is returned. Returns
+ * -1 on truncated headers, or if the chain is longer than the limit.
+ *
+ * If a fragment header is seen, and frag is non-NULL, the fragment info is
+ * collected in frag. Notice that the walk stops at a non-first fragment (with
+ * a non-zero offset), as there is no upper-layer header in the packet; the
+ * protocol is still returned, so callers must check frag->offset before
+ * parsing L4.
+ */
+static __always_inline int skip_ip6hdrext(struct hdr_cursor *nh,
+					  void *data_end,
+					  __u8 next_hdr_type,
+					  struct ipv6_frag_info *frag)
+{
+	struct ipv6_frag_hdr *fh;
+	struct ipv6_opt_hdr *hdr;
+	__u16 frag_off;
+	int i;
+
+	if (frag)
+		__builtin_memset(frag, 0, sizeof(*frag));
+
+	/* Bounded loop, so the verifier does not have to walk the chain more
+	 * than IPV6_EXT_MAX_CHAIN times.
+	 */
+	#pragma unroll
+	for (i = 0; i < IPV6_EXT_MAX_CHAIN; i++) {
+		hdr = nh->pos;
+
+		switch (next_hdr_type) {
+		case IPPROTO_HOPOPTS:
+		case IPPROTO_DSTOPTS:
+		case IPPROTO_ROUTING:
+		case IPPROTO_MH:
+			if (hdr + 1 > data_end)
+				return -1;
+			/* Length in 8-octet units, not including first 8 */
+			nh->pos += (hdr->hdrlen + 1) * 8;
+			next_hdr_type = hdr->nexthdr;
+			break;
+		case IPPROTO_AH:
+			if (hdr + 1 > data_end)
+				return -1;
+			/* Length in 4-octet units, minus 2 (RFC 4302) */
+			nh->pos += (hdr->hdrlen + 2) * 4;
+			next_hdr_type = hdr->nexthdr;
+			break;
+		case IPPROTO_FRAGMENT:
+			fh = nh->pos;
+			if (fh + 1 > data_end)
+				return -1;
+			nh->pos = fh + 1;
+			next_hdr_type = fh->nexthdr;
+
+			frag_off = bpf_ntohs(fh->frag_off);
+			if (frag) {
+				frag->is_frag    = 1;
+				frag->more_frags = !!(frag_off & IPV6_FRAG_MORE);
+				frag->offset     = frag_off & IPV6_FRAG_OFFSET_MASK;
+				frag->id         = fh->identification;
+			}
+			/* Non-first fragment, payload is not a header */
+			if (frag_off & IPV6_FRAG_OFFSET_MASK)
+				return next_hdr_type;
+			break;
+		default:
+			/* Found the upper-layer header */
+			return next_hdr_type;
+		}
+	}
+
+	if (proto_is_ipv6_ext(next_hdr_type))
+		return -1;
+
+	return next_hdr_type;
+}
+
+/*
+ * parse_ip6hdr_ext: like parse_ip6hdr(), but also skips extension headers, so
+ * nh->pos points to the L4 header and the L4 protocol is returned. Fragment
+ * info is collected in frag, if non-NULL.
+ */
+static __always_inline int parse_ip6hdr_ext(struct hdr_cursor *nh,
+					    void *data_end,
+					    struct ipv6hdr **ip6hdr,
+					    struct ipv6_frag_info *frag)
+{
+	int nexthdr;
+
+	/* Also clear frag info when the fixed header itself is truncated */
+	if (frag)
+		__builtin_memset(frag, 0, sizeof(*frag));
+
+	nexthdr = parse_ip6hdr(nh, data_end, ip6hdr);
+	if (nexthdr < 0)
+		return -1;
+
+	return skip_ip6hdrext(nh, data_end, nexthdr, frag);
+}
+
 static __always_inline int parse_iphdr(struct hdr_cursor *nh,
 				       void *data_end,
 				       struct iphdr **iphdr)
@@ -269,4 +424,217 @@ static __always_inline int parse_tcphdr(struct hdr_cursor *nh,
 	return len;
 }
 
+/*
+ *	struct gre_base_hdr - GRE header, without the optional fields
+ *	@flags: C, R, K, S flags and version
+ *	@protocol: EtherType of the encapsulated packet
+ */
+struct gre_base_hdr {
+	__be16	flags;
+	__be16	protocol;
+};
+
+#define GRE_FLAG_CSUM		0x8000
+#define GRE_FLAG_ROUTING	0x4000
+#define GRE_FLAG_KEY		0x2000
+#define GRE_FLAG_SEQ		0x1000
+#define GRE_VERSION_MASK	0x0007
+
+/*
+ *	struct vxlanhdr - VXLAN header (RFC 7348)
+ *	@vx_flags: flags, only the I flag (VNI valid) is defined
+ *	@vx_vni: VXLAN network identifier in the upper 24 bits
+ */
+struct vxlanhdr {
+	__be32	vx_flags;
+	__be32	vx_vni;
+};
+
+#define VXLAN_FLAG_VNI		0x08000000
+
+/*
+ *	struct genevehdr - GENEVE header (RFC 8926), without options
+ *	@ver_opt_len: version (upper 2 bits) and options length in 4-byte units
+ *	@flags: O (control packet) and C (critical options) flags
+ *	@proto_type: EtherType of the encapsulated packet
+ *	@vni: virtual network identifier
+ *	@reserved: always zero
+ */
+struct genevehdr {
+	__u8	ver_opt_len;
+	__u8	flags;
+	__be16	proto_type;
+	__u8	vni[3];
+	__u8	reserved;
+};
+
+#define GENEVE_VER_SHIFT	6
+#define GENEVE_OPT_LEN_MASK	0x3f
+
+/* Allow users of header file to redefine the UDP tunnel ports */
+#ifndef VXLAN_UDP_PORT
+#define VXLAN_UDP_PORT 4789
+#endif
+
+#ifndef GENEVE_UDP_PORT
+#define GENEVE_UDP_PORT 6081
+#endif
+
+#ifndef ETH_P_TEB
+#define ETH_P_TEB 0x6558 /* Transparent Ethernet Bridging */
+#endif
+
+/*
+ * parse_grehdr: parse a GRE header including the optional checksum, key and
+ * sequence number fields, and return the encapsulated protocol
+ * (network-byte-order). ETH_P_TEB means an Ethernet header follows.
+ */
+static __always_inline int parse_grehdr(struct hdr_cursor *nh,
+					void *data_end,
+					struct gre_base_hdr **grehdr)
+{
+	struct gre_base_hdr *greh = nh->pos;
+	__u16 flags;
+	int hdrsize;
+
+	if (greh + 1 > data_end)
+		return -1;
+
+	flags = bpf_ntohs(greh->flags);
+	/* Only version 0 without (deprecated) source routing is supported */
+	if (flags & (GRE_VERSION_MASK | GRE_FLAG_ROUTING))
+		return -1;
+
+	hdrsize = sizeof(*greh);
+	if (flags & GRE_FLAG_CSUM)
+		hdrsize += 4;
+	if (flags & GRE_FLAG_KEY)
+		hdrsize += 4;
+	if (flags & GRE_FLAG_SEQ)
+		hdrsize += 4;
+
+	if (nh->pos + hdrsize > data_end)
+		return -1;
+
+	nh->pos += hdrsize;
+	*grehdr = greh;
+
+	return greh->protocol; /* network-byte-order */
+}
+
+/*
+ * parse_vxlanhdr: parse a VXLAN header and return the VNI. An Ethernet header
+ * always follows.
+ */
+static __always_inline int parse_vxlanhdr(struct hdr_cursor *nh,
+					  void *data_end,
+					  struct vxlanhdr **vxlanhdr)
+{
+	struct vxlanhdr *vxh = nh->pos;
+
+	if (vxh + 1 > data_end)
+		return -1;
+
+	if (!(vxh->vx_flags & bpf_htonl(VXLAN_FLAG_VNI)))
+		return -1;
+
+	nh->pos   = vxh + 1;
+	*vxlanhdr = vxh;
+
+	return bpf_ntohl(vxh->vx_vni) >> 8;
+}
+
+/*
+ * parse_genevehdr: parse a GENEVE header, skipping any options, and return
+ * the encapsulated protocol (network-byte-order).
+ */
+static __always_inline int parse_genevehdr(struct hdr_cursor *nh,
+					   void *data_end,
+					   struct genevehdr **genevehdr)
+{
+	struct genevehdr *gnvh = nh->pos;
+	int hdrsize;
+
+	if (gnvh + 1 > data_end)
+		return -1;
+
+	if (gnvh->ver_opt_len >> GENEVE_VER_SHIFT)
+		return -1;
+
+	/* Options are at most 63 * 4 bytes, so this is bounded */
+	hdrsize = sizeof(*gnvh) + (gnvh->ver_opt_len & GENEVE_OPT_LEN_MASK) * 4;
+	if (nh->pos + hdrsize > data_end)
+		return -1;
+
+	nh->pos    += hdrsize;
+	*genevehdr = gnvh;
+
+	return gnvh->proto_type; /* network-byte-order */
+}
+
+/*
+ * parse_tunnel: parse a tunnel header following the outer IP header, where
+ * l4_proto is the outer protocol returned by parse_iphdr()/parse_ip6hdr_ext().
+ * Handles IPIP/IP6IP6 (and 4in6/6in4), GRE, and VXLAN/GENEVE on their UDP
+ * ports.
+ *
+ * On success nh->pos points to the inner L3 header, and the inner EtherType
+ * (network-byte-order) is returned, like parse_ethhdr() does. If the tunnel
+ * carries Ethernet, *inner_eth points to the inner Ethernet header, and inner
+ * VLAN tags are skipped; otherwise *inner_eth is NULL.
+ *
+ * Returns 0 and leaves the cursor untouched if the packet is not a tunnel
+ * packet, and -1 on malformed tunnel headers.
+ */
+static __always_inline int parse_tunnel(struct hdr_cursor *nh,
+					void *data_end,
+					int l4_proto,
+					struct ethhdr **inner_eth)
+{
+	struct gre_base_hdr *greh;
+	struct genevehdr *gnvh;
+	struct vxlanhdr *vxh;
+	struct udphdr *udph;
+	void *start = nh->pos;
+	int proto;
+
+	*inner_eth = NULL;
+
+	switch (l4_proto) {
+	case IPPROTO_IPIP:
+		return bpf_htons(ETH_P_IP);
+	case IPPROTO_IPV6:
+		return bpf_htons(ETH_P_IPV6);
+	case IPPROTO_GRE:
+		proto = parse_grehdr(nh, data_end, &greh);
+		break;
+	case IPPROTO_UDP:
+		if (parse_udphdr(nh, data_end, &udph) < 0)
+			return -1;
+
+		if (udph->dest == bpf_htons(VXLAN_UDP_PORT)) {
+			if (parse_vxlanhdr(nh, data_end, &vxh) < 0)
+				return -1;
+			proto = bpf_htons(ETH_P_TEB);
+		} else if (udph->dest == bpf_htons(GENEVE_UDP_PORT)) {
+			proto = parse_genevehdr(nh, data_end, &gnvh);
+		} else {
+			/* Plain UDP, rewind to let caller parse it */
+			nh->pos = start;
+			return 0;
+		}
+		break;
+	default:
+		return 0;
+	}
+
+	if (proto < 0)
+		return -1;
+
+	if (proto == bpf_htons(ETH_P_TEB))
+		return parse_ethhdr(nh, data_end, inner_eth);
+
+	return proto;
+}
+
 #endif /* __PARSING_HELPERS_H */
@@ -3,6 +3,9 @@
  * This file contains functions that are used in the packetXX XDP programs to
  * manipulate on packets data. The functions are marked as __always_inline, and
  * fully defined in this header file to be included in the BPF program.
+ *
+ * It relies on the header structs and parsers in parsing_helpers.h, so that
+ * file must be included first.
  */
 
 #ifndef __REWRITE_HELPERS_H
@@ -16,6 +19,8 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 
+#include "csum_helpers.h"
+
 /* Pops the outermost VLAN tag off the packet. Returns the popped VLAN ID on
  * success or negative errno on failure.
  */
@@ -107,6 +112,138 @@ static __always_inline int vlan_tag_push(struct xdp_md *ctx,
 	return 0;
 }
 
+/* Replaces the old_tags (0-2) outermost VLAN tags of the packet with new_tags
+ * (0-2) tags, moving the packet head only once. Two new tags are written as
+ * an 802.1ad S-tag with outer_vid followed by an 802.1Q C-tag with inner_vid;
+ * a single new tag is an 802.1Q tag with outer_vid. Only the VIDs change:
+ * the innermost new tag keeps the PCP and DEI bits of the innermost old tag,
+ * an outer new tag those of the outermost old tag. Any tags beyond old_tags
+ * are left in place. Returns 0 on success, -1 on failure.
+ */
+static __always_inline int vlan_tags_rewrite(struct xdp_md *ctx,
+					     struct ethhdr *eth,
+					     int old_tags, int new_tags,
+					     __u16 outer_vid, __u16 inner_vid)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ethhdr eth_cpy;
+	struct vlan_hdr *vlh;
+	__u16 outer_pri = 0;
+	__u16 inner_pri = 0;
+	__be16 h_proto;
+	int delta;
+
+	vlh = (void *)(eth + 1);
+
+	/* Find the proto that follows the tags we remove */
+	if (old_tags == 2) {
+		if (vlh + 2 > data_end)
+			return -1;
+		if (!proto_is_vlan(eth->h_proto) ||
+		    !proto_is_vlan(vlh[0].h_vlan_encapsulated_proto))
+			return -1;
+		h_proto = vlh[1].h_vlan_encapsulated_proto;
+		outer_pri = bpf_ntohs(vlh[0].h_vlan_TCI) & ~VLAN_VID_MASK;
+		inner_pri = bpf_ntohs(vlh[1].h_vlan_TCI) & ~VLAN_VID_MASK;
+	} else if (old_tags == 1) {
+		if (vlh + 1 > data_end)
+			return -1;
+		if (!proto_is_vlan(eth->h_proto))
+			return -1;
+		h_proto = vlh[0].h_vlan_encapsulated_proto;
+		outer_pri = bpf_ntohs(vlh[0].h_vlan_TCI) & ~VLAN_VID_MASK;
+		inner_pri = outer_pri;
+	} else if (old_tags == 0) {
+		if (eth + 1 > data_end)
+			return -1;
+		h_proto = eth->h_proto;
+	} else {
+		return -1;
+	}
+
+	if (new_tags < 0 || new_tags > 2)
+		return -1;
+
+	__builtin_memcpy(&eth_cpy, eth, sizeof(eth_cpy));
+
+	/* A single head adjustment covers both the removed and added tags */
+	delta = (old_tags - new_tags) * (int)sizeof(*vlh);
+	if (delta && bpf_xdp_adjust_head(ctx, delta))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	eth = (void *)(long)ctx->data;
+
+	if (eth + 1 > data_end)
+		return -1;
+
+	__builtin_memcpy(eth, &eth_cpy, sizeof(*eth));
+	vlh = (void *)(eth + 1);
+
+	if (new_tags == 2) {
+		if (vlh + 2 > data_end)
+			return -1;
+
+		eth->h_proto = bpf_htons(ETH_P_8021AD);
+		vlh[0].h_vlan_TCI = bpf_htons(outer_pri |
+					      (outer_vid & VLAN_VID_MASK));
+		vlh[0].h_vlan_encapsulated_proto = bpf_htons(ETH_P_8021Q);
+		vlh[1].h_vlan_TCI = bpf_htons(inner_pri |
+					      (inner_vid & VLAN_VID_MASK));
+		vlh[1].h_vlan_encapsulated_proto = h_proto;
+	} else if (new_tags == 1) {
+		if (vlh + 1 > data_end)
+			return -1;
+
+		eth->h_proto = bpf_htons(ETH_P_8021Q);
+		vlh[0].h_vlan_TCI = bpf_htons(inner_pri |
+					      (outer_vid & VLAN_VID_MASK));
+		vlh[0].h_vlan_encapsulated_proto = h_proto;
+	} else {
+		eth->h_proto = h_proto;
+	}
+
+	return 0;
+}
+
+/* Pushes a QinQ (802.1ad S-tag + 802.1Q C-tag) pair after the Ethernet
+ * header. Returns 0 on success, -1 on failure.
+ */
+static __always_inline int vlan_tags_push(struct xdp_md *ctx,
+					  struct ethhdr *eth,
+					  __u16 outer_vid, __u16 inner_vid)
+{
+	return vlan_tags_rewrite(ctx, eth, 0, 2, outer_vid, inner_vid);
+}
+
+/* Pops up to two outermost VLAN tags off the packet. Returns the number of
+ * tags removed on success, -1 on failure.
+ */
+static __always_inline int vlan_tags_pop(struct xdp_md *ctx, struct ethhdr *eth)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct vlan_hdr *vlh = (void *)(eth + 1);
+	int tags = 0;
+
+	if (vlh > data_end)
+		return -1;
+
+	if (proto_is_vlan(eth->h_proto)) {
+		tags = 1;
+		if (vlh + 1 <= data_end &&
+		    proto_is_vlan(vlh->h_vlan_encapsulated_proto))
+			tags = 2;
+	}
+
+	if (!tags)
+		return 0;
+
+	if (vlan_tags_rewrite(ctx, eth, tags, 0, 0, 0))
+		return -1;
+
+	return tags;
+}
+
 /*
  * Swaps destination and source MAC addresses inside an Ethernet header
  */
@@ -141,4 +278,650 @@ static __always_inline void swap_src_dst_ipv4(struct iphdr *iphdr)
 	iphdr->daddr = tmp;
 }
 
+/*
+ * Tunnel encapsulation and decapsulation helpers.
+ *
+ * The encap helpers push new outer headers between the Ethernet header and
+ * the (untagged) inner IPv4/IPv6 packet, using a single bpf_xdp_adjust_head()
+ * call. The outer IPv4 header checksum is computed over the new 20-byte header
+ * only; the payload is never touched. The outer UDP checksum of GUE and VXLAN
+ * is left zero over IPv4, which RFC 768 allows. Over IPv6 it is derived from
+ * the inner L4 checksum (see encap_inner_csum()), and inner packets where that
+ * is not possible are refused. The ECN field of the inner packet is copied to
+ * the outer header, and propagated back on decap (RFC 6040).
+ *
+ * All helpers return 0 on success and -1 on failure. On failure after
+ * adjusting the head, the packet is left in an unspecified state and should
+ * be dropped.
+ */
+
+#ifndef ENCAP_TTL
+#define ENCAP_TTL 64
+#endif
+
+/* GUE variant 1 (direct IP over UDP) has no GUE header of its own */
+#ifndef GUE_UDP_PORT
+#define GUE_UDP_PORT 6080
+#endif
+
+#define INET_ECN_MASK	3
+#define INET_ECN_CE	3
+
+#ifndef IP_MF
+#define IP_MF		0x2000
+#endif
+#ifndef IP_OFFSET
+#define IP_OFFSET	0x1fff
+#endif
+
+/* Computes the checksum of an IPv4 header without options */
+static __always_inline __u16 ipv4_hdr_csum(struct iphdr *iph)
+{
+	iph->check = 0;
+	return ip_fast_csum(iph, sizeof(*iph) >> 2);
+}
+
+static __always_inline __u8 ipv6_get_tclass(struct ipv6hdr *ip6h)
+{
+	return (ip6h->priority << 4) | (ip6h->flow_lbl[0] >> 4);
+}
+
+/* Sets ECN CE on an ECN-capable IPv4 packet, patching the checksum */
+static __always_inline void ipv4_set_ce(struct iphdr *iph)
+{
+	__be16 old;
+
+	/* Not-ECT and CE are left alone */
+	if (!(iph->tos & INET_ECN_MASK))
+		return;
+
+	/* The first 16-bit word holds version, ihl and tos */
+	old = *(__be16 *)iph;
+	iph->tos |= INET_ECN_CE;
+	csum_replace2(&iph->check, old, *(__be16 *)iph);
+}
+
+static __always_inline void ipv6_set_ce(struct ipv6hdr *ip6h)
+{
+	/* ECN is the low 2 bits of the traffic class, in flow_lbl[0] */
+	if (!((ip6h->flow_lbl[0] >> 4) & INET_ECN_MASK))
+		return;
+
+	ip6h->flow_lbl[0] |= INET_ECN_CE << 4;
+}
+
+/* Collects what the outer header needs to know about the inner packet: the
+ * protocol to put in the outer header, its traffic class and its length.
+ */
+static __always_inline int encap_inner_info(struct ethhdr *eth, void *data_end,
+					    __u8 *proto, __u8 *tos, __u16 *len)
+{
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+
+	if (eth->h_proto == bpf_htons(ETH_P_IP)) {
+		iph = (void *)(eth + 1);
+		if (iph + 1 > data_end)
+			return -1;
+
+		*proto = IPPROTO_IPIP;
+		*tos   = iph->tos;
+		*len   = bpf_ntohs(iph->tot_len);
+	} else if (eth->h_proto == bpf_htons(ETH_P_IPV6)) {
+		ip6h = (void *)(eth + 1);
+		if (ip6h + 1 > data_end)
+			return -1;
+
+		*proto = IPPROTO_IPV6;
+		*tos   = ipv6_get_tclass(ip6h);
+		*len   = bpf_ntohs(ip6h->payload_len) + sizeof(*ip6h);
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Ones' complement sum of the inner IP packet of len bytes, as the outer UDP
+ * checksum needs it. Like the kernel's local checksum offload (LCO), it is
+ * derived from the inner L4 checksum instead of reading the payload: a valid
+ * L4 checksum makes the L4 segment sum to the complement of its
+ * pseudo-header. Returns -1 when that does not hold, i.e. for fragments,
+ * IPv4 options, IPv6 extension headers, UDP without checksum and other
+ * protocols.
+ */
+static __always_inline int encap_inner_csum(void *ip, void *data_end,
+					    __be16 h_proto, __u32 *csum)
+{
+	struct ipv6hdr *ip6h = ip;
+	struct iphdr *iph = ip;
+	struct udphdr *udph;
+	__u32 pseudo;
+	__u8 proto;
+
+	if (h_proto == bpf_htons(ETH_P_IP)) {
+		if (iph + 1 > data_end || iph->ihl != 5 ||
+		    iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+			return -1;
+
+		proto = iph->protocol;
+		udph = (void *)(iph + 1);
+		*csum = csum_words(iph, sizeof(*iph) / 2, 0);
+		pseudo = csum_tcpudp_nofold(iph->saddr, iph->daddr,
+					    bpf_ntohs(iph->tot_len) -
+					    sizeof(*iph), proto, 0);
+		/* ICMP has no pseudo-header, the message sums to zero */
+		if (proto == IPPROTO_ICMP) {
+			*csum = csum_add(*csum, 0xffff);
+			return 0;
+		}
+	} else if (h_proto == bpf_htons(ETH_P_IPV6)) {
+		if (ip6h + 1 > data_end)
+			return -1;
+
+		proto = ip6h->nexthdr;
+		udph = (void *)(ip6h + 1);
+		*csum = csum_words(ip6h, sizeof(*ip6h) / 2, 0);
+		pseudo = csum_ipv6_nofold(ip6h->saddr.in6_u.u6_addr32,
+					  ip6h->daddr.in6_u.u6_addr32,
+					  bpf_ntohs(ip6h->payload_len),
+					  proto, 0);
+	} else {
+		return -1;
+	}
+
+	if (proto == IPPROTO_UDP) {
+		if (udph + 1 > data_end || !udph->check)
+			return -1;
+	} else if (proto != IPPROTO_TCP && proto != IPPROTO_ICMPV6) {
+		return -1;
+	}
+
+	/* csum_fold() complements, so this is the complement of the folded
+	 * pseudo-header sum
+	 */
+	*csum = csum_add(*csum, (__u16)csum_fold(pseudo));
+	return 0;
+}
+
+/* Makes room for len bytes of outer headers after the Ethernet header, and
+ * moves the Ethernet header to the new start of the packet. Returns the new
+ * Ethernet header pointer, or NULL on failure.
+ */
+static __always_inline struct ethhdr *encap_push_room(struct xdp_md *ctx,
+						      struct ethhdr *eth,
+						      int len)
+{
+	void *data_end;
+	struct ethhdr eth_cpy;
+
+	__builtin_memcpy(&eth_cpy, eth, sizeof(eth_cpy));
+
+	if (bpf_xdp_adjust_head(ctx, 0 - len))
+		return NULL;
+
+	/* Re-evaluate data and data_end after head adjustment */
+	data_end = (void *)(long)ctx->data_end;
+	eth = (void *)(long)ctx->data;
+	if (eth + 1 > data_end)
+		return NULL;
+
+	__builtin_memcpy(eth, &eth_cpy, sizeof(*eth));
+	return eth;
+}
+
+/* Removes len bytes of outer headers after the Ethernet header, and sets the
+ * Ethernet protocol to h_proto. Returns the new Ethernet header pointer, or
+ * NULL on failure.
+ */
+static __always_inline struct ethhdr *decap_pop_room(struct xdp_md *ctx,
+						     struct ethhdr *eth,
+						     int len, __be16 h_proto)
+{
+	void *data_end;
+	struct ethhdr eth_cpy;
+
+	__builtin_memcpy(&eth_cpy, eth, sizeof(eth_cpy));
+
+	if (bpf_xdp_adjust_head(ctx, len))
+		return NULL;
+
+	data_end = (void *)(long)ctx->data_end;
+	eth = (void *)(long)ctx->data;
+	if (eth + 1 > data_end)
+		return NULL;
+
+	__builtin_memcpy(eth, &eth_cpy, sizeof(*eth));
+	eth->h_proto = h_proto;
+	return eth;
+}
+
+static __always_inline void encap_fill_ipv4(struct iphdr *iph,
+					    __be32 saddr, __be32 daddr,
+					    __u8 proto, __u8 tos,
+					    __u16 payload_len)
+{
+	iph->version  = 4;
+	iph->ihl      = sizeof(*iph) >> 2;
+	iph->tos      = tos & INET_ECN_MASK;
+	iph->tot_len  = bpf_htons(sizeof(*iph) + payload_len);
+	iph->id       = 0;
+	iph->frag_off = 0;
+	iph->ttl      = ENCAP_TTL;
+	iph->protocol = proto;
+	iph->saddr    = saddr;
+	iph->daddr    = daddr;
+	iph->check    = ipv4_hdr_csum(iph);
+}
+
+static __always_inline void encap_fill_ipv6(struct ipv6hdr *ip6h,
+					    const struct in6_addr *saddr,
+					    const struct in6_addr *daddr,
+					    __u8 nexthdr, __u8 tos,
+					    __u16 payload_len)
+{
+	ip6h->version     = 6;
+	ip6h->priority    = 0;
+	ip6h->flow_lbl[0] = (tos & INET_ECN_MASK) << 4;
+	ip6h->flow_lbl[1] = 0;
+	ip6h->flow_lbl[2] = 0;
+	ip6h->payload_len = bpf_htons(payload_len);
+	ip6h->nexthdr     = nexthdr;
+	ip6h->hop_limit   = ENCAP_TTL;
+	ip6h->saddr       = *saddr;
+	ip6h->daddr       = *daddr;
+}
+
+static __always_inline void encap_fill_udp(struct udphdr *udph,
+					   __be16 sport, __be16 dport,
+					   __u16 payload_len)
+{
+	udph->source = sport;
+	udph->dest   = dport;
+	udph->len    = bpf_htons(sizeof(*udph) + payload_len);
+	udph->check  = 0;
+}
+
+/* Sets the checksum of an UDP header following an IPv6 header, with csum the
+ * sum of the UDP payload. IPv6 receivers drop UDP with a zero checksum unless
+ * configured otherwise (RFC 6935), so unlike over IPv4 it cannot be left out.
+ */
+static __always_inline void encap_udp6_csum(struct udphdr *udph,
+					    struct ipv6hdr *ip6h, __u32 csum)
+{
+	udph->check = 0;
+	csum = csum_words(udph, sizeof(*udph) / 2, csum);
+	udph->check = csum_ipv6_magic(ip6h->saddr.in6_u.u6_addr32,
+				      ip6h->daddr.in6_u.u6_addr32,
+				      bpf_ntohs(udph->len), IPPROTO_UDP, csum);
+	if (!udph->check)
+		udph->check = CSUM_MANGLED_0;
+}
+
+/*
+ * Common code for IPIP/IP6IP6 and GUE encapsulation. With a non-zero dport
+ * an UDP header is added after the outer IP header (GUE variant 1). The outer
+ * header is IPv6 if saddr6/daddr6 are given, IPv4 otherwise.
+ */
+static __always_inline int __ip_encap(struct xdp_md *ctx,
+				      __be32 saddr, __be32 daddr,
+				      const struct in6_addr *saddr6,
+				      const struct in6_addr *daddr6,
+				      __be16 sport, __be16 dport)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = (void *)(long)ctx->data;
+	int udp_len = dport ? sizeof(struct udphdr) : 0;
+	int l3_len = saddr6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr);
+	struct ipv6hdr *ip6h = NULL;
+	struct udphdr *udph;
+	struct iphdr *iph;
+	__u32 csum = 0;
+	__u8 proto, tos;
+	__u16 len;
+
+	if (eth + 1 > data_end)
+		return -1;
+
+	if (encap_inner_info(eth, data_end, &proto, &tos, &len) < 0)
+		return -1;
+
+	if (dport && saddr6 &&
+	    encap_inner_csum(eth + 1, data_end, eth->h_proto, &csum) < 0)
+		return -1;
+
+	eth = encap_push_room(ctx, eth, l3_len + udp_len);
+	if (!eth)
+		return -1;
+	data_end = (void *)(long)ctx->data_end;
+
+	if (dport)
+		proto = IPPROTO_UDP;
+
+	if (saddr6) {
+		ip6h = (void *)(eth + 1);
+		if (ip6h + 1 > data_end)
+			return -1;
+		encap_fill_ipv6(ip6h, saddr6, daddr6, proto, tos,
+				len + udp_len);
+		eth->h_proto = bpf_htons(ETH_P_IPV6);
+		udph = (void *)(ip6h + 1);
+	} else {
+		iph = (void *)(eth + 1);
+		if (iph + 1 > data_end)
+			return -1;
+		encap_fill_ipv4(iph, saddr, daddr, proto, tos, len + udp_len);
+		eth->h_proto = bpf_htons(ETH_P_IP);
+		udph = (void *)(iph + 1);
+	}
+
+	if (dport) {
+		if (udph + 1 > data_end)
+			return -1;
+		encap_fill_udp(udph, sport, dport, len);
+		if (ip6h)
+			encap_udp6_csum(udph, ip6h, csum);
+	}
+
+	return 0;
+}
+
+/* Encapsulates the IPv4 or IPv6 packet in an outer IPv4 header (IPIP/6in4) */
+static __always_inline int ipip_encap(struct xdp_md *ctx,
+				      __be32 saddr, __be32 daddr)
+{
+	return __ip_encap(ctx, saddr, daddr, NULL, NULL, 0, 0);
+}
+
+/* Encapsulates the IPv4 or IPv6 packet in an outer IPv6 header (IP6IP6/4in6) */
+static __always_inline int ip6ip6_encap(struct xdp_md *ctx,
+					const struct in6_addr *saddr,
+					const struct in6_addr *daddr)
+{
+	return __ip_encap(ctx, 0, 0, saddr, daddr, 0, 0);
+}
+
+/* Encapsulates the packet in outer IPv4 and UDP headers (GUE variant 1). The
+ * source port should carry flow entropy (e.g. a flow hash) for ECMP and RSS.
+ */
+static __always_inline int gue_encap_ipv4(struct xdp_md *ctx,
+					  __be32 saddr, __be32 daddr,
+					  __be16 sport)
+{
+	return __ip_encap(ctx, saddr, daddr, NULL, NULL,
+			  sport, bpf_htons(GUE_UDP_PORT));
+}
+
+static __always_inline int gue_encap_ipv6(struct xdp_md *ctx,
+					  const struct in6_addr *saddr,
+					  const struct in6_addr *daddr,
+					  __be16 sport)
+{
+	return __ip_encap(ctx, 0, 0, saddr, daddr,
+			  sport, bpf_htons(GUE_UDP_PORT));
+}
+
+/*
+ * Encapsulates the whole Ethernet frame in VXLAN. The outer Ethernet header
+ * is a copy of the inner one, so caller will normally rewrite the MAC
+ * addresses afterwards (e.g. from a bpf_fib_lookup()).
+ */
+static __always_inline int __vxlan_encap(struct xdp_md *ctx,
+					 __be32 saddr, __be32 daddr,
+					 const struct in6_addr *saddr6,
+					 const struct in6_addr *daddr6,
+					 __be16 sport, __u32 vni)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct ethhdr *eth = (void *)(long)ctx->data;
+	int l3_len = saddr6 ? sizeof(struct ipv6hdr) : sizeof(struct iphdr);
+	int len = sizeof(*eth) + l3_len + sizeof(struct udphdr) +
+		sizeof(struct vxlanhdr);
+	struct ethhdr *inner_eth;
+	struct ipv6hdr *ip6h = NULL;
+	struct vxlanhdr *vxh;
+	struct udphdr *udph;
+	struct iphdr *iph;
+	__u16 frame_len, ip_len;
+	__u32 csum = 0;
+	__u8 proto, tos;
+
+	if (eth + 1 > data_end)
+		return -1;
+
+	if (encap_inner_info(eth, data_end, &proto, &tos, &ip_len) < 0)
+		tos = 0;
+	/* The whole inner frame is carried, not just the IP packet */
+	frame_len = data_end - (void *)eth;
+
+	/* Over IPv6 the UDP checksum covers the inner frame, so it must be IP.
+	 * Any Ethernet padding is left out, as it is not in the sum.
+	 */
+	if (saddr6) {
+		if (encap_inner_csum(eth + 1, data_end, eth->h_proto,
+				     &csum) < 0 ||
+		    sizeof(*eth) + ip_len > frame_len)
+			return -1;
+		frame_len = sizeof(*eth) + ip_len;
+		csum = csum_words(eth, sizeof(*eth) / 2, csum);
+	}
+
+	/* The original Ethernet header stays in place as the inner header */
+	if (bpf_xdp_adjust_head(ctx, 0 - len))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	eth = (void *)(long)ctx->data;
+	inner_eth = (void *)eth + len;
+	if (inner_eth + 1 > data_end)
+		return -1;
+
+	__builtin_memcpy(eth, inner_eth, sizeof(*eth));
+
+	if (saddr6) {
+		ip6h = (void *)(eth + 1);
+		if (ip6h + 1 > data_end)
+			return -1;
+		encap_fill_ipv6(ip6h, saddr6, daddr6, IPPROTO_UDP, tos,
+				sizeof(*udph) + sizeof(*vxh) + frame_len);
+		eth->h_proto = bpf_htons(ETH_P_IPV6);
+		udph = (void *)(ip6h + 1);
+	} else {
+		iph = (void *)(eth + 1);
+		if (iph + 1 > data_end)
+			return -1;
+		encap_fill_ipv4(iph, saddr, daddr, IPPROTO_UDP, tos,
+				sizeof(*udph) + sizeof(*vxh) + frame_len);
+		eth->h_proto = bpf_htons(ETH_P_IP);
+		udph = (void *)(iph + 1);
+	}
+
+	vxh = (void *)(udph + 1);
+	if (vxh + 1 > data_end)
+		return -1;
+
+	encap_fill_udp(udph, sport, bpf_htons(VXLAN_UDP_PORT),
+		       sizeof(*vxh) + frame_len);
+	vxh->vx_flags = bpf_htonl(VXLAN_FLAG_VNI);
+	vxh->vx_vni   = bpf_htonl(vni << 8);
+	if (ip6h)
+		encap_udp6_csum(udph, ip6h, csum_words(vxh, sizeof(*vxh) / 2,
+						       csum));
+
+	return 0;
+}
+
+static __always_inline int vxlan_encap_ipv4(struct xdp_md *ctx,
+					    __be32 saddr, __be32 daddr,
+					    __be16 sport, __u32 vni)
+{
+	return __vxlan_encap(ctx, saddr, daddr, NULL, NULL, sport, vni);
+}
+
+static __always_inline int vxlan_encap_ipv6(struct xdp_md *ctx,
+					    const struct in6_addr *saddr,
+					    const struct in6_addr *daddr,
+					    __be16 sport, __u32 vni)
+{
+	return __vxlan_encap(ctx, 0, 0, saddr, daddr, sport, vni);
+}
+
+/* Propagates a CE mark from the outer header to the inner packet, which
+ * starts at inner (RFC 6040). The IPv4 checksum is patched incrementally.
+ */
+static __always_inline void decap_ecn(void *inner, void *data_end,
+				      __be16 inner_proto, __u8 outer_tos)
+{
+	struct ipv6hdr *ip6h = inner;
+	struct iphdr *iph = inner;
+
+	if ((outer_tos & INET_ECN_MASK) != INET_ECN_CE)
+		return;
+
+	if (inner_proto == bpf_htons(ETH_P_IP)) {
+		if (iph + 1 > data_end)
+			return;
+		ipv4_set_ce(iph);
+	} else if (inner_proto == bpf_htons(ETH_P_IPV6)) {
+		if (ip6h + 1 > data_end)
+			return;
+		ipv6_set_ce(ip6h);
+	}
+}
+
+/* Parses the outer IP header, which must follow an untagged Ethernet header.
+ * Returns the outer L4 protocol, and the outer header length and ECN field.
+ */
+static __always_inline int decap_parse_outer(struct hdr_cursor *nh,
+					     void *data_end,
+					     struct ethhdr **eth,
+					     int *outer_len, __u8 *outer_tos)
+{
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	int eth_type, proto;
+
+	eth_type = parse_ethhdr(nh, data_end, eth);
+	if (eth_type < 0 || proto_is_vlan((*eth)->h_proto))
+		return -1;
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		proto = parse_iphdr(nh, data_end, &iph);
+		if (proto < 0)
+			return -1;
+		*outer_tos = iph->tos;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		proto = parse_ip6hdr(nh, data_end, &ip6h);
+		if (proto < 0)
+			return -1;
+		*outer_tos = ipv6_get_tclass(ip6h);
+	} else {
+		return -1;
+	}
+
+	*outer_len = nh->pos - (void *)(*eth + 1);
+	return proto;
+}
+
+/* Removes an outer IPv4 or IPv6 header carrying an IPv4 or IPv6 packet */
+static __always_inline int ipip_decap(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct ethhdr *eth;
+	__be16 inner_proto;
+	int proto, len;
+	__u8 tos;
+
+	proto = decap_parse_outer(&nh, data_end, &eth, &len, &tos);
+	if (proto == IPPROTO_IPIP)
+		inner_proto = bpf_htons(ETH_P_IP);
+	else if (proto == IPPROTO_IPV6)
+		inner_proto = bpf_htons(ETH_P_IPV6);
+	else
+		return -1;
+
+	eth = decap_pop_room(ctx, eth, len, inner_proto);
+	if (!eth)
+		return -1;
+
+	decap_ecn(eth + 1, (void *)(long)ctx->data_end, inner_proto, tos);
+	return 0;
+}
+
+/* Removes outer IP and UDP headers of a GUE variant 1 packet */
+static __always_inline int gue_decap(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct ethhdr *eth;
+	struct udphdr *udph;
+	__be16 inner_proto;
+	int proto, len;
+	__u8 *version;
+	__u8 tos;
+
+	proto = decap_parse_outer(&nh, data_end, &eth, &len, &tos);
+	if (proto != IPPROTO_UDP)
+		return -1;
+
+	if (parse_udphdr(&nh, data_end, &udph) < 0 ||
+	    udph->dest != bpf_htons(GUE_UDP_PORT))
+		return -1;
+
+	/* Variant 1: the IP version field tells the inner protocol */
+	version = nh.pos;
+	if (version + 1 > data_end)
+		return -1;
+
+	if ((*version >> 4) == 4)
+		inner_proto = bpf_htons(ETH_P_IP);
+	else if ((*version >> 4) == 6)
+		inner_proto = bpf_htons(ETH_P_IPV6);
+	else
+		return -1;
+
+	eth = decap_pop_room(ctx, eth, len + sizeof(*udph), inner_proto);
+	if (!eth)
+		return -1;
+
+	decap_ecn(eth + 1, (void *)(long)ctx->data_end, inner_proto, tos);
+	return 0;
+}
+
+/* Removes outer Ethernet, IP, UDP and VXLAN headers, leaving the inner frame */
+static __always_inline int vxlan_decap(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	struct hdr_cursor nh = { .pos = (void *)(long)ctx->data };
+	struct ethhdr *eth, *inner_eth;
+	struct vxlanhdr *vxh;
+	struct udphdr *udph;
+	int proto, len;
+	__u8 tos;
+
+	proto = decap_parse_outer(&nh, data_end, &eth, &len, &tos);
+	if (proto != IPPROTO_UDP)
+		return -1;
+
+	if (parse_udphdr(&nh, data_end, &udph) < 0 ||
+	    udph->dest != bpf_htons(VXLAN_UDP_PORT))
+		return -1;
+
+	if (parse_vxlanhdr(&nh, data_end, &vxh) < 0)
+		return -1;
+
+	/* Nothing to copy, the inner frame already has an Ethernet header */
+	if (bpf_xdp_adjust_head(ctx, nh.pos - (void *)eth))
+		return -1;
+
+	data_end = (void *)(long)ctx->data_end;
+	inner_eth = (void *)(long)ctx->data;
+	if (inner_eth + 1 > data_end)
+		return -1;
+
+	decap_ecn(inner_eth + 1, data_end, inner_eth->h_proto, tos);
+	return 0;
+}
+
 #endif /* __REWRITE_HELPERS_H */
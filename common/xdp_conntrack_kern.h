@@ -0,0 +1,366 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used *ONLY* by BPF-prog running kernel side. */
+#ifndef __XDP_CONNTRACK_KERN_H
+#define __XDP_CONNTRACK_KERN_H
+
+/*
+ * Connection tracking for XDP programs.
+ *
+ * Flows live in xdp_ct_map, an LRU hash keyed by the normalized 5-tuple (see
+ * struct xdp_ct_key), so both directions find the same entry. Each entry
+ * keeps a TCP state, per-direction counters and the time it was last seen.
+ *
+ * Entries expire by themselves: every entry carries a bpf_timer that fires
+ * after the idle timeout of its state. The callback deletes the entry if it
+ * has been idle that long, or re-arms the timer for the time left. Packets
+ * therefore only update last_seen, and userspace never has to sweep the
+ * table. Under memory pressure the LRU evicts the least recently used
+ * entries first, which cancels their timers.
+ *
+ * Usage, with parsing_helpers.h included first:
+ *
+ *	struct xdp_ct_entry *ct;
+ *	int dir;
+ *
+ *	ct = xdp_ct_track_packet(ctx, &dir);
+ *	if (ct && ct->tcp_state == XDP_CT_TCP_ESTABLISHED) ...
+ *
+ * Programs that already parsed the packet can fill the key with
+ * xdp_ct_key_init() and call xdp_ct_track() directly. bpf_timer needs a
+ * GPL-compatible license and kernel 5.15 or later.
+ */
+
+#ifndef __XDP_CONNTRACK_KERN_USER_H
+#warning "You forgot to #include <../common/xdp_conntrack_kern_user.h>"
+#include <../common/xdp_conntrack_kern_user.h>
+#endif
+
+#ifndef IP_MF
+#define IP_MF		0x2000
+#endif
+#ifndef IP_OFFSET
+#define IP_OFFSET	0x1fff
+#endif
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ULL
+#endif
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+
+/* TCP header flag bits, as in byte 13 of the header */
+#define XDP_CT_TCP_FIN		0x01
+#define XDP_CT_TCP_SYN		0x02
+#define XDP_CT_TCP_RST		0x04
+#define XDP_CT_TCP_ACK		0x10
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct xdp_ct_key);
+	__type(value, struct xdp_ct_entry);
+	__uint(max_entries, XDP_CT_MAX_ENTRIES);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_ct_map SEC(".maps");
+
+static __always_inline __u64 xdp_ct_timeout(__u8 proto, __u8 tcp_state)
+{
+	if (proto == IPPROTO_UDP)
+		return XDP_CT_TIMEOUT_UDP * NSEC_PER_SEC;
+	if (proto != IPPROTO_TCP)
+		return XDP_CT_TIMEOUT_OTHER * NSEC_PER_SEC;
+
+	switch (tcp_state) {
+	case XDP_CT_TCP_ESTABLISHED:
+		return XDP_CT_TIMEOUT_EST * NSEC_PER_SEC;
+	case XDP_CT_TCP_FIN_WAIT:
+	case XDP_CT_TCP_CLOSE:
+		return XDP_CT_TIMEOUT_CLOSE * NSEC_PER_SEC;
+	default:
+		return XDP_CT_TIMEOUT_SYN * NSEC_PER_SEC;
+	}
+}
+
+static int xdp_ct_timer_cb(void *map, struct xdp_ct_key *key,
+			   struct xdp_ct_entry *ct)
+{
+	__u64 timeout = xdp_ct_timeout(key->proto, ct->tcp_state);
+	__s64 idle = bpf_ktime_get_ns() - ct->last_seen;
+
+	/* Another CPU can refresh last_seen after the clock was read */
+	if (idle < 0)
+		idle = 0;
+
+	if (idle >= timeout)
+		bpf_map_delete_elem(map, key);
+	else
+		bpf_timer_start(&ct->timer, timeout - idle, 0);
+	return 0;
+}
+
+static __always_inline void xdp_ct_addr_copy(__be32 *dst, const __be32 *src,
+					    __u8 family)
+{
+	dst[0] = src[0];
+	if (family == AF_INET6) {
+		dst[1] = src[1];
+		dst[2] = src[2];
+		dst[3] = src[3];
+	}
+}
+
+/* Fills the key for a packet from saddr:sport to daddr:dport (addresses of
+ * 1 word for IPv4, 4 for IPv6). Returns 1 if the sender is the hi side of
+ * the key, 0 if it is the lo side.
+ */
+static __always_inline int xdp_ct_key_init(struct xdp_ct_key *key,
+					   const __be32 *saddr,
+					   const __be32 *daddr,
+					   __be16 sport, __be16 dport,
+					   __u8 proto, __u8 family)
+{
+	int words = family == AF_INET6 ? 4 : 1;
+	int i, cmp = 0;
+
+	#pragma unroll
+	for (i = 0; i < 4; i++) {
+		if (i >= words || cmp)
+			break;
+		if (saddr[i] != daddr[i])
+			cmp = bpf_ntohl(saddr[i]) < bpf_ntohl(daddr[i]) ? -1 : 1;
+	}
+	if (!cmp && sport != dport)
+		cmp = bpf_ntohs(sport) < bpf_ntohs(dport) ? -1 : 1;
+
+	__builtin_memset(key, 0, sizeof(*key));
+	key->proto = proto;
+	key->family = family;
+	if (cmp <= 0) {
+		xdp_ct_addr_copy(key->addr_lo, saddr, family);
+		xdp_ct_addr_copy(key->addr_hi, daddr, family);
+		key->port_lo = sport;
+		key->port_hi = dport;
+		return 0;
+	}
+	xdp_ct_addr_copy(key->addr_lo, daddr, family);
+	xdp_ct_addr_copy(key->addr_hi, saddr, family);
+	key->port_lo = dport;
+	key->port_hi = sport;
+	return 1;
+}
+
+/* Moves the TCP state along for a packet with tcp_flags sent in direction
+ * dir. This is a loose tracker: it follows the flags only, not the sequence
+ * numbers.
+ */
+static __always_inline void xdp_ct_tcp_update(struct xdp_ct_entry *ct,
+					      int dir, __u8 tcp_flags)
+{
+	__u8 state = ct->tcp_state;
+
+	if (tcp_flags & XDP_CT_TCP_RST) {
+		state = XDP_CT_TCP_CLOSE;
+	} else if (tcp_flags & XDP_CT_TCP_FIN) {
+		ct->flags |= dir == XDP_CT_DIR_ORIG ? XDP_CT_F_FIN_ORIG :
+						      XDP_CT_F_FIN_REPLY;
+		if ((ct->flags & XDP_CT_F_FIN_ORIG) &&
+		    (ct->flags & XDP_CT_F_FIN_REPLY))
+			state = XDP_CT_TCP_CLOSE;
+		else if (state != XDP_CT_TCP_CLOSE)
+			state = XDP_CT_TCP_FIN_WAIT;
+	} else if (state == XDP_CT_TCP_SYN_SENT) {
+		if (dir == XDP_CT_DIR_REPLY &&
+		    (tcp_flags & (XDP_CT_TCP_SYN | XDP_CT_TCP_ACK)) ==
+		    (XDP_CT_TCP_SYN | XDP_CT_TCP_ACK))
+			state = XDP_CT_TCP_SYN_RECV;
+	} else if (state == XDP_CT_TCP_SYN_RECV) {
+		if (dir == XDP_CT_DIR_ORIG &&
+		    (tcp_flags & (XDP_CT_TCP_SYN | XDP_CT_TCP_ACK)) ==
+		    XDP_CT_TCP_ACK)
+			state = XDP_CT_TCP_ESTABLISHED;
+	} else if (state == XDP_CT_TCP_CLOSE &&
+		   (tcp_flags & (XDP_CT_TCP_SYN | XDP_CT_TCP_ACK)) ==
+		   XDP_CT_TCP_SYN) {
+		/* The 5-tuple is being reused for a new connection */
+		ct->flags &= ~(XDP_CT_F_FIN_ORIG | XDP_CT_F_FIN_REPLY);
+		state = XDP_CT_TCP_SYN_SENT;
+	}
+
+	if (state == ct->tcp_state)
+		return;
+
+	ct->tcp_state = state;
+	/* The timer may be set for a longer timeout than the new state has */
+	bpf_timer_start(&ct->timer, xdp_ct_timeout(IPPROTO_TCP, state), 0);
+}
+
+/* Creates the entry for a flow's first packet, with its timer armed.
+ * Returns NULL if the map is full of entries that cannot be evicted.
+ */
+static __always_inline struct xdp_ct_entry *xdp_ct_create(struct xdp_ct_key *key,
+							  int from_hi,
+							  __u8 tcp_flags,
+							  __u64 now)
+{
+	struct xdp_ct_entry new_ct = {};
+	struct xdp_ct_entry *ct;
+
+	new_ct.created = now;
+	new_ct.last_seen = now;
+	if (from_hi)
+		new_ct.flags = XDP_CT_F_ORIG_HI;
+	if (key->proto == IPPROTO_TCP) {
+		/* Flows picked up mid-stream are taken as established */
+		if ((tcp_flags & (XDP_CT_TCP_SYN | XDP_CT_TCP_ACK)) ==
+		    XDP_CT_TCP_SYN)
+			new_ct.tcp_state = XDP_CT_TCP_SYN_SENT;
+		else
+			new_ct.tcp_state = XDP_CT_TCP_ESTABLISHED;
+	}
+
+	/* Another CPU may win the race to create it, then we use theirs */
+	bpf_map_update_elem(&xdp_ct_map, key, &new_ct, BPF_NOEXIST);
+	ct = bpf_map_lookup_elem(&xdp_ct_map, key);
+	if (!ct)
+		return NULL;
+
+	/* Fails with -EBUSY if the winner already set up the timer */
+	if (!bpf_timer_init(&ct->timer, &xdp_ct_map, CLOCK_MONOTONIC)) {
+		bpf_timer_set_callback(&ct->timer, xdp_ct_timer_cb);
+		bpf_timer_start(&ct->timer,
+				xdp_ct_timeout(key->proto, ct->tcp_state), 0);
+	}
+	return ct;
+}
+
+/* Accounts a packet of len bytes to its flow, creating the entry if needed.
+ * from_hi is what xdp_ct_key_init() returned, and *dir is set to the packet's
+ * XDP_CT_DIR_*. Returns the entry, or NULL if it could not be created.
+ */
+static __always_inline struct xdp_ct_entry *xdp_ct_track(struct xdp_ct_key *key,
+							 int from_hi,
+							 __u8 tcp_flags,
+							 __u32 len, int *dir)
+{
+	__u64 now = bpf_ktime_get_ns();
+	struct xdp_ct_entry *ct;
+	int d;
+
+	ct = bpf_map_lookup_elem(&xdp_ct_map, key);
+	if (!ct) {
+		ct = xdp_ct_create(key, from_hi, tcp_flags, now);
+		if (!ct)
+			return NULL;
+	}
+
+	d = !!(ct->flags & XDP_CT_F_ORIG_HI) != from_hi;
+	ct->last_seen = now;
+	if (key->proto == IPPROTO_TCP)
+		xdp_ct_tcp_update(ct, d, tcp_flags);
+
+	if (d == XDP_CT_DIR_ORIG) {
+		__sync_fetch_and_add(&ct->dir[XDP_CT_DIR_ORIG].packets, 1);
+		__sync_fetch_and_add(&ct->dir[XDP_CT_DIR_ORIG].bytes, len);
+	} else {
+		__sync_fetch_and_add(&ct->dir[XDP_CT_DIR_REPLY].packets, 1);
+		__sync_fetch_and_add(&ct->dir[XDP_CT_DIR_REPLY].bytes, len);
+	}
+
+	*dir = d;
+	return ct;
+}
+
+/* Parses the packet and tracks it. TCP and UDP flows are keyed by their
+ * ports, ICMP echo by the echo id; other IP protocols and fragments get one
+ * flow per address pair. IPv6 extension headers are skipped. Returns NULL
+ * for non-IP or truncated packets.
+ */
+static __always_inline struct xdp_ct_entry *xdp_ct_track_packet(struct xdp_md *ctx,
+								int *dir)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	__be16 sport = 0, dport = 0;
+	struct icmphdr_common *icmph;
+	struct ipv6_frag_info frag;
+	struct xdp_ct_key key;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	int eth_type, ip_type, from_hi;
+	__u8 tcp_flags = 0;
+	__u8 family, is_frag;
+	__be32 *saddr, *daddr;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+		if (ip_type < 0)
+			return NULL;
+		family = AF_INET;
+		saddr = &iph->saddr;
+		daddr = &iph->daddr;
+		is_frag = !!(iph->frag_off & bpf_htons(IP_MF | IP_OFFSET));
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ip6h, &frag);
+		if (ip_type < 0)
+			return NULL;
+		family = AF_INET6;
+		is_frag = frag.is_frag;
+		saddr = ip6h->saddr.in6_u.u6_addr32;
+		daddr = ip6h->daddr.in6_u.u6_addr32;
+	} else {
+		return NULL;
+	}
+
+	/* Only the first fragment has the L4 header, so fragments are
+	 * tracked per address pair, like other protocols
+	 */
+	if (is_frag)
+		goto track;
+
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(&nh, data_end, &tcph) < 0)
+			return NULL;
+		sport = tcph->source;
+		dport = tcph->dest;
+		tcp_flags = ((__u8 *)tcph)[13];
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udph) < 0)
+			return NULL;
+		sport = udph->source;
+		dport = udph->dest;
+	} else if (ip_type == IPPROTO_ICMP || ip_type == IPPROTO_ICMPV6) {
+		if (parse_icmphdr_common(&nh, data_end, &icmph) < 0)
+			return NULL;
+		if (ip_type == IPPROTO_ICMP ?
+		    icmph->type == ICMP_ECHO || icmph->type == ICMP_ECHOREPLY :
+		    icmph->type == ICMPV6_ECHO_REQUEST ||
+		    icmph->type == ICMPV6_ECHO_REPLY) {
+			/* Both directions carry the same id */
+			if ((void *)(icmph + 1) + sizeof(__be16) > data_end)
+				return NULL;
+			sport = *(__be16 *)(icmph + 1);
+			dport = sport;
+		}
+	}
+
+track:
+	from_hi = xdp_ct_key_init(&key, saddr, daddr, sport, dport,
+				  ip_type, family);
+	return xdp_ct_track(&key, from_hi, tcp_flags, data_end - data, dir);
+}
+
+#endif /* __XDP_CONNTRACK_KERN_H */
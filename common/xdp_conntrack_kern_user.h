@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used by BPF-prog kernel side BPF-progs and userspace programs,
+ * for sharing the xdp_conntrack structs and DEFINEs.
+ */
+#ifndef __XDP_CONNTRACK_KERN_USER_H
+#define __XDP_CONNTRACK_KERN_USER_H
+
+#define XDP_CT_MAX_ENTRIES	262144
+
+/* Idle timeouts in seconds */
+#define XDP_CT_TIMEOUT_SYN	60
+#define XDP_CT_TIMEOUT_EST	3600
+#define XDP_CT_TIMEOUT_CLOSE	10
+#define XDP_CT_TIMEOUT_UDP	30
+#define XDP_CT_TIMEOUT_OTHER	30
+
+enum xdp_ct_tcp_state {
+	XDP_CT_TCP_NONE = 0,	/* not TCP */
+	XDP_CT_TCP_SYN_SENT,
+	XDP_CT_TCP_SYN_RECV,
+	XDP_CT_TCP_ESTABLISHED,
+	XDP_CT_TCP_FIN_WAIT,	/* one side has sent a FIN */
+	XDP_CT_TCP_CLOSE,	/* both FINs, or a RST */
+	XDP_CT_TCP_MAX,
+};
+
+/* Packet directions, relative to the first packet seen */
+#define XDP_CT_DIR_ORIG		0
+#define XDP_CT_DIR_REPLY	1
+
+/* xdp_ct_entry.flags */
+#define XDP_CT_F_ORIG_HI	(1U << 0) /* first packet was sent by the hi side */
+#define XDP_CT_F_FIN_ORIG	(1U << 1) /* FIN seen in the original direction */
+#define XDP_CT_F_FIN_REPLY	(1U << 2)
+
+/* Both directions of a flow share one key: the endpoint that compares lower
+ * (address, then port) is "lo". IPv4 addresses use addr[0] only.
+ */
+struct xdp_ct_key {
+	__be32 addr_lo[4];
+	__be32 addr_hi[4];
+	__be16 port_lo;
+	__be16 port_hi;
+	__u8 proto;
+	__u8 family;
+	__u16 pad;
+};
+
+struct xdp_ct_counters {
+	__u64 packets;
+	__u64 bytes;
+};
+
+struct xdp_ct_entry {
+	struct bpf_timer timer;	/* expires the entry, see xdp_conntrack_kern.h */
+	__u64 created;		/* bpf_ktime_get_ns() */
+	__u64 last_seen;
+	struct xdp_ct_counters dir[2];	/* indexed by XDP_CT_DIR_* */
+	__u32 flags;
+	__u8 tcp_state;
+	__u8 pad[3];
+};
+
+/* What the conntrack iterator program writes out for each entry */
+struct xdp_ct_dump_rec {
+	struct xdp_ct_key key;
+	__u64 created;
+	__u64 last_seen;
+	struct xdp_ct_counters dir[2];
+	__u32 flags;
+	__u32 tcp_state;
+};
+
+#endif /* __XDP_CONNTRACK_KERN_USER_H */
@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used *ONLY* by BPF-prog running kernel side. */
+#ifndef __XDP_FILTER_KERN_H
+#define __XDP_FILTER_KERN_H
+
+/*
+ * Packet filter for XDP programs, e.g. to select the packets to capture.
+ *
+ * Userspace compiles a tcpdump-style expression (see xdp_filter_user.h) into
+ * a table of rules in xdp_filter_map, one rule per "or"ed term. The program
+ * calls xdp_filter_match() with the number of rules in use, which it gets
+ * from userspace through its own config map.
+ */
+
+#include <linux/in.h>
+#include <bpf/bpf_endian.h>
+
+#include "parsing_helpers.h"
+#include "xdp_filter_kern_user.h"
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+
+/* from include/net/ip.h */
+#ifndef IP_OFFSET
+#define IP_OFFSET	0x1fff
+#endif
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct xdp_filter_rule);
+	__uint(max_entries, XDP_FILTER_RULES_MAX);
+} xdp_filter_map SEC(".maps");
+
+/* The packet fields the filter looks at */
+struct xdp_filter_pkt {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 family;
+	__u8 proto;
+	__u8 has_ports;	/* false for non-TCP/UDP and non-first fragments */
+};
+
+static __always_inline int xdp_filter_parse(void *data, void *data_end,
+					    struct xdp_filter_pkt *pkt)
+{
+	struct hdr_cursor nh = { .pos = data };
+	struct ipv6_frag_info frag;
+	struct ipv6hdr *ip6h;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+	struct ethhdr *eth;
+	struct iphdr *iph;
+	int eth_type, ip_type;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+		if (ip_type < 0)
+			return -1;
+		pkt->family = AF_INET;
+		pkt->saddr[0] = iph->saddr;
+		pkt->daddr[0] = iph->daddr;
+		if (iph->frag_off & bpf_htons(IP_OFFSET))
+			goto out;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ip6h, &frag);
+		if (ip_type < 0)
+			return -1;
+		pkt->family = AF_INET6;
+		__builtin_memcpy(pkt->saddr, &ip6h->saddr, sizeof(pkt->saddr));
+		__builtin_memcpy(pkt->daddr, &ip6h->daddr, sizeof(pkt->daddr));
+		if (frag.offset)
+			goto out;
+	} else {
+		return -1;
+	}
+
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(&nh, data_end, &tcph) < 0)
+			goto out;
+		pkt->sport = tcph->source;
+		pkt->dport = tcph->dest;
+		pkt->has_ports = 1;
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(&nh, data_end, &udph) < 0)
+			goto out;
+		pkt->sport = udph->source;
+		pkt->dport = udph->dest;
+		pkt->has_ports = 1;
+	}
+
+out:
+	pkt->proto = ip_type;
+	return 0;
+}
+
+static __always_inline int xdp_filter_addr_eq(const __be32 *addr,
+					      const struct xdp_filter_addr *m)
+{
+	return (addr[0] & m->mask[0]) == m->addr[0] &&
+	       (addr[1] & m->mask[1]) == m->addr[1] &&
+	       (addr[2] & m->mask[2]) == m->addr[2] &&
+	       (addr[3] & m->mask[3]) == m->addr[3];
+}
+
+static __always_inline
+int xdp_filter_addr_match(const struct xdp_filter_pkt *pkt,
+			  const struct xdp_filter_addr *m)
+{
+	switch (m->dir) {
+	case XDP_FILTER_DIR_NONE:
+		return 1;
+	case XDP_FILTER_DIR_SRC:
+		return xdp_filter_addr_eq(pkt->saddr, m);
+	case XDP_FILTER_DIR_DST:
+		return xdp_filter_addr_eq(pkt->daddr, m);
+	default:
+		return xdp_filter_addr_eq(pkt->saddr, m) ||
+		       xdp_filter_addr_eq(pkt->daddr, m);
+	}
+}
+
+static __always_inline
+int xdp_filter_port_match(const struct xdp_filter_pkt *pkt,
+			  const struct xdp_filter_port *m)
+{
+	if (m->dir == XDP_FILTER_DIR_NONE)
+		return 1;
+	if (!pkt->has_ports)
+		return 0;
+
+	switch (m->dir) {
+	case XDP_FILTER_DIR_SRC:
+		return pkt->sport == m->port;
+	case XDP_FILTER_DIR_DST:
+		return pkt->dport == m->port;
+	default:
+		return pkt->sport == m->port || pkt->dport == m->port;
+	}
+}
+
+static __always_inline
+int xdp_filter_rule_match(const struct xdp_filter_pkt *pkt,
+			  const struct xdp_filter_rule *rule)
+{
+	if (rule->family && rule->family != pkt->family)
+		return 0;
+	if (rule->proto && rule->proto != pkt->proto)
+		return 0;
+
+	return xdp_filter_addr_match(pkt, &rule->addr[0]) &&
+	       xdp_filter_addr_match(pkt, &rule->addr[1]) &&
+	       xdp_filter_port_match(pkt, &rule->port[0]) &&
+	       xdp_filter_port_match(pkt, &rule->port[1]);
+}
+
+/* Returns 1 if the packet matches one of the first nr_rules rules, or if
+ * nr_rules is 0
+ */
+static __always_inline int xdp_filter_match(void *data, void *data_end,
+					    __u32 nr_rules)
+{
+	struct xdp_filter_pkt pkt = {};
+	struct xdp_filter_rule *rule;
+	__u32 i;
+
+	if (!nr_rules)
+		return 1;
+
+	if (xdp_filter_parse(data, data_end, &pkt) < 0)
+		return 0;
+
+	for (i = 0; i < XDP_FILTER_RULES_MAX; i++) {
+		if (i >= nr_rules)
+			break;
+		rule = bpf_map_lookup_elem(&xdp_filter_map, &i);
+		if (rule && xdp_filter_rule_match(&pkt, rule))
+			return 1;
+	}
+	return 0;
+}
+
+#endif /* __XDP_FILTER_KERN_H */
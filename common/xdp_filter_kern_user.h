@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used by BPF-prog kernel side BPF-progs and userspace programs,
+ * for sharing the xdp_filter structs and DEFINEs.
+ */
+#ifndef __XDP_FILTER_KERN_USER_H
+#define __XDP_FILTER_KERN_USER_H
+
+/* Size of xdp_filter_map, i.e. the number of "or"ed filter terms */
+#define XDP_FILTER_RULES_MAX	8
+
+/* Which packet field an xdp_filter_addr/xdp_filter_port applies to */
+enum xdp_filter_dir {
+	XDP_FILTER_DIR_NONE = 0,	/* unused, always matches */
+	XDP_FILTER_DIR_SRC,
+	XDP_FILTER_DIR_DST,
+	XDP_FILTER_DIR_ANY,	/* either source or destination */
+};
+
+/* The packet address matches if (addr & mask) == this addr. IPv4 uses
+ * word 0 only, the rest of addr and mask is zero.
+ */
+struct xdp_filter_addr {
+	__be32 addr[4];
+	__be32 mask[4];
+	__u8 dir;
+	__u8 pad[3];
+};
+
+struct xdp_filter_port {
+	__be16 port;
+	__u8 dir;
+	__u8 pad;
+};
+
+/* One filter term, i.e. a list of primitives joined by "and". A packet is
+ * accepted if it matches any of the first nr_rules rules in xdp_filter_map.
+ * Zero fields match anything.
+ */
+struct xdp_filter_rule {
+	__u8 family;		/* AF_INET or AF_INET6 */
+	__u8 proto;		/* L4 protocol */
+	__u16 pad;
+	struct xdp_filter_addr addr[2];
+	struct xdp_filter_port port[2];
+};
+
+#endif /* __XDP_FILTER_KERN_USER_H */
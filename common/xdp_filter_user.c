@@ -0,0 +1,260 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Compiles tcpdump-style filter expressions for xdp_filter_kern.h */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <bpf/bpf.h>
+
+#include "xdp_filter_kern_user.h"
+#include "xdp_filter_user.h"
+
+/* Turns a prefix length into a mask over words 32-bit words */
+static void prefix_to_mask(__be32 *mask, int words, int prefixlen)
+{
+	int i, bits;
+
+	for (i = 0; i < words; i++) {
+		bits = prefixlen - i * 32;
+		if (bits >= 32)
+			mask[i] = 0xffffffff;
+		else
+			mask[i] = bits <= 0 ? 0 : htonl(~0U << (32 - bits));
+	}
+}
+
+static int rule_set_family(struct xdp_filter_rule *rule, int family)
+{
+	if (rule->family && rule->family != family)
+		return -1;
+	rule->family = family;
+	return 0;
+}
+
+static int rule_set_proto(struct xdp_filter_rule *rule, int proto)
+{
+	if (rule->proto && rule->proto != proto)
+		return -1;
+	rule->proto = proto;
+	return 0;
+}
+
+static int rule_add_addr(struct xdp_filter_rule *rule, int dir, char *arg,
+			 bool is_net)
+{
+	struct xdp_filter_addr *m;
+	int i, family;
+	char *slash, *end;
+	long len = -1;
+
+	for (i = 0; i < 2 && rule->addr[i].dir; i++)
+		;
+	if (i == 2) {
+		fprintf(stderr, "ERR: filter: at most 2 addresses per term\n");
+		return -1;
+	}
+	m = &rule->addr[i];
+
+	slash = strchr(arg, '/');
+	if (slash) {
+		*slash = '\0';
+		errno = 0;
+		len = strtol(slash + 1, &end, 10);
+		if (errno || end == slash + 1 || *end || len < 0) {
+			fprintf(stderr, "ERR: filter: bad prefix length '%s'\n",
+				slash + 1);
+			return -1;
+		}
+	}
+	if (slash && !is_net) {
+		fprintf(stderr, "ERR: filter: use 'net' for %s/%ld\n", arg, len);
+		return -1;
+	}
+
+	if (inet_pton(AF_INET, arg, m->addr) == 1 && len <= 32) {
+		family = AF_INET;
+		prefix_to_mask(m->mask, 1, len < 0 ? 32 : len);
+	} else if (inet_pton(AF_INET6, arg, m->addr) == 1 && len <= 128) {
+		family = AF_INET6;
+		prefix_to_mask(m->mask, 4, len < 0 ? 128 : len);
+	} else {
+		fprintf(stderr, "ERR: filter: bad address '%s'\n", arg);
+		return -1;
+	}
+	if (rule_set_family(rule, family)) {
+		fprintf(stderr, "ERR: filter: '%s' never matches\n", arg);
+		return -1;
+	}
+
+	for (i = 0; i < 4; i++)
+		m->addr[i] &= m->mask[i];
+	m->dir = dir;
+	return 0;
+}
+
+static int rule_add_port(struct xdp_filter_rule *rule, int dir, const char *arg)
+{
+	char *end;
+	long port;
+	int i;
+
+	for (i = 0; i < 2 && rule->port[i].dir; i++)
+		;
+	if (i == 2) {
+		fprintf(stderr, "ERR: filter: at most 2 ports per term\n");
+		return -1;
+	}
+
+	errno = 0;
+	port = strtol(arg, &end, 10);
+	if (errno || end == arg || *end || port < 0 || port > 65535) {
+		fprintf(stderr, "ERR: filter: bad port '%s'\n", arg);
+		return -1;
+	}
+	rule->port[i].port = htons(port);
+	rule->port[i].dir = dir;
+	return 0;
+}
+
+/* The words that start a host, net or port primitive */
+static bool is_qualifier(const char *word)
+{
+	return !strcmp(word, "src") || !strcmp(word, "dst") ||
+	       !strcmp(word, "host") || !strcmp(word, "net") ||
+	       !strcmp(word, "port");
+}
+
+/* Parses one primitive starting at argv[*i], leaving *i at its last word */
+static int parse_primitive(struct xdp_filter_rule *rule, char **argv, int argc,
+			   int *i)
+{
+	static const struct {
+		const char *name;
+		int family;
+		int proto;
+	} protos[] = {
+		{ "ip",    AF_INET,  0 },
+		{ "ip6",   AF_INET6, 0 },
+		{ "tcp",   0,        IPPROTO_TCP },
+		{ "udp",   0,        IPPROTO_UDP },
+		{ "icmp",  AF_INET,  IPPROTO_ICMP },
+		{ "icmp6", AF_INET6, IPPROTO_ICMPV6 },
+	};
+	int dir = XDP_FILTER_DIR_ANY;
+	const char *kw;
+	size_t p;
+
+	for (p = 0; p < sizeof(protos) / sizeof(protos[0]); p++) {
+		if (strcmp(argv[*i], protos[p].name))
+			continue;
+		if ((protos[p].family &&
+		     rule_set_family(rule, protos[p].family)) ||
+		    (protos[p].proto && rule_set_proto(rule, protos[p].proto))) {
+			fprintf(stderr, "ERR: filter: '%s' never matches\n",
+				argv[*i]);
+			return -1;
+		}
+		/* As in pcap-filter, "tcp port 80" is "tcp and port 80" */
+		if (*i + 1 == argc || !is_qualifier(argv[*i + 1]))
+			return 0;
+		(*i)++;
+		break;
+	}
+
+	if (!strcmp(argv[*i], "src") || !strcmp(argv[*i], "dst")) {
+		dir = argv[*i][0] == 's' ? XDP_FILTER_DIR_SRC : XDP_FILTER_DIR_DST;
+		if (++(*i) == argc)
+			goto missing;
+	}
+
+	/* Like tcpdump, "src <addr>" is short for "src host <addr>" */
+	kw = "host";
+	if (!strcmp(argv[*i], "host") || !strcmp(argv[*i], "net") ||
+	    !strcmp(argv[*i], "port")) {
+		kw = argv[*i];
+		if (++(*i) == argc)
+			goto missing;
+	} else if (dir == XDP_FILTER_DIR_ANY) {
+		fprintf(stderr, "ERR: filter: unknown primitive '%s'\n",
+			argv[*i]);
+		return -1;
+	}
+
+	if (!strcmp(kw, "port"))
+		return rule_add_port(rule, dir, argv[*i]);
+	return rule_add_addr(rule, dir, argv[*i], !strcmp(kw, "net"));
+
+missing:
+	fprintf(stderr, "ERR: filter: expression ends too early\n");
+	return -1;
+}
+
+int xdp_filter_compile(char **argv, int argc, struct xdp_filter_rule *rules)
+{
+	int i, nr_rules = 0;
+	bool need_prim = true;
+
+	memset(rules, 0, XDP_FILTER_RULES_MAX * sizeof(*rules));
+
+	for (i = 0; i < argc; i++) {
+		if (!strcmp(argv[i], "and") || !strcmp(argv[i], "&&") ||
+		    !strcmp(argv[i], "or") || !strcmp(argv[i], "||")) {
+			if (need_prim)
+				goto syntax;
+			if (argv[i][0] == 'o' || argv[i][0] == '|') {
+				if (nr_rules == XDP_FILTER_RULES_MAX) {
+					fprintf(stderr, "ERR: filter: at most %d 'or' terms\n",
+						XDP_FILTER_RULES_MAX);
+					return -1;
+				}
+			}
+			need_prim = true;
+			continue;
+		}
+		if (!strcmp(argv[i], "not") || !strcmp(argv[i], "!") ||
+		    strchr(argv[i], '(') || strchr(argv[i], ')')) {
+			fprintf(stderr, "ERR: filter: 'not' and parentheses are not supported\n");
+			return -1;
+		}
+		if (!need_prim)
+			goto syntax;
+
+		/* The first primitive of a term, i.e. after an "or" */
+		if (i == 0 || argv[i - 1][0] == 'o' || argv[i - 1][0] == '|')
+			nr_rules++;
+		if (parse_primitive(&rules[nr_rules - 1], argv, argc, &i))
+			return -1;
+		need_prim = false;
+	}
+
+	if (argc && need_prim)
+		goto syntax;
+	return nr_rules;
+
+syntax:
+	fprintf(stderr, "ERR: filter: syntax error at '%s'\n",
+		i < argc ? argv[i] : "end");
+	return -1;
+}
+
+int xdp_filter_load(int map_fd, const struct xdp_filter_rule *rules,
+		    int nr_rules)
+{
+	__u32 key;
+
+	for (key = 0; key < (__u32)nr_rules; key++) {
+		if (bpf_map_update_elem(map_fd, &key, &rules[key], 0)) {
+			fprintf(stderr, "ERR: writing filter: %s\n",
+				strerror(errno));
+			return -1;
+		}
+	}
+	return 0;
+}
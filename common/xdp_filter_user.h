@@ -0,0 +1,24 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Userspace side of xdp_filter_kern.h */
+#ifndef __XDP_FILTER_USER_H
+#define __XDP_FILTER_USER_H
+
+#include "xdp_filter_kern_user.h"
+
+/* For the __doc__ of programs that take a filter expression */
+#define XDP_FILTER_USAGE \
+	"   [src|dst] host <addr>, [src|dst] net <addr>/<len>, [src|dst] port <n>,\n" \
+	"   ip, ip6, tcp, udp, icmp, icmp6; joined by 'and' and 'or'\n"
+
+/* Compiles the filter expression in argv, one word per element, into rules,
+ * which must have room for XDP_FILTER_RULES_MAX rules. Returns the number of
+ * rules, 0 for an empty expression, or -1 on error.
+ */
+int xdp_filter_compile(char **argv, int argc, struct xdp_filter_rule *rules);
+
+/* Writes the rules to xdp_filter_map */
+int xdp_filter_load(int map_fd, const struct xdp_filter_rule *rules,
+		    int nr_rules);
+
+#endif /* __XDP_FILTER_USER_H */
@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used *ONLY* by BPF-prog running kernel side. */
+#ifndef __XDP_RATELIMIT_KERN_H
+#define __XDP_RATELIMIT_KERN_H
+
+/*
+ * Token bucket rate limiting per source address or per source prefix.
+ *
+ * Source prefixes are mapped to a class through xdp_rl_prefix_map, and the
+ * class limits are read from xdp_rl_class_map; sources without a matching
+ * prefix are not limited. The maps are pinned by name, like xdp_stats_map,
+ * so they can be filled with e.g. bpftool.
+ *
+ * Buckets are per CPU (an LRU per-CPU hash), so no atomics are needed, but
+ * the limits hold per CPU: traffic from one source normally hashes to one
+ * RX queue, but a per-prefix class spread over N CPUs may pass up to N
+ * times its rate.
+ *
+ * Usage, with parsing_helpers.h and xdp_stats_kern.h included first:
+ *
+ *	if (xdp_ratelimit_check(ctx) == XDP_DROP)
+ *		return xdp_stats_record_action(ctx, XDP_DROP);
+ */
+
+#ifndef __XDP_RATELIMIT_KERN_USER_H
+#warning "You forgot to #include <../common/xdp_ratelimit_kern_user.h>"
+#include <../common/xdp_ratelimit_kern_user.h>
+#endif
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ULL
+#endif
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct xdp_rl_class);
+	__uint(max_entries, XDP_RL_MAX_CLASSES);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_rl_class_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LPM_TRIE);
+	__type(key, struct xdp_rl_prefix_key);
+	__type(value, struct xdp_rl_prefix_val);
+	__uint(max_entries, XDP_RL_MAX_PREFIXES);
+	__uint(map_flags, BPF_F_NO_PREALLOC);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_rl_prefix_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__type(key, struct xdp_rl_bucket_key);
+	__type(value, struct xdp_rl_bucket);
+	__uint(max_entries, XDP_RL_MAX_BUCKETS);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_rl_bucket_map SEC(".maps");
+
+/* Returns tokens after elapsed ns at rate, at most max. The bucket is full
+ * after (max - tokens) / rate ns, so checking that first also keeps
+ * elapsed * rate from overflowing, however long the bucket was idle.
+ */
+static __always_inline __u64 xdp_rl_refill(__u64 tokens, __u64 max,
+					   __u64 elapsed, __u64 rate)
+{
+	if (!rate || tokens >= max || elapsed >= (max - tokens) / rate)
+		return max;
+	return tokens + elapsed * rate;
+}
+
+/* Refills the bucket and takes one packet of len bytes from it. Returns 0 if
+ * the packet conforms, -1 if it exceeds a limit.
+ */
+static __always_inline int xdp_rl_take(struct xdp_rl_bucket *b,
+				       struct xdp_rl_class *cls,
+				       __u64 now, __u32 len)
+{
+	__u64 pkt_max = cls->burst_pkts * NSEC_PER_SEC;
+	__u64 byte_max = cls->burst_bytes * NSEC_PER_SEC;
+	__u64 byte_cost = (__u64)len * NSEC_PER_SEC;
+	__u64 elapsed;
+
+	if (!b->last_ns) {
+		/* New bucket (or first use on this CPU): start full */
+		b->pkt_tokens = pkt_max;
+		b->byte_tokens = byte_max;
+	} else {
+		elapsed = now - b->last_ns;
+		b->pkt_tokens = xdp_rl_refill(b->pkt_tokens, pkt_max, elapsed,
+					      cls->rate_pps);
+		b->byte_tokens = xdp_rl_refill(b->byte_tokens, byte_max,
+					       elapsed, cls->rate_bps);
+	}
+	b->last_ns = now;
+
+	if (cls->rate_pps && b->pkt_tokens < NSEC_PER_SEC)
+		return -1;
+	if (cls->rate_bps && b->byte_tokens < byte_cost)
+		return -1;
+
+	if (cls->rate_pps)
+		b->pkt_tokens -= NSEC_PER_SEC;
+	if (cls->rate_bps)
+		b->byte_tokens -= byte_cost;
+	return 0;
+}
+
+/* Rate limits a packet by its source address, given IPv4-mapped for IPv4.
+ * Returns XDP_DROP if the packet exceeds its class limits, XDP_PASS
+ * otherwise.
+ */
+static __always_inline __u32 xdp_ratelimit_addr(const __be32 saddr[4],
+						__u32 len)
+{
+	struct xdp_rl_prefix_key pkey = { .prefixlen = 128 };
+	struct xdp_rl_bucket_key bkey = {};
+	struct xdp_rl_bucket *b, new_b = {};
+	struct xdp_rl_prefix_val *pval;
+	struct xdp_rl_class *cls;
+
+	__builtin_memcpy(pkey.addr, saddr, sizeof(pkey.addr));
+	pval = bpf_map_lookup_elem(&xdp_rl_prefix_map, &pkey);
+	if (!pval)
+		return XDP_PASS;
+
+	cls = bpf_map_lookup_elem(&xdp_rl_class_map, &pval->class_id);
+	if (!cls || (!cls->rate_pps && !cls->rate_bps))
+		return XDP_PASS;
+
+	bkey.class_id = pval->class_id;
+	if (cls->flags & XDP_RL_F_PER_PREFIX)
+		__builtin_memcpy(bkey.addr, pval->addr, sizeof(bkey.addr));
+	else
+		__builtin_memcpy(bkey.addr, saddr, sizeof(bkey.addr));
+
+	b = bpf_map_lookup_elem(&xdp_rl_bucket_map, &bkey);
+	if (!b) {
+		/* Only this CPU's copy is set, the others start at zero */
+		bpf_map_update_elem(&xdp_rl_bucket_map, &bkey, &new_b,
+				    BPF_NOEXIST);
+		b = bpf_map_lookup_elem(&xdp_rl_bucket_map, &bkey);
+		if (!b)
+			return XDP_PASS;
+	}
+
+	if (xdp_rl_take(b, cls, bpf_ktime_get_ns(), len))
+		return XDP_DROP;
+
+	return XDP_PASS;
+}
+
+/* Parses the packet and rate limits it by its IPv4/IPv6 source address.
+ * Returns XDP_DROP if it exceeds its class limits, XDP_PASS otherwise
+ * (including for non-IP packets).
+ */
+static __always_inline __u32 xdp_ratelimit_check(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	__u32 len = data_end - data;
+	struct ipv6hdr *ip6h;
+	struct iphdr *iph;
+	struct ethhdr *eth;
+	__be32 saddr[4];
+	int eth_type;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		if (parse_iphdr(&nh, data_end, &iph) < 0)
+			return XDP_PASS;
+		saddr[0] = 0;
+		saddr[1] = 0;
+		saddr[2] = bpf_htonl(0xffff);
+		saddr[3] = iph->saddr;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		if (parse_ip6hdr(&nh, data_end, &ip6h) < 0)
+			return XDP_PASS;
+		__builtin_memcpy(saddr, &ip6h->saddr, sizeof(saddr));
+	} else {
+		return XDP_PASS;
+	}
+
+	return xdp_ratelimit_addr(saddr, len);
+}
+
+#endif /* __XDP_RATELIMIT_KERN_H */
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used by BPF-prog kernel side BPF-progs and userspace programs,
+ * for sharing the xdp_ratelimit structs and DEFINEs.
+ */
+#ifndef __XDP_RATELIMIT_KERN_USER_H
+#define __XDP_RATELIMIT_KERN_USER_H
+
+#define XDP_RL_MAX_CLASSES	64
+#define XDP_RL_MAX_PREFIXES	16384
+#define XDP_RL_MAX_BUCKETS	65536
+
+/* xdp_rl_class.flags: one bucket for the whole prefix instead of one per
+ * source address
+ */
+#define XDP_RL_F_PER_PREFIX	(1U << 0)
+
+/* Limits of a class, a zero rate means no limit of that kind */
+struct xdp_rl_class {
+	__u64 rate_pps;
+	__u64 burst_pkts;
+	__u64 rate_bps;		/* bytes per second */
+	__u64 burst_bytes;
+	__u32 flags;
+	__u32 pad;
+};
+
+/* IPv4 prefixes are stored IPv4-mapped (::ffff:a.b.c.d), with 96 added to
+ * the prefix length.
+ */
+struct xdp_rl_prefix_key {
+	__u32 prefixlen;
+	__be32 addr[4];
+};
+
+/* addr is the prefix itself (host bits cleared), for XDP_RL_F_PER_PREFIX */
+struct xdp_rl_prefix_val {
+	__u32 class_id;
+	__be32 addr[4];
+};
+
+struct xdp_rl_bucket_key {
+	__be32 addr[4];
+	__u32 class_id;
+};
+
+/* Tokens are scaled by NSEC_PER_SEC, so refills of less than one token are
+ * not lost at high packet rates.
+ */
+struct xdp_rl_bucket {
+	__u64 last_ns;
+	__u64 pkt_tokens;
+	__u64 byte_tokens;
+};
+
+#endif /* __XDP_RATELIMIT_KERN_USER_H */
@@ -12,6 +12,17 @@
 #include <../common/xdp_stats_kern_user.h>
 #endif
 
+#ifdef XDP_STATS_MMAP
+/* Keeps stats per CPU and (enum) xdp_action, see XDP_STATS_MMAP_ENTRIES */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct datarec);
+	__uint(max_entries, XDP_STATS_MMAP_ENTRIES);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_stats_map SEC(".maps");
+#else
 /* Keeps stats per (enum) xdp_action */
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
@@ -20,25 +31,77 @@ struct {
 	__uint(max_entries, XDP_ACTION_MAX);
 	__uint(pinning, LIBBPF_PIN_BY_NAME);
 } xdp_stats_map SEC(".maps");
+#endif
+
+#ifdef XDP_STATS_QUEUES
+#ifdef XDP_STATS_MMAP
+/* Keeps stats per CPU and RX queue, see XDP_STATS_QUEUE_MMAP_ENTRIES */
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct datarec);
+	__uint(max_entries, XDP_STATS_QUEUE_MMAP_ENTRIES);
+	__uint(map_flags, BPF_F_MMAPABLE);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_stats_queue_map SEC(".maps");
+#else
+/* Keeps stats per RX queue, see XDP_STATS_MAX_QUEUES */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct datarec);
+	__uint(max_entries, XDP_STATS_MAX_QUEUES);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} xdp_stats_queue_map SEC(".maps");
+#endif
+#endif
 
 static __always_inline
 __u32 xdp_stats_record_action(struct xdp_md *ctx, __u32 action)
 {
+	__u32 key = action;
+#ifdef XDP_STATS_MMAP
+	__u32 cpu;
+#endif
+
 	if (action >= XDP_ACTION_MAX)
 		return XDP_ABORTED;
 
+#ifdef XDP_STATS_MMAP
+	cpu = bpf_get_smp_processor_id();
+	if (cpu >= XDP_STATS_MAX_CPUS)
+		return action; /* Not counted */
+	key = cpu * XDP_STATS_CPU_STRIDE + action;
+#endif
+
 	/* Lookup in kernel BPF-side return pointer to actual data record */
-	struct datarec *rec = bpf_map_lookup_elem(&xdp_stats_map, &action);
+	struct datarec *rec = bpf_map_lookup_elem(&xdp_stats_map, &key);
 	if (!rec)
 		return XDP_ABORTED;
 
 	/* BPF_MAP_TYPE_PERCPU_ARRAY returns a data record specific to current
 	 * CPU and XDP hooks runs under Softirq, which makes it safe to update
-	 * without atomic operations.
+	 * without atomic operations. The XDP_STATS_MMAP layout gives each CPU
+	 * its own records for the same reason.
 	 */
 	rec->rx_packets++;
 	rec->rx_bytes += (ctx->data_end - ctx->data);
 
+#ifdef XDP_STATS_QUEUES
+	key = ctx->rx_queue_index;
+	if (key >= XDP_STATS_MAX_QUEUES)
+		key = XDP_STATS_MAX_QUEUES - 1;
+#ifdef XDP_STATS_MMAP
+	key += cpu * XDP_STATS_MAX_QUEUES;
+#endif
+
+	rec = bpf_map_lookup_elem(&xdp_stats_queue_map, &key);
+	if (rec) {
+		rec->rx_packets++;
+		rec->rx_bytes += (ctx->data_end - ctx->data);
+	}
+#endif
+
 	return action;
 }
 
@@ -16,4 +16,26 @@ struct datarec {
 #define XDP_ACTION_MAX (XDP_REDIRECT + 1)
 #endif
 
+/* Layout of xdp_stats_map when the BPF-prog is built with XDP_STATS_MMAP: a
+ * BPF_F_MMAPABLE array that userspace can mmap and read without syscalls.
+ * Each CPU has a block of XDP_STATS_CPU_STRIDE records, indexed by action,
+ * so record cpu * XDP_STATS_CPU_STRIDE + action belongs to a single CPU.
+ * A block is 128 bytes, so CPUs do not share cache lines.
+ */
+#define XDP_STATS_MAX_CPUS	256
+#define XDP_STATS_CPU_STRIDE	8
+#define XDP_STATS_MMAP_ENTRIES	(XDP_STATS_MAX_CPUS * XDP_STATS_CPU_STRIDE)
+
+/* Size of xdp_stats_queue_map, kept when the BPF-prog is built with
+ * XDP_STATS_QUEUES: one record per RX queue, over all actions. The last
+ * record also counts the queues above it.
+ */
+#define XDP_STATS_MAX_QUEUES	64
+
+/* With XDP_STATS_MMAP as well, xdp_stats_queue_map is a BPF_F_MMAPABLE
+ * array too, with a block of XDP_STATS_MAX_QUEUES records per CPU, so record
+ * cpu * XDP_STATS_MAX_QUEUES + queue belongs to a single CPU.
+ */
+#define XDP_STATS_QUEUE_MMAP_ENTRIES	(XDP_STATS_MAX_CPUS * XDP_STATS_MAX_QUEUES)
+
 #endif /* __XDP_STATS_KERN_USER_H */
@@ -0,0 +1,61 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Used *ONLY* by BPF-prog running kernel side. */
+#ifndef __XDP_TRACE_KERN_H
+#define __XDP_TRACE_KERN_H
+
+/*
+ * Kernel types used by the tp_btf programs on the xdp tracepoints.
+ *
+ * tp_btf programs get the raw tracepoint arguments, i.e. the arguments of
+ * trace_xdp_*() in include/trace/events/xdp.h, instead of the perf record
+ * built from them. That saves the record copy on every event, but the
+ * arguments are kernel pointers. Only the members used are declared here;
+ * preserve_access_index makes libbpf relocate their offsets against the
+ * BTF of the running kernel (CO-RE), so no vmlinux.h is needed.
+ *
+ * Usage:
+ *
+ *	SEC("tp_btf/xdp_exception")
+ *	int BPF_PROG(trace_xdp_exception, const struct net_device *dev,
+ *		     const struct bpf_prog *xdp, __u32 act)
+ *	{
+ *		int ifindex = dev->ifindex;
+ *		...
+ *
+ * Needs a kernel with CONFIG_DEBUG_INFO_BTF.
+ */
+
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_tracing.h>
+
+struct net_device {
+	int ifindex;
+} __attribute__((preserve_access_index));
+
+/* Only in the tracepoint signatures, never dereferenced */
+struct bpf_prog;
+
+/* The redirect tracepoints get this as 'tgt' for devmap targets */
+struct bpf_dtab_netdev {
+	struct net_device *dev;
+} __attribute__((preserve_access_index));
+
+/* The to_ifindex the xdp_redirect* tracepoints report: the target device
+ * for devmap and bpf_redirect(), 0 otherwise.
+ */
+static __always_inline int xdp_trace_to_ifindex(const void *tgt,
+						enum bpf_map_type map_type,
+						__u32 map_id, __u32 index)
+{
+	const struct bpf_dtab_netdev *dst = tgt;
+
+	if (map_type == BPF_MAP_TYPE_DEVMAP ||
+	    map_type == BPF_MAP_TYPE_DEVMAP_HASH)
+		return dst ? BPF_CORE_READ(dst, dev, ifindex) : 0;
+	if (map_type == BPF_MAP_TYPE_UNSPEC && map_id == 0x7fffffff)
+		return index;
+	return 0;
+}
+
+#endif /* __XDP_TRACE_KERN_H */
@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+
+/* Shared by the NAT programs xdp_nat_kern.c (ingress) and tc_nat_kern.c
+ * (egress). Both objects pin the maps by name, so when loaded with the same
+ * pin path they operate on one connection tracking table.
+ *
+ * Egress creates the state: the first packet of a flow leaving the external
+ * interface gets an external port allocated, and two entries are added, one
+ * keyed by the original tuple and one by the tuple replies will arrive with.
+ * Ingress only ever translates replies back, it never creates a flow.
+ *
+ * Each entry's translation, reversed, is the key of the other entry of the
+ * pair. The LRU can evict the two separately, so every lookup checks the
+ * other entry too (nat_ct_lookup_pair()), re-creates it if it is missing and
+ * drops an entry the other one no longer points back to. Entries also age
+ * out after NAT_CT_TIMEOUT_* seconds without traffic; there is no TCP state
+ * tracking, so a closed TCP connection keeps its port until then.
+ *
+ * NAT44 masquerades IPv4 traffic to nat_config.ext_addr. NAT64 (RFC 6146)
+ * translates IPv6 traffic towards nat_config.nat64_prefix::/96 to IPv4 from
+ * ext_addr, and is disabled while the prefix is all zeroes. TCP and UDP are
+ * translated for both; ICMP echo for NAT44 only.
+ */
+#ifndef __NAT_KERN_H
+#define __NAT_KERN_H
+
+#ifndef AF_INET
+#define AF_INET 2
+#endif
+#ifndef AF_INET6
+#define AF_INET6 10
+#endif
+
+/* from include/net/ip.h */
+#ifndef IP_DF
+#define IP_DF		0x4000
+#define IP_MF		0x2000
+#define IP_OFFSET	0x1fff
+#endif
+
+#define NAT_CT_MAX_ENTRIES	65536
+#define NAT_PORT_TRIES		8
+
+#ifndef NAT_CT_TIMEOUT_TCP
+#define NAT_CT_TIMEOUT_TCP	3600
+#endif
+#ifndef NAT_CT_TIMEOUT_UDP
+#define NAT_CT_TIMEOUT_UDP	120
+#endif
+#ifndef NAT_CT_TIMEOUT_ICMP
+#define NAT_CT_TIMEOUT_ICMP	30
+#endif
+
+#ifndef NSEC_PER_SEC
+#define NSEC_PER_SEC 1000000000ULL
+#endif
+
+/* Single entry, filled in from userspace (e.g. bpftool map update) */
+struct nat_config {
+	__be32 ext_addr;
+	__be32 nat64_prefix[3];
+	__u16 port_min;		/* host byte order; 0 means 1024 */
+	__u16 port_max;		/* host byte order; 0 means 65535 */
+};
+
+/* IPv4 addresses use addr[0] only, the rest is zero. For ICMP echo both
+ * ports hold the echo identifier.
+ */
+struct nat_tuple {
+	__be32 saddr[4];
+	__be32 daddr[4];
+	__be16 sport;
+	__be16 dport;
+	__u8 proto;
+	__u8 family;
+	__u16 pad;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct nat_config);
+	__uint(max_entries, 1);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} nat_config_map SEC(".maps");
+
+struct nat_ct_entry {
+	struct nat_tuple tr;	/* the tuple the packet leaves with */
+	__u64 last_seen;	/* bpf_ktime_get_ns() */
+};
+
+/* Maps the tuple a packet arrives with to the tuple it leaves with */
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_HASH);
+	__type(key, struct nat_tuple);
+	__type(value, struct nat_ct_entry);
+	__uint(max_entries, NAT_CT_MAX_ENTRIES);
+	__uint(pinning, LIBBPF_PIN_BY_NAME);
+} nat_ct_map SEC(".maps");
+
+static __always_inline struct nat_config *nat_config_get(void)
+{
+	__u32 key = 0;
+
+	return bpf_map_lookup_elem(&nat_config_map, &key);
+}
+
+static __always_inline int nat64_prefix_enabled(struct nat_config *cfg)
+{
+	return cfg->nat64_prefix[0] || cfg->nat64_prefix[1] ||
+	       cfg->nat64_prefix[2];
+}
+
+static __always_inline int nat64_prefix_match(struct nat_config *cfg,
+					      const struct in6_addr *addr)
+{
+	return addr->in6_u.u6_addr32[0] == cfg->nat64_prefix[0] &&
+	       addr->in6_u.u6_addr32[1] == cfg->nat64_prefix[1] &&
+	       addr->in6_u.u6_addr32[2] == cfg->nat64_prefix[2];
+}
+
+static __always_inline __u64 nat_ct_timeout(__u8 proto)
+{
+	if (proto == IPPROTO_TCP)
+		return NAT_CT_TIMEOUT_TCP * NSEC_PER_SEC;
+	if (proto == IPPROTO_UDP)
+		return NAT_CT_TIMEOUT_UDP * NSEC_PER_SEC;
+	return NAT_CT_TIMEOUT_ICMP * NSEC_PER_SEC;
+}
+
+static __always_inline int nat_ct_expired(struct nat_ct_entry *e, __u64 now)
+{
+	/* Signed, as another CPU may have set last_seen after now was read */
+	return (__s64)(now - e->last_seen) > (__s64)nat_ct_timeout(e->tr.proto);
+}
+
+/* The tuple of the packets going the other way */
+static __always_inline void nat_tuple_reverse(struct nat_tuple *dst,
+					      const struct nat_tuple *src)
+{
+	__builtin_memcpy(dst->saddr, src->daddr, sizeof(dst->saddr));
+	__builtin_memcpy(dst->daddr, src->saddr, sizeof(dst->daddr));
+	dst->sport = src->dport;
+	dst->dport = src->sport;
+	dst->proto = src->proto;
+	dst->family = src->family;
+	dst->pad = 0;
+}
+
+static __always_inline int nat_tuple_equal(const struct nat_tuple *a,
+					   const struct nat_tuple *b)
+{
+	const __u32 *x = (const __u32 *)a, *y = (const __u32 *)b;
+	int i;
+
+	#pragma unroll
+	for (i = 0; i < sizeof(*a) / sizeof(*x); i++)
+		if (x[i] != y[i])
+			return 0;
+	return 1;
+}
+
+/* Looks up the entry for key, and checks that the other entry of the pair
+ * translates back to key, re-creating that one if it was evicted. Returns NULL
+ * if there is no entry, if it expired or if the pair is broken; the stale
+ * entries are deleted then.
+ */
+static __always_inline struct nat_ct_entry *
+nat_ct_lookup_pair(struct nat_tuple *key)
+{
+	struct nat_ct_entry *e, *peer, new = {};
+	__u64 now = bpf_ktime_get_ns();
+	struct nat_tuple peer_key;
+
+	e = bpf_map_lookup_elem(&nat_ct_map, key);
+	if (!e)
+		return NULL;
+
+	nat_tuple_reverse(&peer_key, &e->tr);
+	nat_tuple_reverse(&new.tr, key);
+	new.last_seen = now;
+
+	if (nat_ct_expired(e, now)) {
+		peer = bpf_map_lookup_elem(&nat_ct_map, &peer_key);
+		if (peer && nat_tuple_equal(&peer->tr, &new.tr))
+			bpf_map_delete_elem(&nat_ct_map, &peer_key);
+		goto stale;
+	}
+
+	peer = bpf_map_lookup_elem(&nat_ct_map, &peer_key);
+	if (!peer) {
+		/* Fails if another CPU got there first, so look again */
+		bpf_map_update_elem(&nat_ct_map, &peer_key, &new, BPF_NOEXIST);
+		peer = bpf_map_lookup_elem(&nat_ct_map, &peer_key);
+		if (!peer)
+			goto stale;
+	}
+
+	/* The port went to another flow while this entry was alone */
+	if (!nat_tuple_equal(&peer->tr, &new.tr))
+		goto stale;
+
+	e->last_seen = now;
+	peer->last_seen = now;
+	return e;
+
+stale:
+	bpf_map_delete_elem(&nat_ct_map, key);
+	return NULL;
+}
+
+/* Fills the L4 part of a tuple. Returns 0 if the protocol is translated,
+ * -1 otherwise.
+ */
+static __always_inline int nat_tuple_l4(struct hdr_cursor *nh, void *data_end,
+					struct nat_tuple *t, int ip_type)
+{
+	struct icmphdr *icmph;
+	struct udphdr *udph;
+	struct tcphdr *tcph;
+
+	t->proto = ip_type;
+
+	if (ip_type == IPPROTO_TCP) {
+		if (parse_tcphdr(nh, data_end, &tcph) < 0)
+			return -1;
+		t->sport = tcph->source;
+		t->dport = tcph->dest;
+	} else if (ip_type == IPPROTO_UDP) {
+		if (parse_udphdr(nh, data_end, &udph) < 0)
+			return -1;
+		t->sport = udph->source;
+		t->dport = udph->dest;
+	} else if (ip_type == IPPROTO_ICMP && t->family == AF_INET) {
+		icmph = nh->pos;
+		if (icmph + 1 > data_end)
+			return -1;
+		if (icmph->type != ICMP_ECHO && icmph->type != ICMP_ECHOREPLY)
+			return -1;
+		t->sport = icmph->un.echo.id;
+		t->dport = icmph->un.echo.id;
+	} else {
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Offset of the L4 checksum field, or -1 if the protocol has none */
+static __always_inline int nat_l4_csum_off(__u8 proto)
+{
+	switch (proto) {
+	case IPPROTO_TCP:
+		return __builtin_offsetof(struct tcphdr, check);
+	case IPPROTO_UDP:
+		return __builtin_offsetof(struct udphdr, check);
+	case IPPROTO_ICMP:
+		return __builtin_offsetof(struct icmphdr, checksum);
+	}
+	return -1;
+}
+
+/* Offset of the source or destination port; for ICMP, of the echo id.
+ * TCP and UDP share the port layout.
+ */
+static __always_inline int nat_l4_port_off(__u8 proto, int dest)
+{
+	if (proto == IPPROTO_ICMP)
+		return __builtin_offsetof(struct icmphdr, un.echo.id);
+	return dest ? __builtin_offsetof(struct udphdr, dest) :
+		      __builtin_offsetof(struct udphdr, source);
+}
+
+#endif /* __NAT_KERN_H */
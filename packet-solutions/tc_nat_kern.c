@@ -0,0 +1,306 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+
+#include <linux/if_ether.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+#include <linux/pkt_cls.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/csum_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+#include "nat_kern.h"
+
+/*
+ * Egress half of the NAT, see nat_kern.h. Runs as a TC egress filter on the
+ * external interface:
+ *
+ *   tc qdisc add dev eth0 clsact
+ *   tc filter add dev eth0 egress bpf da obj tc_nat_kern.o sec tc
+ *
+ * Checksums are patched with bpf_l3/l4_csum_replace() rather than the
+ * csum_helpers.h functions used on the XDP side: on egress the skb may be
+ * CHECKSUM_PARTIAL (e.g. GSO), and only the helpers know how to update such
+ * a checksum.
+ */
+
+/* Inserts the reply entry unless another flow uses the port. An expired
+ * entry there is reclaimed. Returns 0 on success.
+ */
+static __always_inline int nat_ct_insert_reply(struct nat_tuple *reply,
+					       struct nat_ct_entry *back,
+					       __u64 now)
+{
+	struct nat_ct_entry *old;
+
+	if (!bpf_map_update_elem(&nat_ct_map, reply, back, BPF_NOEXIST))
+		return 0;
+
+	old = bpf_map_lookup_elem(&nat_ct_map, reply);
+	if (!old || !nat_ct_expired(old, now))
+		return -1;
+
+	bpf_map_delete_elem(&nat_ct_map, reply);
+	return bpf_map_update_elem(&nat_ct_map, reply, back, BPF_NOEXIST);
+}
+
+/* Allocates an external port for the flow and installs both directions.
+ * Returns the translation for orig, or NULL if no port was free.
+ */
+static __always_inline struct nat_tuple *nat_ct_create(struct nat_config *cfg,
+						       struct nat_tuple *orig)
+{
+	struct nat_ct_entry out_ct = {}, back_ct = {}, *ct;
+	struct nat_tuple *out = &out_ct.tr, reply = {};
+	__u32 port_min, port_max, range, start;
+	__u64 now = bpf_ktime_get_ns();
+	__be16 port;
+	int i;
+
+	port_min = cfg->port_min ? cfg->port_min : 1024;
+	port_max = cfg->port_max ? cfg->port_max : 65535;
+	if (port_max < port_min)
+		return NULL;
+	range = port_max - port_min + 1;
+
+	/* How the packet leaves: from ext_addr, to the remote IPv4 address */
+	out->family = AF_INET;
+	out->proto = orig->proto;
+	out->saddr[0] = cfg->ext_addr;
+	out->daddr[0] = orig->family == AF_INET6 ? orig->daddr[3] :
+						   orig->daddr[0];
+	out->dport = orig->dport;
+	out_ct.last_seen = now;
+
+	/* Replies arrive with the reverse of out, and are translated back to
+	 * the reverse of orig
+	 */
+	nat_tuple_reverse(&back_ct.tr, orig);
+	back_ct.last_seen = now;
+
+	/* Probe a few random ports; the reply entry is only inserted if no
+	 * other flow uses the port towards the same remote endpoint.
+	 */
+	start = bpf_get_prandom_u32();
+
+	#pragma unroll
+	for (i = 0; i < NAT_PORT_TRIES; i++) {
+		port = bpf_htons(port_min + (start + i) % range);
+
+		out->sport = port;
+		if (orig->proto == IPPROTO_ICMP)
+			out->dport = port; /* The echo id is both "ports" */
+		nat_tuple_reverse(&reply, out);
+
+		if (nat_ct_insert_reply(&reply, &back_ct, now))
+			continue;
+
+		/* Another CPU may have created the flow meanwhile; keep its
+		 * port and drop ours
+		 */
+		if (bpf_map_update_elem(&nat_ct_map, orig, &out_ct,
+					BPF_NOEXIST))
+			bpf_map_delete_elem(&nat_ct_map, &reply);
+
+		ct = bpf_map_lookup_elem(&nat_ct_map, orig);
+		return ct ? &ct->tr : NULL;
+	}
+
+	return NULL;
+}
+
+static __always_inline struct nat_tuple *nat_ct_lookup(struct nat_config *cfg,
+						       struct nat_tuple *orig)
+{
+	struct nat_ct_entry *ct;
+
+	ct = nat_ct_lookup_pair(orig);
+	if (ct)
+		return &ct->tr;
+
+	return nat_ct_create(cfg, orig);
+}
+
+/* Rewrites the L4 source port and patches the L4 checksum */
+static __always_inline int tc_nat_l4_sport(struct __sk_buff *skb, int l4_off,
+					   __u8 proto, __be16 from, __be16 to)
+{
+	int csum_off = nat_l4_csum_off(proto);
+	__u64 flags = sizeof(to);
+
+	if (from == to)
+		return 0;
+
+	if (proto == IPPROTO_UDP)
+		flags |= BPF_F_MARK_MANGLED_0;
+
+	if (bpf_l4_csum_replace(skb, l4_off + csum_off, from, to, flags))
+		return -1;
+
+	return bpf_skb_store_bytes(skb, l4_off + nat_l4_port_off(proto, 0),
+				   &to, sizeof(to), 0);
+}
+
+static __always_inline int tc_nat44(struct __sk_buff *skb, int l3_off,
+				    int l4_off, struct nat_tuple *orig,
+				    struct nat_tuple *tr)
+{
+	__be32 from = orig->saddr[0], to = tr->saddr[0];
+	int csum_off = nat_l4_csum_off(orig->proto);
+	__u64 flags = BPF_F_PSEUDO_HDR | sizeof(to);
+
+	if (bpf_l3_csum_replace(skb, l3_off + offsetof(struct iphdr, check),
+				from, to, sizeof(to)))
+		return -1;
+
+	/* The ICMP checksum does not cover a pseudo-header */
+	if (orig->proto != IPPROTO_ICMP) {
+		if (orig->proto == IPPROTO_UDP)
+			flags |= BPF_F_MARK_MANGLED_0;
+		if (bpf_l4_csum_replace(skb, l4_off + csum_off, from, to,
+					flags))
+			return -1;
+	}
+
+	if (bpf_skb_store_bytes(skb, l3_off + offsetof(struct iphdr, saddr),
+				&to, sizeof(to), 0))
+		return -1;
+
+	return tc_nat_l4_sport(skb, l4_off, orig->proto, orig->sport,
+			       tr->sport);
+}
+
+/* Replaces the IPv6 header by an IPv4 one (RFC 7915). The caller has made
+ * sure there are no extension headers.
+ */
+static __always_inline int tc_nat64(struct __sk_buff *skb, int l3_off,
+				    struct ipv6hdr *ip6h, struct nat_tuple *orig,
+				    struct nat_tuple *tr)
+{
+	int csum_off = nat_l4_csum_off(orig->proto);
+	__be16 h_proto = bpf_htons(ETH_P_IP);
+	__u64 flags = BPF_F_PSEUDO_HDR;
+	__be32 addrs[2] = { tr->saddr[0], tr->daddr[0] };
+	struct iphdr iph = {};
+	__s64 diff;
+	int l4_off;
+
+	iph.version	= 4;
+	iph.ihl		= sizeof(iph) >> 2;
+	iph.tos		= ipv6_get_tclass(ip6h);
+	iph.tot_len	= bpf_htons(bpf_ntohs(ip6h->payload_len) + sizeof(iph));
+	iph.frag_off	= bpf_htons(IP_DF);
+	iph.ttl		= ip6h->hop_limit;
+	iph.protocol	= orig->proto;
+	iph.saddr	= tr->saddr[0];
+	iph.daddr	= tr->daddr[0];
+	iph.check	= ip_fast_csum(&iph, iph.ihl);
+
+	/* Length and protocol are the same in both pseudo-headers, so only
+	 * the addresses change the L4 checksum.
+	 */
+	diff = bpf_csum_diff((__be32 *)&ip6h->saddr, 2 * sizeof(ip6h->saddr),
+			     addrs, sizeof(addrs), 0);
+	if (diff < 0)
+		return -1;
+
+	/* Invalidates ip6h */
+	if (bpf_skb_change_proto(skb, h_proto, 0))
+		return -1;
+
+	if (bpf_skb_store_bytes(skb, offsetof(struct ethhdr, h_proto),
+				&h_proto, sizeof(h_proto), 0))
+		return -1;
+
+	if (bpf_skb_store_bytes(skb, l3_off, &iph, sizeof(iph), 0))
+		return -1;
+
+	l4_off = l3_off + sizeof(iph);
+	if (orig->proto == IPPROTO_UDP)
+		flags |= BPF_F_MARK_MANGLED_0;
+	if (bpf_l4_csum_replace(skb, l4_off + csum_off, 0, diff, flags))
+		return -1;
+
+	return tc_nat_l4_sport(skb, l4_off, orig->proto, orig->sport,
+			       tr->sport);
+}
+
+SEC("tc")
+int tc_nat_egress(struct __sk_buff *skb)
+{
+	void *data_end = (void *)(long)skb->data_end;
+	void *data = (void *)(long)skb->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct nat_tuple orig = {};
+	struct nat_config *cfg;
+	struct ipv6hdr *ip6h;
+	struct nat_tuple *tr;
+	struct iphdr *iph;
+	struct ethhdr *eth;
+	int eth_type, ip_type;
+	int l3_off, l4_off;
+
+	cfg = nat_config_get();
+	if (!cfg || !cfg->ext_addr)
+		return TC_ACT_OK;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type < 0)
+		return TC_ACT_OK;
+
+	l3_off = nh.pos - data;
+
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iph);
+		if (ip_type < 0)
+			return TC_ACT_OK;
+
+		/* Our own traffic, and fragments we cannot match to a flow */
+		if (iph->saddr == cfg->ext_addr ||
+		    iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+			return TC_ACT_OK;
+
+		orig.family = AF_INET;
+		orig.saddr[0] = iph->saddr;
+		orig.daddr[0] = iph->daddr;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		/* Extension headers are not translated, so plain parsing is
+		 * enough: anything else than TCP/UDP is left alone below.
+		 */
+		ip_type = parse_ip6hdr(&nh, data_end, &ip6h);
+		if (ip_type < 0)
+			return TC_ACT_OK;
+
+		if (!nat64_prefix_enabled(cfg) ||
+		    !nat64_prefix_match(cfg, &ip6h->daddr))
+			return TC_ACT_OK;
+
+		orig.family = AF_INET6;
+		__builtin_memcpy(orig.saddr, &ip6h->saddr, sizeof(orig.saddr));
+		__builtin_memcpy(orig.daddr, &ip6h->daddr, sizeof(orig.daddr));
+	} else {
+		return TC_ACT_OK;
+	}
+
+	l4_off = nh.pos - data;
+	if (nat_tuple_l4(&nh, data_end, &orig, ip_type) < 0)
+		return TC_ACT_OK;
+
+	tr = nat_ct_lookup(cfg, &orig);
+	if (!tr)
+		return TC_ACT_SHOT; /* Out of ports */
+
+	if (orig.family == AF_INET) {
+		if (tc_nat44(skb, l3_off, l4_off, &orig, tr))
+			return TC_ACT_SHOT;
+	} else {
+		if (tc_nat64(skb, l3_off, ip6h, &orig, tr))
+			return TC_ACT_SHOT;
+	}
+
+	return TC_ACT_OK;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -9,6 +9,7 @@
 
 // The parsing helper functions from the packet01 lesson have moved here
 #include "../common/parsing_helpers.h"
+#include "../common/csum_helpers.h"
 
 SEC("tc")
 int _fix_port_egress(struct __sk_buff *skb)
@@ -18,10 +19,12 @@ int _fix_port_egress(struct __sk_buff *skb)
 	struct hdr_cursor nh = { .pos = data };
 	int eth_type, ip_type, ret = TC_ACT_OK;
 	struct ipv6hdr *ipv6hdr;
+	struct ipv6_frag_info frag;
 	struct iphdr *iphdr;
         struct udphdr *udphdr;
         struct tcphdr *tcphdr;
 	struct ethhdr *eth;
+	__be16 old_port;
 
 	if (data + sizeof(*eth) > data_end)
 		goto out;
@@ -34,7 +37,10 @@ int _fix_port_egress(struct __sk_buff *skb)
 	if (eth_type == bpf_htons(ETH_P_IP)) {
 		ip_type = parse_iphdr(&nh, data_end, &iphdr);
 	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
-		ip_type = parse_ip6hdr(&nh, data_end, &ipv6hdr);
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ipv6hdr, &frag);
+		/* Non-first fragments carry no L4 header to patch */
+		if (frag.offset)
+			goto out;
 	} else {
 		goto out;
 	}
@@ -43,18 +49,20 @@ int _fix_port_egress(struct __sk_buff *skb)
 		if (parse_udphdr(&nh, data_end, &udphdr) < 0)
 			goto out;
 
+		old_port = udphdr->source;
 		udphdr->source = bpf_htons(bpf_ntohs(udphdr->source) + 1);
-		udphdr->check += bpf_htons(-1);
-		if (!udphdr->check)
-			udphdr->check += bpf_htons(-1);
+		if (udphdr->check) {
+			csum_replace2(&udphdr->check, old_port, udphdr->source);
+			if (!udphdr->check)
+				udphdr->check = CSUM_MANGLED_0;
+		}
 	} else if (ip_type == IPPROTO_TCP) {
 		if (parse_tcphdr(&nh, data_end, &tcphdr) < 0)
 			goto out;
 
+		old_port = tcphdr->source;
 		tcphdr->source = bpf_htons(bpf_ntohs(tcphdr->source) + 1);
-		tcphdr->check += bpf_htons(-1);
-		if (!tcphdr->check)
-			tcphdr->check += bpf_htons(-1);
+		csum_replace2(&tcphdr->check, old_port, tcphdr->source);
 	}
 
 out:
@@ -0,0 +1,351 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/csum_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+/*
+ * Protocol dispatcher: the xdp_dispatch program parses the headers once,
+ * leaves the result in dispatch_ctx_map and tail-calls into the handler for
+ * the protocol found. Handlers take the header offsets from the context
+ * instead of parsing again, and may chain into further handlers the same way.
+ *
+ * The context lives in a per-CPU scratch map rather than in data_meta, as not
+ * all drivers support metadata; an XDP program runs to completion on one CPU,
+ * so the entry is not overwritten while a tail-call chain uses it.
+ */
+
+#undef AF_INET
+#define AF_INET 2
+#undef AF_INET6
+#define AF_INET6 10
+#define IPV6_FLOWINFO_MASK bpf_htonl(0x0FFFFFFF)
+
+enum dispatch_slot {
+	DISPATCH_ICMP_ECHO = 0,
+	DISPATCH_PORT_REWRITE,
+	DISPATCH_ROUTER,
+	DISPATCH_MAX,
+};
+
+/* Parse result handed to the handlers; offsets are from ctx->data */
+struct dispatch_ctx {
+	__u16 l3_off;
+	__u16 l4_off;
+	__be16 eth_proto;	/* network-byte-order */
+	__u8 l4_proto;
+	__u8 pad;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct dispatch_ctx);
+	__uint(max_entries, 1);
+} dispatch_ctx_map SEC(".maps");
+
+int xdp_dispatch_icmp_echo_func(struct xdp_md *ctx);
+int xdp_dispatch_port_rewrite_func(struct xdp_md *ctx);
+int xdp_dispatch_router_func(struct xdp_md *ctx);
+
+/* Populated by libbpf when the object is loaded; a handler can be replaced
+ * at runtime by updating its slot.
+ */
+struct {
+	__uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+	__uint(max_entries, DISPATCH_MAX);
+	__type(key, __u32);
+	__array(values, int (struct xdp_md *));
+} dispatch_progs SEC(".maps") = {
+	.values = {
+		[DISPATCH_ICMP_ECHO]	= (void *)&xdp_dispatch_icmp_echo_func,
+		[DISPATCH_PORT_REWRITE]	= (void *)&xdp_dispatch_port_rewrite_func,
+		[DISPATCH_ROUTER]	= (void *)&xdp_dispatch_router_func,
+	},
+};
+
+static __always_inline struct dispatch_ctx *dispatch_ctx_get(void)
+{
+	__u32 key = 0;
+
+	return bpf_map_lookup_elem(&dispatch_ctx_map, &key);
+}
+
+/* Only returns if the slot is empty; the caller decides what to do then */
+static __always_inline void dispatch_next(struct xdp_md *ctx, __u32 slot)
+{
+	bpf_tail_call(ctx, &dispatch_progs, slot);
+}
+
+SEC("xdp_dispatch")
+int xdp_dispatch_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct ipv6_frag_info frag;
+	struct ipv6hdr *ipv6hdr;
+	struct dispatch_ctx *dctx;
+	struct iphdr *iphdr;
+	struct ethhdr *eth;
+	int action = XDP_PASS;
+	int eth_type, ip_type;
+	void *l3;
+
+	dctx = dispatch_ctx_get();
+	if (!dctx) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type < 0) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	/* Non-first fragments have no L4 header; only route them */
+	l3 = nh.pos;
+	if (eth_type == bpf_htons(ETH_P_IP)) {
+		ip_type = parse_iphdr(&nh, data_end, &iphdr);
+		if (ip_type >= 0 && (iphdr->frag_off & bpf_htons(IP_OFFSET)))
+			ip_type = IPPROTO_FRAGMENT;
+	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ipv6hdr, &frag);
+		if (frag.offset)
+			ip_type = IPPROTO_FRAGMENT;
+	} else {
+		goto out;
+	}
+	if (ip_type < 0) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	dctx->eth_proto = eth_type;
+	dctx->l3_off = l3 - data;
+	dctx->l4_off = nh.pos - data;
+	dctx->l4_proto = ip_type;
+
+	switch (ip_type) {
+	case IPPROTO_ICMP:
+	case IPPROTO_ICMPV6:
+		dispatch_next(ctx, DISPATCH_ICMP_ECHO);
+		break;
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+		dispatch_next(ctx, DISPATCH_PORT_REWRITE);
+		break;
+	}
+	/* Everything else, and protocols whose handler is not loaded */
+	dispatch_next(ctx, DISPATCH_ROUTER);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+/* The xdp_icmp_echo solution from xdp_prog_kern_03.c, minus the parsing */
+SEC("xdp_dispatch_icmp_echo")
+int xdp_dispatch_icmp_echo_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct icmphdr_common *icmphdr;
+	struct dispatch_ctx *dctx;
+	struct ipv6hdr *ipv6hdr;
+	struct iphdr *iphdr;
+	struct ethhdr *eth = data;
+	int action = XDP_PASS;
+	__u16 echo_reply;
+	__be16 old_word;
+
+	dctx = dispatch_ctx_get();
+	if (!dctx)
+		goto out;
+
+	if (eth + 1 > data_end)
+		goto out;
+
+	icmphdr = data + dctx->l4_off;
+	if (icmphdr + 1 > data_end)
+		goto out;
+
+	if (dctx->eth_proto == bpf_htons(ETH_P_IP) &&
+	    icmphdr->type == ICMP_ECHO) {
+		iphdr = data + dctx->l3_off;
+		if (iphdr + 1 > data_end)
+			goto out;
+		swap_src_dst_ipv4(iphdr);
+		echo_reply = ICMP_ECHOREPLY;
+	} else if (dctx->eth_proto == bpf_htons(ETH_P_IPV6) &&
+		   icmphdr->type == ICMPV6_ECHO_REQUEST) {
+		ipv6hdr = data + dctx->l3_off;
+		if (ipv6hdr + 1 > data_end)
+			goto out;
+		swap_src_dst_ipv6(ipv6hdr);
+		echo_reply = ICMPV6_ECHO_REPLY;
+	} else {
+		goto out;
+	}
+
+	swap_src_dst_mac(eth);
+
+	old_word = *(__be16 *)icmphdr;
+	icmphdr->type = echo_reply;
+	csum_replace2(&icmphdr->cksum, old_word, *(__be16 *)icmphdr);
+
+	action = XDP_TX;
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+/* The xdp_patch_ports solution from xdp_prog_kern_02.c, minus the parsing.
+ * Chains into the router once the ports are rewritten.
+ */
+SEC("xdp_dispatch_port_rewrite")
+int xdp_dispatch_port_rewrite_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct dispatch_ctx *dctx;
+	struct udphdr *udphdr;
+	struct tcphdr *tcphdr;
+	int action = XDP_PASS;
+	__be16 old_port;
+
+	dctx = dispatch_ctx_get();
+	if (!dctx)
+		goto out;
+
+	if (dctx->l4_proto == IPPROTO_UDP) {
+		udphdr = data + dctx->l4_off;
+		if (udphdr + 1 > data_end) {
+			action = XDP_ABORTED;
+			goto out;
+		}
+
+		old_port = udphdr->dest;
+		udphdr->dest = bpf_htons(bpf_ntohs(udphdr->dest) - 1);
+		if (udphdr->check) {
+			csum_replace2(&udphdr->check, old_port, udphdr->dest);
+			if (!udphdr->check)
+				udphdr->check = CSUM_MANGLED_0;
+		}
+	} else if (dctx->l4_proto == IPPROTO_TCP) {
+		tcphdr = data + dctx->l4_off;
+		if (tcphdr + 1 > data_end) {
+			action = XDP_ABORTED;
+			goto out;
+		}
+
+		old_port = tcphdr->dest;
+		tcphdr->dest = bpf_htons(bpf_ntohs(tcphdr->dest) - 1);
+		csum_replace2(&tcphdr->check, old_port, tcphdr->dest);
+	}
+
+	dispatch_next(ctx, DISPATCH_ROUTER);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+/* The xdp_router solution from xdp_prog_kern_03.c, minus the parsing */
+SEC("xdp_dispatch_router")
+int xdp_dispatch_router_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct bpf_fib_lookup fib_params = {};
+	struct dispatch_ctx *dctx;
+	struct ethhdr *eth = data;
+	struct ipv6hdr *ip6h = NULL;
+	struct iphdr *iph = NULL;
+	int action = XDP_PASS;
+	__be16 old_word;
+	int rc;
+
+	dctx = dispatch_ctx_get();
+	if (!dctx)
+		goto out;
+
+	if (eth + 1 > data_end)
+		goto out;
+
+	if (dctx->eth_proto == bpf_htons(ETH_P_IP)) {
+		iph = data + dctx->l3_off;
+		if (iph + 1 > data_end)
+			goto out;
+
+		if (iph->ttl <= 1)
+			goto out;
+
+		fib_params.family	= AF_INET;
+		fib_params.tos		= iph->tos;
+		fib_params.l4_protocol	= iph->protocol;
+		fib_params.tot_len	= bpf_ntohs(iph->tot_len);
+		fib_params.ipv4_src	= iph->saddr;
+		fib_params.ipv4_dst	= iph->daddr;
+	} else if (dctx->eth_proto == bpf_htons(ETH_P_IPV6)) {
+		struct in6_addr *src = (struct in6_addr *) fib_params.ipv6_src;
+		struct in6_addr *dst = (struct in6_addr *) fib_params.ipv6_dst;
+
+		ip6h = data + dctx->l3_off;
+		if (ip6h + 1 > data_end)
+			goto out;
+
+		if (ip6h->hop_limit <= 1)
+			goto out;
+
+		fib_params.family	= AF_INET6;
+		fib_params.flowinfo	= *(__be32 *) ip6h & IPV6_FLOWINFO_MASK;
+		fib_params.l4_protocol	= ip6h->nexthdr;
+		fib_params.tot_len	= bpf_ntohs(ip6h->payload_len);
+		*src			= ip6h->saddr;
+		*dst			= ip6h->daddr;
+	} else {
+		goto out;
+	}
+
+	fib_params.ifindex = ctx->ingress_ifindex;
+
+	rc = bpf_fib_lookup(ctx, &fib_params, sizeof(fib_params), 0);
+	switch (rc) {
+	case BPF_FIB_LKUP_RET_SUCCESS:
+		if (iph) {
+			/* TTL shares a 16-bit word with the protocol field */
+			old_word = *(__be16 *)&iph->ttl;
+			iph->ttl--;
+			csum_replace2(&iph->check, old_word,
+				      *(__be16 *)&iph->ttl);
+		} else if (ip6h) {
+			ip6h->hop_limit--;
+		}
+
+		__builtin_memcpy(eth->h_dest, fib_params.dmac, ETH_ALEN);
+		__builtin_memcpy(eth->h_source, fib_params.smac, ETH_ALEN);
+		action = bpf_redirect(fib_params.ifindex, 0);
+		break;
+	case BPF_FIB_LKUP_RET_BLACKHOLE:
+	case BPF_FIB_LKUP_RET_UNREACHABLE:
+	case BPF_FIB_LKUP_RET_PROHIBIT:
+		action = XDP_DROP;
+		break;
+	default:
+		/* Let the kernel handle it */
+		break;
+	}
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,203 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/csum_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+#include "nat_kern.h"
+
+/*
+ * Ingress half of the NAT, see nat_kern.h. Translates replies arriving on the
+ * external interface back to the inside host and hands them to the stack for
+ * forwarding; everything else passes untouched.
+ */
+
+/* Points check at the L4 checksum and port at the destination port (or echo
+ * id). Returns 0 on success, -1 if the header is truncated.
+ */
+static __always_inline int xdp_nat_l4_fields(void *l4, void *data_end,
+					     __u8 proto, __sum16 **check,
+					     __be16 **port)
+{
+	struct icmphdr *icmph = l4;
+	struct udphdr *udph = l4;
+	struct tcphdr *tcph = l4;
+
+	if (proto == IPPROTO_TCP) {
+		if (tcph + 1 > data_end)
+			return -1;
+		*check = &tcph->check;
+		*port = &tcph->dest;
+	} else if (proto == IPPROTO_UDP) {
+		if (udph + 1 > data_end)
+			return -1;
+		*check = &udph->check;
+		*port = &udph->dest;
+	} else {
+		if (icmph + 1 > data_end)
+			return -1;
+		*check = &icmph->checksum;
+		*port = &icmph->un.echo.id;
+	}
+	return 0;
+}
+
+/* Patches the L4 part of a reply: the destination port, plus the change of
+ * pseudo-header sum from pseudo_from to pseudo_to.
+ */
+static __always_inline void xdp_nat_l4(__u8 proto, __sum16 *check,
+				       __be16 *port, __be16 new_port,
+				       __u32 pseudo_from, __u32 pseudo_to)
+{
+	/* A zero UDP checksum means no checksum is used */
+	if (proto == IPPROTO_UDP && !*check) {
+		*port = new_port;
+		return;
+	}
+
+	if (proto != IPPROTO_ICMP)
+		csum_replace_wsum(check, pseudo_from, pseudo_to);
+	csum_replace2(check, *port, new_port);
+	*port = new_port;
+
+	if (proto == IPPROTO_UDP && !*check)
+		*check = CSUM_MANGLED_0;
+}
+
+static __always_inline int xdp_nat44(struct iphdr *iph, void *l4,
+				     void *data_end, struct nat_tuple *tr)
+{
+	__sum16 *check;
+	__be16 *port;
+
+	if (xdp_nat_l4_fields(l4, data_end, iph->protocol, &check, &port))
+		return -1;
+
+	xdp_nat_l4(iph->protocol, check, port, tr->dport,
+		   iph->daddr, tr->daddr[0]);
+
+	csum_replace4(&iph->check, iph->daddr, tr->daddr[0]);
+	iph->daddr = tr->daddr[0];
+	return 0;
+}
+
+/* Replaces the IPv4 header by an IPv6 one (RFC 7915). The caller has made
+ * sure the IPv4 header has no options.
+ */
+static __always_inline int xdp_nat64(struct xdp_md *ctx, struct ethhdr *eth,
+				     struct iphdr *iph, void *l4,
+				     void *data_end, struct nat_tuple *tr)
+{
+	struct ethhdr eth_cpy;
+	struct ipv6hdr ip6h = {};
+	__sum16 *check;
+	__be16 *port;
+
+	if (xdp_nat_l4_fields(l4, data_end, iph->protocol, &check, &port))
+		return -1;
+
+	/* IPv6 requires a UDP checksum, and computing one over the payload is
+	 * not worth it here; RFC 7915 allows dropping these.
+	 */
+	if (iph->protocol == IPPROTO_UDP && !*check)
+		return -1;
+
+	ip6h.version = 6;
+	ip6h.priority = iph->tos >> 4;
+	ip6h.flow_lbl[0] = iph->tos << 4;
+	ip6h.payload_len = bpf_htons(bpf_ntohs(iph->tot_len) - sizeof(*iph));
+	ip6h.nexthdr = iph->protocol;
+	ip6h.hop_limit = iph->ttl;
+	__builtin_memcpy(&ip6h.saddr, tr->saddr, sizeof(ip6h.saddr));
+	__builtin_memcpy(&ip6h.daddr, tr->daddr, sizeof(ip6h.daddr));
+
+	/* Length and protocol are the same in both pseudo-headers, so only
+	 * the addresses change the L4 checksum. The L4 header does not move,
+	 * so patch it before growing the packet.
+	 */
+	xdp_nat_l4(iph->protocol, check, port, tr->dport,
+		   csum_add(iph->saddr, iph->daddr),
+		   csum_words(tr->saddr, 8, csum_words(tr->daddr, 8, 0)));
+
+	__builtin_memcpy(&eth_cpy, eth, sizeof(eth_cpy));
+
+	if (bpf_xdp_adjust_head(ctx, (int)sizeof(*iph) - (int)sizeof(ip6h)))
+		return -1;
+
+	eth = (void *)(long)ctx->data;
+	data_end = (void *)(long)ctx->data_end;
+	if ((void *)(eth + 1) + sizeof(ip6h) > data_end)
+		return -1;
+
+	eth_cpy.h_proto = bpf_htons(ETH_P_IPV6);
+	__builtin_memcpy(eth, &eth_cpy, sizeof(*eth));
+	__builtin_memcpy(eth + 1, &ip6h, sizeof(ip6h));
+	return 0;
+}
+
+SEC("xdp_nat")
+int xdp_nat_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct hdr_cursor nh = { .pos = data };
+	struct nat_tuple key = {};
+	struct nat_ct_entry *ct;
+	struct nat_config *cfg;
+	struct nat_tuple *tr;
+	struct iphdr *iph;
+	struct ethhdr *eth;
+	int action = XDP_PASS;
+	int eth_type, ip_type;
+	void *l4;
+
+	cfg = nat_config_get();
+	if (!cfg || !cfg->ext_addr)
+		goto out;
+
+	eth_type = parse_ethhdr(&nh, data_end, &eth);
+	if (eth_type != bpf_htons(ETH_P_IP))
+		goto out;
+
+	ip_type = parse_iphdr(&nh, data_end, &iph);
+	if (ip_type < 0)
+		goto out;
+
+	if (iph->daddr != cfg->ext_addr ||
+	    iph->frag_off & bpf_htons(IP_MF | IP_OFFSET))
+		goto out;
+
+	l4 = nh.pos;
+	key.family = AF_INET;
+	key.saddr[0] = iph->saddr;
+	key.daddr[0] = iph->daddr;
+	if (nat_tuple_l4(&nh, data_end, &key, ip_type) < 0)
+		goto out;
+
+	ct = nat_ct_lookup_pair(&key);
+	if (!ct)
+		goto out;
+	tr = &ct->tr;
+
+	if (tr->family == AF_INET) {
+		if (xdp_nat44(iph, l4, data_end, tr))
+			action = XDP_DROP;
+	} else {
+		if (iph->ihl != sizeof(*iph) >> 2 ||
+		    xdp_nat64(ctx, eth, iph, l4, data_end, tr))
+			action = XDP_DROP;
+	}
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -8,6 +8,7 @@
 
 // The parsing helper functions from the packet01 lesson have moved here
 #include "../common/parsing_helpers.h"
+#include "../common/csum_helpers.h"
 #include "../common/rewrite_helpers.h"
 
 /* Defines xdp_stats_map */
@@ -25,8 +26,10 @@ int xdp_patch_ports_func(struct xdp_md *ctx)
 	struct ethhdr *eth;
 	struct iphdr *iphdr;
 	struct ipv6hdr *ipv6hdr;
+	struct ipv6_frag_info frag;
 	struct udphdr *udphdr;
 	struct tcphdr *tcphdr;
+	__be16 old_port;
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
 	struct hdr_cursor nh = { .pos = data };
@@ -40,7 +43,10 @@ int xdp_patch_ports_func(struct xdp_md *ctx)
 	if (eth_type == bpf_htons(ETH_P_IP)) {
 		ip_type = parse_iphdr(&nh, data_end, &iphdr);
 	} else if (eth_type == bpf_htons(ETH_P_IPV6)) {
-		ip_type = parse_ip6hdr(&nh, data_end, &ipv6hdr);
+		ip_type = parse_ip6hdr_ext(&nh, data_end, &ipv6hdr, &frag);
+		/* Non-first fragments carry no L4 header to patch */
+		if (frag.offset)
+			goto out;
 	} else {
 		goto out;
 	}
@@ -52,32 +58,26 @@ int xdp_patch_ports_func(struct xdp_md *ctx)
 		}
 
 		/*
-		 * We need to update the packet checksum when modifying the header.
-		 * RFC1071 contains an algorithm for in-place updating, which is what we use here
-		 * since we're always just decrementing the port number. Another option would be
-		 * to recompute the full checksum, like:
-		 *
-		 * struct udphdr udphdr_old;
-		 * __u32 csum = udphdr->check;
-		 * udphdr_old = *udphdr;
-		 * udphdr->dest = bpf_htons(bpf_ntohs(udphdr->dest) - 1);
-		 * csum = bpf_csum_diff((__be32 *)&udphdr_old, 4, (__be32 *)udphdr, 4, ~csum);
-		 * udphdr->check = csum_fold_helper(csum);
+		 * We need to update the packet checksum when modifying the
+		 * header. As only the port changed, the checksum can be patched
+		 * incrementally (RFC 1624), instead of recomputing it over the
+		 * whole packet. A zero UDP checksum means no checksum is used.
 		 */
-
+		old_port = udphdr->dest;
 		udphdr->dest = bpf_htons(bpf_ntohs(udphdr->dest) - 1);
-		udphdr->check += bpf_htons(1);
-		if (!udphdr->check)
-			udphdr->check += bpf_htons(1);
+		if (udphdr->check) {
+			csum_replace2(&udphdr->check, old_port, udphdr->dest);
+			if (!udphdr->check)
+				udphdr->check = CSUM_MANGLED_0;
+		}
 	} else if (ip_type == IPPROTO_TCP) {
 		if (parse_tcphdr(&nh, data_end, &tcphdr) < 0) {
 			action = XDP_ABORTED;
 			goto out;
 		}
+		old_port = tcphdr->dest;
 		tcphdr->dest = bpf_htons(bpf_ntohs(tcphdr->dest) - 1);
-		tcphdr->check += bpf_htons(1);
-		if (!tcphdr->check)
-			tcphdr->check += bpf_htons(1);
+		csum_replace2(&tcphdr->check, old_port, tcphdr->dest);
 	}
 
 out:
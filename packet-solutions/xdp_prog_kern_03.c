@@ -6,6 +6,7 @@
 
 // The parsing helper functions from the packet01 lesson have moved here
 #include "../common/parsing_helpers.h"
+#include "../common/csum_helpers.h"
 #include "../common/rewrite_helpers.h"
 
 /* Defines xdp_stats_map */
@@ -31,32 +32,6 @@ struct {
 	__uint(max_entries, 1);
 } redirect_params SEC(".maps");
 
-static __always_inline __u16 csum_fold_helper(__u32 csum)
-{
-	__u32 sum;
-	sum = (csum >> 16) + (csum & 0xffff);
-	sum += (sum >> 16);
-	return ~sum;
-}
-
-/*
- * The icmp_checksum_diff function takes pointers to old and new structures and
- * the old checksum and returns the new checksum.  It uses the bpf_csum_diff
- * helper to compute the checksum difference. Note that the sizes passed to the
- * bpf_csum_diff helper should be multiples of 4, as it operates on 32-bit
- * words.
- */
-static __always_inline __u16 icmp_checksum_diff(
-		__u16 seed,
-		struct icmphdr_common *icmphdr_new,
-		struct icmphdr_common *icmphdr_old)
-{
-	__u32 csum, size = sizeof(struct icmphdr_common);
-
-	csum = bpf_csum_diff((__be32 *)icmphdr_old, size, (__be32 *)icmphdr_new, size, seed);
-	return csum_fold_helper(csum);
-}
-
 /* Solution to packet03/assignment-1 */
 SEC("xdp_icmp_echo")
 int xdp_icmp_echo_func(struct xdp_md *ctx)
@@ -70,9 +45,9 @@ int xdp_icmp_echo_func(struct xdp_md *ctx)
 	int icmp_type;
 	struct iphdr *iphdr;
 	struct ipv6hdr *ipv6hdr;
-	__u16 echo_reply, old_csum;
+	__u16 echo_reply;
+	__be16 old_word;
 	struct icmphdr_common *icmphdr;
-	struct icmphdr_common icmphdr_old;
 	__u32 action = XDP_PASS;
 
 	/* These keep track of the next header type and iterator pointer */
@@ -116,33 +91,14 @@ int xdp_icmp_echo_func(struct xdp_md *ctx)
 	swap_src_dst_mac(eth);
 
 
-	/* Patch the packet and update the checksum.*/
-	old_csum = icmphdr->cksum;
-	icmphdr->cksum = 0;
-	icmphdr_old = *icmphdr;
-	icmphdr->type = echo_reply;
-	icmphdr->cksum = icmp_checksum_diff(~old_csum, icmphdr, &icmphdr_old);
-
-	/* Another, less generic, but a bit more efficient way to update the
-	 * checksum is listed below.  As only one 16-bit word changed, the sum
-	 * can be patched using this formula: sum' = ~(~sum + ~m0 + m1), where
-	 * sum' is a new sum, sum is an old sum, m0 and m1 are the old and new
-	 * 16-bit words, correspondingly. In the formula above the + operation
-	 * is defined as the following function:
-	 *
-	 *     static __always_inline __u16 csum16_add(__u16 csum, __u16 addend)
-	 *     {
-	 *         csum += addend;
-	 *         return csum + (csum < addend);
-	 *     }
-	 *
-	 * So an alternative code to update the checksum might look like this:
-	 *
-	 *     __u16 m0 = * (__u16 *) icmphdr;
-	 *     icmphdr->type = echo_reply;
-	 *     __u16 m1 = * (__u16 *) icmphdr;
-	 *     icmphdr->checksum = ~(csum16_add(csum16_add(~icmphdr->checksum, ~m0), m1));
+	/* Patch the packet and update the checksum. As only the 16-bit word
+	 * holding type and code changes, the checksum can be patched
+	 * incrementally (RFC 1624): sum' = ~(~sum + ~m0 + m1), where m0 and m1
+	 * are the old and new 16-bit words. See ../common/csum_helpers.h.
 	 */
+	old_word = *(__be16 *)icmphdr;
+	icmphdr->type = echo_reply;
+	csum_replace2(&icmphdr->cksum, old_word, *(__be16 *)icmphdr);
 
 	action = XDP_TX;
 
@@ -218,13 +174,15 @@ out:
 #define AF_INET6 10
 #define IPV6_FLOWINFO_MASK bpf_htonl(0x0FFFFFFF)
 
-/* from include/net/ip.h */
+/* Like ip_decrease_ttl() in include/net/ip.h */
 static __always_inline int ip_decrease_ttl(struct iphdr *iph)
 {
-	__u32 check = iph->check;
-	check += bpf_htons(0x0100);
-	iph->check = (__u16)(check + (check >= 0xFFFF));
-	return --iph->ttl;
+	/* TTL shares a 16-bit word with the protocol field */
+	__be16 old_word = *(__be16 *)&iph->ttl;
+
+	iph->ttl--;
+	csum_replace2(&iph->check, old_word, *(__be16 *)&iph->ttl);
+	return iph->ttl;
 }
 
 /* Solution to packet03/assignment-4 */
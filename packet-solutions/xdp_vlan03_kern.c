@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#include <linux/bpf.h>
+#include <linux/in.h>
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
+
+#include "../common/parsing_helpers.h"
+#include "../common/rewrite_helpers.h"
+
+/* Defines xdp_stats_map */
+#include "../common/xdp_stats_kern_user.h"
+#include "../common/xdp_stats_kern.h"
+
+/* Incoming VLAN IDs; a zero ID means the tag is absent, thus untagged
+ * traffic uses {0, 0} and single tagged traffic uses {vid, 0}.
+ */
+struct vlan_steer_key {
+	__u16 outer_vid;
+	__u16 inner_vid;
+};
+
+/* Where to send the packet and which tags it leaves with; new_inner_vid is
+ * only used when new_outer_vid is set.
+ */
+struct vlan_steer_val {
+	__u32 port;		/* index into vlan_tx_port */
+	__u16 new_outer_vid;
+	__u16 new_inner_vid;
+};
+
+struct {
+	__uint(type, BPF_MAP_TYPE_HASH);
+	__type(key, struct vlan_steer_key);
+	__type(value, struct vlan_steer_val);
+	__uint(max_entries, 4096);
+} vlan_steer_map SEC(".maps");
+
+struct {
+	__uint(type, BPF_MAP_TYPE_DEVMAP);
+	__type(key, int);
+	__type(value, int);
+	__uint(max_entries, 256);
+} vlan_tx_port SEC(".maps");
+
+/* Solution to VLAN steering: demux (outer, inner) VLAN pairs to egress
+ * ports, retagging on the way, so no kernel VLAN devices are involved.
+ * Traffic without a steering entry goes up the stack untouched.
+ */
+SEC("xdp_vlan_steer")
+int xdp_vlan_steer_func(struct xdp_md *ctx)
+{
+	void *data_end = (void *)(long)ctx->data_end;
+	void *data = (void *)(long)ctx->data;
+	struct vlan_steer_key key = {};
+	struct vlan_steer_val *val;
+	struct collect_vlans vlans = {};
+	struct hdr_cursor nh;
+	struct ethhdr *eth;
+	int action = XDP_PASS;
+	int old_tags, new_tags;
+	int eth_type;
+
+	nh.pos = data;
+
+	eth_type = parse_ethhdr_vlan(&nh, data_end, &eth, &vlans);
+	if (eth_type < 0) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	/* The cursor has skipped the tags parse_ethhdr_vlan() walked */
+	old_tags = (nh.pos - (void *)(eth + 1)) / sizeof(struct vlan_hdr);
+
+	/* Deeper stacks than we can rewrite are left to the kernel */
+	if (proto_is_vlan(eth_type))
+		goto out;
+
+	if (old_tags > 0)
+		key.outer_vid = vlans.id[0];
+	if (old_tags > 1)
+		key.inner_vid = vlans.id[1];
+
+	val = bpf_map_lookup_elem(&vlan_steer_map, &key);
+	if (!val)
+		goto out;
+
+	new_tags = 0;
+	if (val->new_outer_vid)
+		new_tags = val->new_inner_vid ? 2 : 1;
+
+	if (vlan_tags_rewrite(ctx, eth, old_tags, new_tags,
+			      val->new_outer_vid, val->new_inner_vid)) {
+		action = XDP_ABORTED;
+		goto out;
+	}
+
+	action = bpf_redirect_map(&vlan_tx_port, val->port, 0);
+
+out:
+	return xdp_stats_record_action(ctx, action);
+}
+
+char _license[] SEC("license") = "GPL";
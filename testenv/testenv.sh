@@ -28,12 +28,13 @@ XDP_STATS=./xdp_stats
 LEGACY_IP=0
 USE_VLAN=0
 RUN_ON_INNER=0
+NUM_QUEUES=1
 
 # State variables that are written to and read from statefile
 STATEVARS=(IP6_PREFIX IP4_PREFIX
            INSIDE_IP6 INSIDE_IP4 INSIDE_MAC
            OUTSIDE_IP6 OUTSIDE_IP4 OUTSIDE_MAC
-           ENABLE_IPV4 ENABLE_VLAN)
+           ENABLE_IPV4 ENABLE_VLAN NUM_QUEUES)
 IP6_PREFIX=
 IP4_PREFIX=
 INSIDE_IP6=
@@ -238,7 +239,9 @@ setup()
     fi
 
     ip netns add "$NS"
-    ip link add dev "$NS" type veth peer name veth0 netns "$NS"
+    ip link add dev "$NS" numtxqueues "$NUM_QUEUES" numrxqueues "$NUM_QUEUES" \
+        type veth peer name veth0 netns "$NS" \
+        numtxqueues "$NUM_QUEUES" numrxqueues "$NUM_QUEUES"
 
     set_sysctls $NS
     ip link set dev "$NS" up
@@ -531,12 +534,15 @@ usage()
     echo ""
     echo "    --inner         Use with tcpdump command to run on inner interface."
     echo ""
+    echo "    --queues <num>  Create the veth pair with <num> RX and TX queues (setup only)."
+    echo "                    Default: $NUM_QUEUES"
+    echo ""
     exit 1
 }
 
 
 OPTS="hn:gl:s:"
-LONGOPTS="help,name:,gen-new,loader:,stats:,legacy-ip,vlan,inner"
+LONGOPTS="help,name:,gen-new,loader:,stats:,legacy-ip,vlan,inner,queues:"
 
 OPTIONS=$(getopt -o "$OPTS" --long "$LONGOPTS" -- "$@")
 [ "$?" -ne "0" ] && usage >&2 || true
@@ -576,6 +582,10 @@ while true; do
         --inner)
             RUN_ON_INNER=1
             ;;
+        --queues)
+            NUM_QUEUES="$1"
+            shift
+            ;;
         -- )
             break
             ;;
@@ -207,16 +207,17 @@ static struct bpf_object* load_bpf_and_trace_attach(struct config *cfg)
 			goto err;
 	}
 
-	link = bpf_program__attach_tracepoint(prog, "xdp", "xdp_exception");
+	/* Attaches to the tracepoint named by the tp_btf/xdp_exception section */
+	link = bpf_program__attach(prog);
 	if (libbpf_get_error(link)) {
-		printf("bpf_program__attach_tracepoint failed\n");
+		printf("bpf_program__attach failed\n");
 		goto err;
 	}
 	/*
 	 * As far as this program is concerned, we don't care about
-	 * the perf event file descriptor, it will get closed when
-	 * the program is terminated. But normally you want to call
-	 * close(fd) when you stop using it.
+	 * the link file descriptor, it will get closed when the
+	 * program is terminated. But normally you want to call
+	 * bpf_link__destroy() when you stop using it.
 	 */
 	return obj;
 
@@ -2,6 +2,8 @@
 #include <linux/bpf.h>
 #include <bpf/bpf_helpers.h>
 
+#include "../common/xdp_trace_kern.h"
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
 	__type(key, __s32);
@@ -9,21 +11,16 @@ struct {
 	__uint(max_entries, 10);
 } xdp_stats_map SEC(".maps");
 
-struct xdp_exception_ctx {
-	__u64 __pad;      // First 8 bytes are not accessible by bpf code
-	__s32 prog_id;    //      offset:8;  size:4; signed:1;
-	__u32 act;        //      offset:12; size:4; signed:0;
-	__s32 ifindex;    //      offset:16; size:4; signed:1;
-};
-
-SEC("tracepoint/xdp/xdp_exception")
-int trace_xdp_exception(struct xdp_exception_ctx *ctx)
+/* Arguments of trace_xdp_exception(), see common/xdp_trace_kern.h */
+SEC("tp_btf/xdp_exception")
+int BPF_PROG(trace_xdp_exception, const struct net_device *dev,
+	     const struct bpf_prog *xdp, __u32 act)
 {
-	__s32 key = ctx->ifindex;
+	__s32 key = dev->ifindex;
 	__u32 *valp;
 
 	/* Collecting stats only for XDP_ABORTED action. */
-	if (ctx->act != XDP_ABORTED)
+	if (act != XDP_ABORTED)
 		return 0;
 
 	/* Lookup in kernel BPF-side returns pointer to actual data. */
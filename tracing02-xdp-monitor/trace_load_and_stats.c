@@ -5,6 +5,7 @@ static const char *__doc__ = "XDP monitor via tracepoints\n";
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <getopt.h>
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -66,6 +67,27 @@ struct datarec {
 
 #define MAX_CPUS 64
 
+/* Redirect error key shared with _kern.c */
+struct redir_err_key {
+	int err;
+	int to_ifindex;
+	__u32 map_id;
+};
+#define REDIR_ERR_MAX 1024
+#define REDIR_ERR_TOP 10
+
+/* Bulk size histograms shared with _kern.c */
+#define BULK_HIST_SLOTS 8
+struct bulk_hist {
+	__u64 bulk[BULK_HIST_SLOTS];
+	__u64 drops[BULK_HIST_SLOTS];
+};
+#define BULK_HIST_DEVS 256
+
+static const char *bulk_hist_names[BULK_HIST_SLOTS] = {
+	"0", "1", "2-3", "4-7", "8-15", "16-31", "32-63", "64+"
+};
+
 /* Userspace structs for collection of stats from maps */
 struct record {
 	__u64 timestamp;
@@ -84,12 +106,42 @@ struct record_u64 {
 	struct u64rec *cpu;
 };
 
+struct redir_err_rec {
+	struct redir_err_key key;
+	__u64 total;
+};
+
+struct record_redir_err {
+	__u64 timestamp;
+	__u32 cnt;
+	struct redir_err_rec *recs;
+};
+
+struct record_hist {
+	__u64 timestamp;
+	struct bulk_hist total;
+};
+
+struct dev_hist_rec {
+	__u32 ifindex;
+	struct bulk_hist total;
+};
+
+struct record_dev_hist {
+	__u64 timestamp;
+	__u32 cnt;
+	struct dev_hist_rec *recs;
+};
+
 struct stats_record {
 	struct record_u64 xdp_redirect[REDIR_RES_MAX];
+	struct record_redir_err xdp_redirect_err;
 	struct record_u64 xdp_exception[XDP_ACTION_MAX];
 	struct record xdp_cpumap_kthread;
 	struct record xdp_cpumap_enqueue[MAX_CPUS];
 	struct record xdp_devmap_xmit;
+	struct record_hist xdp_cpumap_enqueue_hist[MAX_CPUS];
+	struct record_dev_hist xdp_devmap_xmit_hist;
 };
 
 static const char *default_filename = "trace_prog_kern.o";
@@ -191,6 +243,15 @@ static int check_map(const char *name, int fd)
 				.max_entries = 2,
 			}
 		},
+		{
+			.name = "redirect_err_detail",
+			.info = {
+				.type = BPF_MAP_TYPE_LRU_PERCPU_HASH,
+				.key_size = sizeof(struct redir_err_key),
+				.value_size = sizeof(__u64),
+				.max_entries = REDIR_ERR_MAX,
+			}
+		},
 		{
 			.name = "exception_cnt",
 			.info = {
@@ -218,6 +279,24 @@ static int check_map(const char *name, int fd)
 				.max_entries = 1,
 			}
 		},
+		{
+			.name = "cpumap_enqueue_hist",
+			.info = {
+				.type = BPF_MAP_TYPE_PERCPU_ARRAY,
+				.key_size = sizeof(__u32),
+				.value_size = sizeof(struct bulk_hist),
+				.max_entries = MAX_CPUS,
+			}
+		},
+		{
+			.name = "devmap_xmit_hist",
+			.info = {
+				.type = BPF_MAP_TYPE_PERCPU_HASH,
+				.key_size = sizeof(__u32),
+				.value_size = sizeof(struct bulk_hist),
+				.max_entries = BULK_HIST_DEVS,
+			}
+		},
 		{
 			.name = "devmap_xmit_cnt",
 			.info = {
@@ -337,6 +416,80 @@ static bool map_collect_record_u64(int fd, __u32 key, struct record_u64 *rec)
 	return true;
 }
 
+/* Sums the per-CPU counters of every (err, to_ifindex, map_id) entry */
+static bool map_collect_redir_err(int fd, struct record_redir_err *rec)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	struct redir_err_key key, next;
+	__u64 values[nr_cpus];
+	bool have_key = false;
+	__u64 sum;
+	int i;
+
+	rec->cnt = 0;
+	rec->timestamp = gettime();
+
+	while (rec->cnt < REDIR_ERR_MAX &&
+	       !bpf_map_get_next_key(fd, have_key ? &key : NULL, &next)) {
+		key = next;
+		have_key = true;
+
+		/* Entry may have been evicted since get_next_key */
+		if (bpf_map_lookup_elem(fd, &key, values))
+			continue;
+
+		sum = 0;
+		for (i = 0; i < nr_cpus; i++)
+			sum += values[i];
+
+		rec->recs[rec->cnt].key   = key;
+		rec->recs[rec->cnt].total = sum;
+		rec->cnt++;
+	}
+	return true;
+}
+
+/* Sums the per-CPU histograms of one key, returns false if it is missing */
+static bool map_collect_hist(int fd, __u32 key, struct bulk_hist *total)
+{
+	unsigned int nr_cpus = libbpf_num_possible_cpus();
+	struct bulk_hist values[nr_cpus];
+	int i, j;
+
+	memset(total, 0, sizeof(*total));
+	if (bpf_map_lookup_elem(fd, &key, values))
+		return false;
+
+	for (i = 0; i < nr_cpus; i++) {
+		for (j = 0; j < BULK_HIST_SLOTS; j++) {
+			total->bulk[j]  += values[i].bulk[j];
+			total->drops[j] += values[i].drops[j];
+		}
+	}
+	return true;
+}
+
+static bool map_collect_dev_hist(int fd, struct record_dev_hist *rec)
+{
+	__u32 key, next;
+	bool have_key = false;
+
+	rec->cnt = 0;
+	rec->timestamp = gettime();
+
+	while (rec->cnt < BULK_HIST_DEVS &&
+	       !bpf_map_get_next_key(fd, have_key ? &key : NULL, &next)) {
+		key = next;
+		have_key = true;
+
+		if (!map_collect_hist(fd, key, &rec->recs[rec->cnt].total))
+			continue;
+		rec->recs[rec->cnt].ifindex = key;
+		rec->cnt++;
+	}
+	return true;
+}
+
 static double calc_period(struct record *r, struct record *p)
 {
 	double period_ = 0;
@@ -421,6 +574,195 @@ static double calc_err(struct datarec *r, struct datarec *p, double period)
 	return pps;
 }
 
+static const char *redir_errno_str(int err)
+{
+	switch (-err) {
+	case ENETDOWN:	 return "ENETDOWN (device down)";
+	case EOPNOTSUPP: return "EOPNOTSUPP (no ndo_xdp_xmit)";
+	case EINVAL:	 return "EINVAL (empty map slot/xsk queue mismatch)";
+	case ENOSPC:	 return "ENOSPC (xsk RX ring full)";
+	case ENOBUFS:	 return "ENOBUFS (xsk fill ring empty)";
+	case ENXIO:	 return "ENXIO";
+	case EOVERFLOW:	 return "EOVERFLOW";
+	case EFAULT:	 return "EFAULT";
+	case ENOMEM:	 return "ENOMEM";
+	case EBUSY:	 return "EBUSY";
+	}
+	return NULL;
+}
+
+/* Names the map type, so e.g. xskmap errors stand out. bpf_redirect()
+ * reports map_id INT_MAX.
+ */
+static const char *redir_map_str(__u32 map_id)
+{
+	struct bpf_map_info info = {};
+	__u32 info_len = sizeof(info);
+	int fd, err;
+
+	if (!map_id || map_id == INT_MAX)
+		return "none";
+
+	fd = bpf_map_get_fd_by_id(map_id);
+	if (fd < 0)
+		return "gone";
+	err = bpf_obj_get_info_by_fd(fd, &info, &info_len);
+	close(fd);
+	if (err)
+		return "?";
+
+	switch (info.type) {
+	case BPF_MAP_TYPE_DEVMAP:	return "devmap";
+	case BPF_MAP_TYPE_DEVMAP_HASH:	return "devmap_hash";
+	case BPF_MAP_TYPE_CPUMAP:	return "cpumap";
+	case BPF_MAP_TYPE_XSKMAP:	return "xskmap";
+	default:			return "other";
+	}
+}
+
+/* Prints the bulk events per second that fell in each histogram slot */
+static void print_hist(const char *event, const char *to, const __u64 *cur,
+		       const __u64 *prev, double t)
+{
+	double rate[BULK_HIST_SLOTS];
+	bool any = false;
+	int i;
+
+	if (t <= 0)
+		return;
+
+	for (i = 0; i < BULK_HIST_SLOTS; i++) {
+		rate[i] = cur[i] >= prev[i] ? (cur[i] - prev[i]) / t : 0;
+		if (rate[i] > 0)
+			any = true;
+	}
+	if (!any)
+		return;
+
+	printf("%-15s %-7s", event, to);
+	for (i = 0; i < BULK_HIST_SLOTS; i++)
+		if (rate[i] > 0)
+			printf(" %s:%'.0f", bulk_hist_names[i], rate[i]);
+	printf("\n");
+}
+
+static void stats_print_hist(struct stats_record *stats_rec,
+			     struct stats_record *stats_prev)
+{
+	static const struct bulk_hist zero;
+	char to[16];
+	__u32 i, j;
+	double t;
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		struct record_hist *rec  = &stats_rec->xdp_cpumap_enqueue_hist[i];
+		struct record_hist *prev = &stats_prev->xdp_cpumap_enqueue_hist[i];
+
+		t = ((double)(rec->timestamp - prev->timestamp)) / NANOSEC_PER_SEC;
+		snprintf(to, sizeof(to), "cpu:%u", i);
+		print_hist("cpumap-bulk", to, rec->total.bulk,
+			   prev->total.bulk, t);
+		print_hist("cpumap-drops", to, rec->total.drops,
+			   prev->total.drops, t);
+	}
+
+	{
+		struct record_dev_hist *rec  = &stats_rec->xdp_devmap_xmit_hist;
+		struct record_dev_hist *prev = &stats_prev->xdp_devmap_xmit_hist;
+
+		t = ((double)(rec->timestamp - prev->timestamp)) / NANOSEC_PER_SEC;
+		for (i = 0; i < rec->cnt; i++) {
+			const struct bulk_hist *p = &zero;
+			char ifname[IF_NAMESIZE];
+
+			for (j = 0; j < prev->cnt; j++) {
+				if (prev->recs[j].ifindex == rec->recs[i].ifindex) {
+					p = &prev->recs[j].total;
+					break;
+				}
+			}
+			if (!if_indextoname(rec->recs[i].ifindex, ifname))
+				snprintf(ifname, sizeof(ifname), "%u",
+					 rec->recs[i].ifindex);
+			print_hist("devmap-bulk", ifname, rec->recs[i].total.bulk,
+				   p->bulk, t);
+			print_hist("devmap-drops", ifname,
+				   rec->recs[i].total.drops, p->drops, t);
+		}
+	}
+}
+
+struct redir_err_rate {
+	struct redir_err_key *key;
+	double pps;
+};
+
+static int cmp_redir_err_rate(const void *a, const void *b)
+{
+	const struct redir_err_rate *ra = a, *rb = b;
+
+	if (ra->pps < rb->pps)
+		return 1;
+	return ra->pps > rb->pps ? -1 : 0;
+}
+
+/* Prints the destinations with the highest redirect error rate */
+static void stats_print_redir_err(struct record_redir_err *rec,
+				  struct record_redir_err *prev)
+{
+	char *fmt = "%-15s %-7s %'-12.0f %'-12.0f %s dev:%s map:%s(%u)\n";
+	struct redir_err_rate rates[REDIR_ERR_MAX];
+	char ifname[IF_NAMESIZE], errbuf[16];
+	__u32 i, j, n = 0;
+	const char *err_str;
+	__u64 delta;
+	double t;
+
+	t = ((double)(rec->timestamp - prev->timestamp)) / NANOSEC_PER_SEC;
+	if (t <= 0)
+		return;
+
+	for (i = 0; i < rec->cnt; i++) {
+		/* Entries not seen before (or evicted and re-added) start
+		 * from zero
+		 */
+		delta = rec->recs[i].total;
+		for (j = 0; j < prev->cnt; j++) {
+			if (!memcmp(&rec->recs[i].key, &prev->recs[j].key,
+				    sizeof(struct redir_err_key))) {
+				if (delta >= prev->recs[j].total)
+					delta -= prev->recs[j].total;
+				break;
+			}
+		}
+		if (!delta)
+			continue;
+		rates[n].key = &rec->recs[i].key;
+		rates[n].pps = delta / t;
+		n++;
+	}
+
+	qsort(rates, n, sizeof(rates[0]), cmp_redir_err_rate);
+
+	for (i = 0; i < n && i < REDIR_ERR_TOP; i++) {
+		struct redir_err_key *key = rates[i].key;
+
+		err_str = redir_errno_str(key->err);
+		if (!err_str) {
+			snprintf(errbuf, sizeof(errbuf), "errno:%d", -key->err);
+			err_str = errbuf;
+		}
+		if (!key->to_ifindex)
+			snprintf(ifname, sizeof(ifname), "-");
+		else if (!if_indextoname(key->to_ifindex, ifname))
+			snprintf(ifname, sizeof(ifname), "%d", key->to_ifindex);
+
+		printf(fmt, "redirect-err", "total", 0.0, rates[i].pps,
+		       err_str, ifname, redir_map_str(key->map_id),
+		       key->map_id == INT_MAX ? 0 : key->map_id);
+	}
+}
+
 static void stats_print(struct stats_record *stats_rec,
 			struct stats_record *stats_prev,
 			bool err_only)
@@ -461,6 +803,10 @@ static void stats_print(struct stats_record *stats_rec,
 		       rec_i ? 0.0: pps, rec_i ? pps : 0.0, err2str(rec_i));
 	}
 
+	/* tracepoint: xdp:xdp_redirect_*_err, top offenders */
+	stats_print_redir_err(&stats_rec->xdp_redirect_err,
+			      &stats_prev->xdp_redirect_err);
+
 	/* tracepoint: xdp:xdp_exception */
 	for (rec_i = 0; rec_i < XDP_ACTION_MAX; rec_i++) {
 		struct record_u64 *rec, *prev;
@@ -601,6 +947,9 @@ static void stats_print(struct stats_record *stats_rec,
 		       info, i_str, err_str);
 	}
 
+	/* bulk size histograms, events/s per slot */
+	stats_print_hist(stats_rec, stats_prev);
+
 	printf("\n");
 }
 
@@ -629,6 +978,10 @@ static bool stats_collect(struct bpf_object *obj, struct stats_record *rec)
 	for (i = 0; i < REDIR_RES_MAX; i++)
 		map_collect_record_u64(fd, i, &rec->xdp_redirect[i]);
 
+	fd = map_fd(obj, "redirect_err_detail");
+
+	map_collect_redir_err(fd, &rec->xdp_redirect_err);
+
 	fd = map_fd(obj, "exception_cnt");
 
 	for (i = 0; i < XDP_ACTION_MAX; i++) {
@@ -648,6 +1001,17 @@ static bool stats_collect(struct bpf_object *obj, struct stats_record *rec)
 
 	map_collect_record(fd, 0, &rec->xdp_devmap_xmit);
 
+	fd = map_fd(obj, "cpumap_enqueue_hist");
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		rec->xdp_cpumap_enqueue_hist[i].timestamp = gettime();
+		map_collect_hist(fd, i, &rec->xdp_cpumap_enqueue_hist[i].total);
+	}
+
+	fd = map_fd(obj, "devmap_xmit_hist");
+
+	map_collect_dev_hist(fd, &rec->xdp_devmap_xmit_hist);
+
 	return true;
 }
 
@@ -686,6 +1050,15 @@ static struct stats_record *alloc_stats_record(void)
 	for (i = 0; i < REDIR_RES_MAX; i++)
 		rec->xdp_redirect[i].cpu = alloc_rec_per_cpu(rec_sz);
 
+	rec->xdp_redirect_err.recs = calloc(REDIR_ERR_MAX,
+					    sizeof(struct redir_err_rec));
+	rec->xdp_devmap_xmit_hist.recs = calloc(BULK_HIST_DEVS,
+						sizeof(struct dev_hist_rec));
+	if (!rec->xdp_redirect_err.recs || !rec->xdp_devmap_xmit_hist.recs) {
+		fprintf(stderr, "Mem alloc error\n");
+		exit(-1);
+	}
+
 	for (i = 0; i < XDP_ACTION_MAX; i++)
 		rec->xdp_exception[i].cpu = alloc_rec_per_cpu(rec_sz);
 
@@ -706,6 +1079,9 @@ static void free_stats_record(struct stats_record *r)
 	for (i = 0; i < REDIR_RES_MAX; i++)
 		free(r->xdp_redirect[i].cpu);
 
+	free(r->xdp_redirect_err.recs);
+	free(r->xdp_devmap_xmit_hist.recs);
+
 	for (i = 0; i < XDP_ACTION_MAX; i++)
 		free(r->xdp_exception[i].cpu);
 
@@ -776,7 +1152,7 @@ static struct bpf_object* load_bpf_and_trace_attach(struct config *cfg)
 {
 	struct bpf_object *obj;
 	struct bpf_program *prog;
-	struct bpf_link *tp_link;
+	struct bpf_link *link;
 	int err;
 
 	obj = bpf_object__open_file(cfg->filename, NULL);
@@ -792,32 +1168,18 @@ static struct bpf_object* load_bpf_and_trace_attach(struct config *cfg)
 		goto err;
 	}
 
+	/* The tp_btf/<tracepoint> section names tell libbpf where to attach */
 	bpf_object__for_each_program(prog, obj) {
-		const char *sec = bpf_program__section_name(prog);
-		char *tp;
-
-		if (!sec) {
-			fprintf(stderr, "ERR: failed to get program title\n");
-			goto err;
-		}
-
-		tp = strrchr(sec, '/');
-		if (!tp) {
-			fprintf(stderr, "ERR: wrong program title %s\n", sec);
-			goto err;
-		}
-
-		tp++;
-
 		if (verbose)
-			printf("Attach tracepoint %s \t(prog sec:%s)\n", tp, sec);
-
-		tp_link = bpf_program__attach_tracepoint(prog, "xdp", tp);
+			printf("Attach %s \t(prog sec:%s)\n",
+			       bpf_program__name(prog),
+			       bpf_program__section_name(prog));
 
-		err = libbpf_get_error(tp_link);
+		link = bpf_program__attach(prog);
+		err = libbpf_get_error(link);
 		if (err < 0) {
-			fprintf(stderr, "ERR: failed to open raw tracepoint for %s, (%d %s)\n",
-				tp, -errno, strerror(errno));
+			fprintf(stderr, "ERR: failed to attach %s (%d %s)\n",
+				bpf_program__name(prog), err, strerror(-err));
 			goto err;
 		}
 	}
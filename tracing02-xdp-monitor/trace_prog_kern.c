@@ -3,6 +3,8 @@
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_tracing.h>
 
+#include "../common/xdp_trace_kern.h"
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__type(key, __u32);
@@ -10,6 +12,21 @@ struct {
 	__uint(max_entries, 2);
 } redirect_err_cnt SEC(".maps");
 
+/* Redirect errors broken down by errno and destination. Shared with _user.c */
+struct redir_err_key {
+	int err;
+	int to_ifindex;
+	__u32 map_id;
+};
+#define REDIR_ERR_MAX 1024
+
+struct {
+	__uint(type, BPF_MAP_TYPE_LRU_PERCPU_HASH);
+	__type(key, struct redir_err_key);
+	__type(value, __u64);
+	__uint(max_entries, REDIR_ERR_MAX);
+} redirect_err_detail SEC(".maps");
+
 #define XDP_UNKNOWN	XDP_REDIRECT + 1
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
@@ -18,31 +35,27 @@ struct {
 	__uint(max_entries, 6);
 } exception_cnt SEC(".maps");
 
-/* Tracepoint format: /sys/kernel/debug/tracing/events/xdp/xdp_redirect/format
- * Code in:                kernel/include/trace/events/xdp.h
- */
-struct xdp_redirect_ctx {
-	__u64 pad;
-	int prog_id;		//	offset: 0; size:4; signed:1;
-	__u32 act;		//	offset: 4  size:4; signed:0;
-	int ifindex;		//	offset: 8  size:4; signed:1;
-	int err;		//	offset:12  size:4; signed:1;
-	int to_ifindex; 	//	offset:16  size:4; signed:1;
-	__u32 map_id;		//	offset:20  size:4; signed:0;
-	int map_index;		//	offset:24  size:4; signed:1;
-};				//	offset:28
-
 enum {
 	XDP_REDIRECT_SUCCESS = 0,
 	XDP_REDIRECT_ERROR = 1
 };
 
+/* The xdp_redirect* tracepoints all take the arguments:
+ *
+ *   (const struct net_device *dev, const struct bpf_prog *xdp,
+ *    const void *tgt, int err, enum bpf_map_type map_type,
+ *    u32 map_id, u32 index)
+ *
+ * Code in: kernel/include/trace/events/xdp.h
+ */
 static __always_inline
-int xdp_redirect_collect_stat(struct xdp_redirect_ctx *ctx)
+int xdp_redirect_collect_stat(const void *tgt, int err,
+			      enum bpf_map_type map_type, __u32 map_id,
+			      __u32 index)
 {
 	__u32 key = XDP_REDIRECT_ERROR;
-	int err = ctx->err;
-	__u64 *cnt;
+	struct redir_err_key err_key;
+	__u64 *cnt, one = 1;
 
 	if (!err)
 		key = XDP_REDIRECT_SUCCESS;
@@ -52,58 +65,67 @@ int xdp_redirect_collect_stat(struct xdp_redirect_ctx *ctx)
 		return 1;
 	*cnt += 1;
 
-	return 0; /* Indicate event was filtered (no further processing)*/
-	/*
-	 * Returning 1 here would allow e.g. a perf-record tracepoint
-	 * to see and record these events, but it doesn't work well
-	 * in-practice as stopping perf-record also unload this
-	 * bpf_prog.  Plus, there is additional overhead of doing so.
-	 */
+	if (!err)
+		return 0;
+
+	/* to_ifindex is 0 for maps other than devmap */
+	__builtin_memset(&err_key, 0, sizeof(err_key));
+	err_key.err = err;
+	err_key.to_ifindex = xdp_trace_to_ifindex(tgt, map_type, map_id, index);
+	err_key.map_id = map_id;
+
+	cnt = bpf_map_lookup_elem(&redirect_err_detail, &err_key);
+	if (cnt)
+		*cnt += 1;
+	else
+		bpf_map_update_elem(&redirect_err_detail, &err_key, &one,
+				    BPF_NOEXIST);
+
+	return 0;
 }
 
-SEC("tracepoint/xdp/xdp_redirect_err")
-int trace_xdp_redirect_err(struct xdp_redirect_ctx *ctx)
+SEC("tp_btf/xdp_redirect_err")
+int BPF_PROG(trace_xdp_redirect_err, const struct net_device *dev,
+	     const struct bpf_prog *xdp, const void *tgt, int err,
+	     enum bpf_map_type map_type, __u32 map_id, __u32 index)
 {
-	return xdp_redirect_collect_stat(ctx);
+	return xdp_redirect_collect_stat(tgt, err, map_type, map_id, index);
 }
 
-SEC("tracepoint/xdp/xdp_redirect_map_err")
-int trace_xdp_redirect_map_err(struct xdp_redirect_ctx *ctx)
+SEC("tp_btf/xdp_redirect_map_err")
+int BPF_PROG(trace_xdp_redirect_map_err, const struct net_device *dev,
+	     const struct bpf_prog *xdp, const void *tgt, int err,
+	     enum bpf_map_type map_type, __u32 map_id, __u32 index)
 {
-	return xdp_redirect_collect_stat(ctx);
+	return xdp_redirect_collect_stat(tgt, err, map_type, map_id, index);
 }
 
 /* Likely unloaded when prog starts */
-SEC("tracepoint/xdp/xdp_redirect")
-int trace_xdp_redirect(struct xdp_redirect_ctx *ctx)
+SEC("tp_btf/xdp_redirect")
+int BPF_PROG(trace_xdp_redirect, const struct net_device *dev,
+	     const struct bpf_prog *xdp, const void *tgt, int err,
+	     enum bpf_map_type map_type, __u32 map_id, __u32 index)
 {
-	return xdp_redirect_collect_stat(ctx);
+	return xdp_redirect_collect_stat(tgt, err, map_type, map_id, index);
 }
 
 /* Likely unloaded when prog starts */
-SEC("tracepoint/xdp/xdp_redirect_map")
-int trace_xdp_redirect_map(struct xdp_redirect_ctx *ctx)
+SEC("tp_btf/xdp_redirect_map")
+int BPF_PROG(trace_xdp_redirect_map, const struct net_device *dev,
+	     const struct bpf_prog *xdp, const void *tgt, int err,
+	     enum bpf_map_type map_type, __u32 map_id, __u32 index)
 {
-	return xdp_redirect_collect_stat(ctx);
+	return xdp_redirect_collect_stat(tgt, err, map_type, map_id, index);
 }
 
-/* Tracepoint format: /sys/kernel/debug/tracing/events/xdp/xdp_exception/format
- * Code in:                kernel/include/trace/events/xdp.h
- */
-struct xdp_exception_ctx {
-	__u64 pad;
-	int prog_id;	//	offset:0; size:4; signed:1;
-	__u32 act;	//	offset:4; size:4; signed:0;
-	int ifindex;	//	offset:8; size:4; signed:1;
-};
-
-SEC("tracepoint/xdp/xdp_exception")
-int trace_xdp_exception(struct xdp_exception_ctx *ctx)
+SEC("tp_btf/xdp_exception")
+int BPF_PROG(trace_xdp_exception, const struct net_device *dev,
+	     const struct bpf_prog *xdp, __u32 act)
 {
 	__u64 *cnt;
 	__u32 key;
 
-	key = ctx->act;
+	key = act;
 	if (key > XDP_REDIRECT)
 		key = XDP_UNKNOWN;
 
@@ -124,6 +146,17 @@ struct datarec {
 };
 #define MAX_CPUS 64
 
+/* log2 histograms of the bulk size and drops of each bulk event, slot 0
+ * counts zero, slot n counts [2^(n-1), 2^n) and the last slot everything
+ * above. Shared with _user.c
+ */
+#define BULK_HIST_SLOTS 8
+struct bulk_hist {
+	__u64 bulk[BULK_HIST_SLOTS];
+	__u64 drops[BULK_HIST_SLOTS];
+};
+#define BULK_HIST_DEVS 256
+
 struct {
 	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
 	__type(key, __u32);
@@ -138,56 +171,72 @@ struct {
 	__uint(max_entries, 1);
 } cpumap_kthread_cnt SEC(".maps");
 
-/* Tracepoint: /sys/kernel/debug/tracing/events/xdp/xdp_cpumap_enqueue/format
- * Code in:         kernel/include/trace/events/xdp.h
- */
-struct cpumap_enqueue_ctx {
-	__u64 pad;
-	int map_id;		//	offset: 0; size:4; signed:1;
-	__u32 act;		//	offset: 4; size:4; signed:0;
-	int cpu;		//	offset: 8; size:4; signed:1;
-	unsigned int drops;	//	offset:12; size:4; signed:0;
-	unsigned int processed; //	offset:16; size:4; signed:0;
-	int to_cpu;		//	offset:20; size:4; signed:1;
-};
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct bulk_hist);
+	__uint(max_entries, MAX_CPUS);
+} cpumap_enqueue_hist SEC(".maps");
+
+static __always_inline __u32 bulk_hist_slot(__u32 v)
+{
+	__u32 slot = 0;
+
+	if (!v)
+		return 0;
+	if (v >= (1 << 16)) { v >>= 16; slot += 16; }
+	if (v >= (1 << 8))  { v >>= 8;  slot += 8; }
+	if (v >= (1 << 4))  { v >>= 4;  slot += 4; }
+	if (v >= (1 << 2))  { v >>= 2;  slot += 2; }
+	if (v >= (1 << 1))  { slot += 1; }
+
+	slot += 1;
+	if (slot >= BULK_HIST_SLOTS)
+		slot = BULK_HIST_SLOTS - 1;
+	return slot;
+}
+
+static __always_inline void bulk_hist_record(struct bulk_hist *hist,
+					     __u32 bulk, __u32 drops)
+{
+	hist->bulk[bulk_hist_slot(bulk)]++;
+	hist->drops[bulk_hist_slot(drops)]++;
+}
 
-SEC("tracepoint/xdp/xdp_cpumap_enqueue")
-int trace_xdp_cpumap_enqueue(struct cpumap_enqueue_ctx *ctx)
+/* Code in: kernel/include/trace/events/xdp.h */
+SEC("tp_btf/xdp_cpumap_enqueue")
+int BPF_PROG(trace_xdp_cpumap_enqueue, int map_id, unsigned int processed,
+	     unsigned int drops, int to_cpu)
 {
-	__u32 to_cpu = ctx->to_cpu;
+	__u32 key = to_cpu;
+	struct bulk_hist *hist;
 	struct datarec *rec;
 
-	if (to_cpu >= MAX_CPUS)
+	if (key >= MAX_CPUS)
 		return 1;
 
-	rec = bpf_map_lookup_elem(&cpumap_enqueue_cnt, &to_cpu);
+	rec = bpf_map_lookup_elem(&cpumap_enqueue_cnt, &key);
 	if (!rec)
 		return 0;
-	rec->processed += ctx->processed;
-	rec->dropped   += ctx->drops;
+	rec->processed += processed;
+	rec->dropped   += drops;
 
 	/* Record bulk events, then userspace can calc average bulk size */
-	if (ctx->processed > 0)
+	if (processed > 0)
 		rec->info += 1;
 
+	/* processed already counts the dropped frames */
+	hist = bpf_map_lookup_elem(&cpumap_enqueue_hist, &key);
+	if (hist)
+		bulk_hist_record(hist, processed, drops);
+
 	return 0;
 }
 
-/* Tracepoint: /sys/kernel/debug/tracing/events/xdp/xdp_cpumap_kthread/format
- * Code in:         kernel/include/trace/events/xdp.h
- */
-struct cpumap_kthread_ctx {
-	__u64 pad;
-	int map_id;		//	offset: 0; size:4; signed:1;
-	__u32 act;		//	offset: 4; size:4; signed:0;
-	int cpu;		//	offset: 8; size:4; signed:1;
-	unsigned int drops;	//	offset:12; size:4; signed:0;
-	unsigned int processed; //	offset:16; size:4; signed:0;
-	int sched;		//	offset:20; size:4; signed:1;
-};
-
-SEC("tracepoint/xdp/xdp_cpumap_kthread")
-int trace_xdp_cpumap_kthread(struct cpumap_kthread_ctx *ctx)
+/* Code in: kernel/include/trace/events/xdp.h */
+SEC("tp_btf/xdp_cpumap_kthread")
+int BPF_PROG(trace_xdp_cpumap_kthread, int map_id, unsigned int processed,
+	     unsigned int drops, int sched)
 {
 	struct datarec *rec;
 	__u32 key = 0;
@@ -195,11 +244,11 @@ int trace_xdp_cpumap_kthread(struct cpumap_kthread_ctx *ctx)
 	rec = bpf_map_lookup_elem(&cpumap_kthread_cnt, &key);
 	if (!rec)
 		return 0;
-	rec->processed += ctx->processed;
-	rec->dropped   += ctx->drops;
+	rec->processed += processed;
+	rec->dropped   += drops;
 
 	/* Count times kthread yielded CPU via schedule call */
-	if (ctx->sched)
+	if (sched)
 		rec->info++;
 
 	return 0;
@@ -211,41 +260,55 @@ struct {
 	__uint(max_entries, 1);
 } devmap_xmit_cnt SEC(".maps");
 
-/* Tracepoint: /sys/kernel/debug/tracing/events/xdp/xdp_devmap_xmit/format
- * Code in:         kernel/include/trace/events/xdp.h
- */
-struct devmap_xmit_ctx {
-	__u64 pad;
-	int from_ifindex;	//	offset: 0; size:4; signed:1;
-	__u32 act;		//	offset: 4; size:4; signed:0;
-	int to_ifindex;		//	offset: 8; size:4; signed:1;
-	int drops;		//	offset:12; size:4; signed:1;
-	int sent;		//	offset:16; size:4; signed:1;
-	int err;		//	offset:28; size:4; signed:1;
-};
-
-SEC("tracepoint/xdp/xdp_devmap_xmit")
-int trace_xdp_devmap_xmit(struct devmap_xmit_ctx *ctx)
+/* Keyed by to_ifindex */
+struct {
+	__uint(type, BPF_MAP_TYPE_PERCPU_HASH);
+	__type(key, __u32);
+	__type(value, struct bulk_hist);
+	__uint(max_entries, BULK_HIST_DEVS);
+} devmap_xmit_hist SEC(".maps");
+
+/* Code in: kernel/include/trace/events/xdp.h */
+SEC("tp_btf/xdp_devmap_xmit")
+int BPF_PROG(trace_xdp_devmap_xmit, const struct net_device *from_dev,
+	     const struct net_device *to_dev, int sent, int drops, int err)
 {
+	struct bulk_hist *hist;
 	struct datarec *rec;
 	__u32 key = 0;
+	__u32 ifindex;
 
 	rec = bpf_map_lookup_elem(&devmap_xmit_cnt, &key);
 	if (!rec)
 		return 0;
-	rec->processed += ctx->sent;
-	rec->dropped   += ctx->drops;
+	rec->processed += sent;
+	rec->dropped   += drops;
 
 	/* Record bulk events, then userspace can calc average bulk size */
 	rec->info += 1;
 
 	/* Record error cases, where no frame were sent */
-	if (ctx->err)
+	if (err)
 		rec->err++;
 
 	/* Catch API error of drv ndo_xdp_xmit sent more than count */
-	if (ctx->drops < 0)
+	if (drops < 0) {
 		rec->err++;
+		return 0;
+	}
 
-	return 1;
+	ifindex = to_dev->ifindex;
+	hist = bpf_map_lookup_elem(&devmap_xmit_hist, &ifindex);
+	if (!hist) {
+		struct bulk_hist zero = {};
+
+		bpf_map_update_elem(&devmap_xmit_hist, &ifindex, &zero,
+				    BPF_NOEXIST);
+		hist = bpf_map_lookup_elem(&devmap_xmit_hist, &ifindex);
+		if (!hist)
+			return 0;
+	}
+	bulk_hist_record(hist, sent + drops, drops);
+
+	return 0;
 }
@@ -0,0 +1,44 @@
+/* This common_kern_user.h is used by kernel side BPF-progs and
+ * userspace programs, for sharing common struct's and DEFINEs.
+ */
+#ifndef __COMMON_KERN_USER_H
+#define __COMMON_KERN_USER_H
+
+/* Largest number of packet bytes in a sample */
+#define SAMPLE_SNAPLEN_MAX	1024
+
+/* Default size of each CPU's ring buffer, a power of 2 multiple of the page
+ * size. Userspace creates the rings, so --ring-size can change it; the kernel
+ * does not require the size of the map-in-map template.
+ */
+#define SAMPLE_RINGBUF_SIZE	(1024 * 1024)
+#define SAMPLE_MAX_CPUS		256
+
+/* Single entry of sample_config_map, written by userspace */
+struct sample_config {
+	__u32 sample_rate;	/* sample 1 in sample_rate packets, 0 = none */
+	__u32 snaplen;		/* bytes to capture, up to SAMPLE_SNAPLEN_MAX */
+	__u32 nr_rules;		/* rules in xdp_filter_map, 0 = match all */
+};
+
+/* Per-CPU counters in sample_stats_map */
+struct sample_stats {
+	__u64 matched;		/* packets that passed the filter */
+	__u64 sampled;		/* samples written to the ring buffer */
+	__u64 ringbuf_full;	/* samples lost because the ring was full */
+	__u64 no_ring;		/* samples lost because the CPU has no ring */
+	__u64 copy_failed;	/* samples lost because the copy failed */
+};
+
+/* A sample in the ring buffer: this header, followed by cap_len bytes of
+ * the packet
+ */
+struct sample_hdr {
+	__u64 timestamp;	/* bpf_ktime_get_ns() */
+	__u32 ifindex;
+	__u32 rx_queue;
+	__u32 pkt_len;
+	__u32 cap_len;
+};
+
+#endif /* __COMMON_KERN_USER_H */
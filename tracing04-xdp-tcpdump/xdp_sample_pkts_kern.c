@@ -1,61 +1,143 @@
 // SPDX-License-Identifier: GPL-2.0
 #include <linux/bpf.h>
+#include <linux/in.h>
 #include <bpf/bpf_helpers.h>
+#include <bpf/bpf_endian.h>
 
-#define SAMPLE_SIZE 1024ul
-#define MAX_CPUS 128
+#include "../common/xdp_filter_kern_user.h"
+#include "../common/xdp_filter_kern.h"
 
-#ifndef __packed
-#define __packed __attribute__((packed))
-#endif
+#include "common_kern_user.h"
+
+/* Samples go to userspace through one ring buffer per CPU, so CPUs do not
+ * contend on a shared ring and userspace can drain them from several
+ * threads. A sample is reserved in the ring, filled in place and committed,
+ * so the packet is copied once, straight into memory userspace has mapped.
+ * Userspace creates the rings and stores them at their CPU's index.
+ */
+struct sample_ringbuf {
+	__uint(type, BPF_MAP_TYPE_RINGBUF);
+	__uint(max_entries, SAMPLE_RINGBUF_SIZE);
+};
 
-#define min(x, y) ((x) < (y) ? (x) : (y))
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY_OF_MAPS);
+	__type(key, __u32);
+	__uint(max_entries, SAMPLE_MAX_CPUS);
+	__array(values, struct sample_ringbuf);
+} sample_rbs SEC(".maps");
 
-/* Metadata will be in the perf event before the packet data. */
-struct S {
-	__u16 cookie;
-	__u16 pkt_len;
-} __packed;
+struct {
+	__uint(type, BPF_MAP_TYPE_ARRAY);
+	__type(key, __u32);
+	__type(value, struct sample_config);
+	__uint(max_entries, 1);
+} sample_config_map SEC(".maps");
 
 struct {
-	__uint(type, BPF_MAP_TYPE_PERF_EVENT_ARRAY);
-	__type(key, int);
-	__type(value, struct S);
-	__uint(max_entries, MAX_CPUS);
-} my_map SEC(".maps");
+	__uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+	__type(key, __u32);
+	__type(value, struct sample_stats);
+	__uint(max_entries, 1);
+} sample_stats_map SEC(".maps");
+
+#ifndef barrier_var
+#define barrier_var(var) asm volatile("" : "+r"(var))
+#endif
+
+/* The reserved size must be a constant, so samples come in a few sizes
+ * rather than all taking SAMPLE_SNAPLEN_MAX bytes of the ring. barrier_var()
+ * keeps the compiler from merging the calls into one with a variable size,
+ * which the verifier would reject.
+ */
+#define SAMPLE_RESERVE(len)						\
+	bpf_ringbuf_reserve(rb, sizeof(struct sample_hdr) + (len), 0)
+
+static __always_inline struct sample_hdr *sample_reserve(void *rb,
+							 __u32 cap_len)
+{
+	struct sample_hdr *hdr;
+
+	if (cap_len <= 128) {
+		hdr = SAMPLE_RESERVE(128);
+		barrier_var(hdr);
+	} else if (cap_len <= 256) {
+		hdr = SAMPLE_RESERVE(256);
+		barrier_var(hdr);
+	} else if (cap_len <= 512) {
+		hdr = SAMPLE_RESERVE(512);
+		barrier_var(hdr);
+	} else {
+		hdr = SAMPLE_RESERVE(SAMPLE_SNAPLEN_MAX);
+		barrier_var(hdr);
+	}
+	return hdr;
+}
 
 SEC("xdp")
 int xdp_sample_prog(struct xdp_md *ctx)
 {
 	void *data_end = (void *)(long)ctx->data_end;
 	void *data = (void *)(long)ctx->data;
-	if (data < data_end) {
-		/* The XDP perf_event_output handler will use the upper 32 bits
-		 * of the flags argument as a number of bytes to include of the
-		 * packet payload in the event data. If the size is too big, the
-		 * call to bpf_perf_event_output will fail and return -EFAULT.
-		 *
-		 * See bpf_xdp_event_output in net/core/filter.c.
-		 *
-		 * The BPF_F_CURRENT_CPU flag means that the event output fd
-		 * will be indexed by the CPU number in the event map.
-		 */
-		__u64 flags = BPF_F_CURRENT_CPU;
-		__u16 sample_size = (__u16)(data_end - data);
-		int ret;
-		struct S metadata;
-
-		metadata.cookie = 0xdead;
-		metadata.pkt_len = min(sample_size, SAMPLE_SIZE);
-
-		flags |= (__u64)sample_size << 32;
-
-		ret = bpf_perf_event_output(ctx, &my_map, flags,
-					    &metadata, sizeof(metadata));
-		if (ret)
-			bpf_printk("perf_event_output failed: %d\n", ret);
+	__u32 pkt_len = data_end - data;
+	struct sample_config *cfg;
+	struct sample_stats *stats;
+	struct sample_hdr *hdr;
+	__u32 key = 0, cpu, cap_len;
+	void *rb;
+
+	cfg = bpf_map_lookup_elem(&sample_config_map, &key);
+	if (!cfg || !cfg->sample_rate || !pkt_len)
+		return XDP_PASS;
+
+	if (!xdp_filter_match(data, data_end, cfg->nr_rules))
+		return XDP_PASS;
+
+	stats = bpf_map_lookup_elem(&sample_stats_map, &key);
+	if (!stats)
+		return XDP_PASS;
+	stats->matched++;
+
+	if (cfg->sample_rate > 1 &&
+	    bpf_get_prandom_u32() % cfg->sample_rate)
+		return XDP_PASS;
+
+	cap_len = pkt_len;
+	if (cap_len > cfg->snaplen)
+		cap_len = cfg->snaplen;
+	if (cap_len > SAMPLE_SNAPLEN_MAX)
+		cap_len = SAMPLE_SNAPLEN_MAX;
+	if (!cap_len)
+		return XDP_PASS;
+
+	cpu = bpf_get_smp_processor_id();
+	rb = bpf_map_lookup_elem(&sample_rbs, &cpu);
+	if (!rb) {
+		stats->no_ring++;
+		return XDP_PASS;
 	}
 
+	hdr = sample_reserve(rb, cap_len);
+	if (!hdr) {
+		stats->ringbuf_full++;
+		return XDP_PASS;
+	}
+
+	hdr->timestamp = bpf_ktime_get_ns();
+	hdr->ifindex = ctx->ingress_ifindex;
+	hdr->rx_queue = ctx->rx_queue_index;
+	hdr->pkt_len = pkt_len;
+	hdr->cap_len = cap_len;
+
+	if (bpf_xdp_load_bytes(ctx, 0, hdr + 1, cap_len)) {
+		bpf_ringbuf_discard(hdr, 0);
+		stats->copy_failed++;
+		return XDP_PASS;
+	}
+
+	bpf_ringbuf_submit(hdr, 0);
+	stats->sampled++;
+
 	return XDP_PASS;
 }
 
@@ -1,111 +1,481 @@
 // SPDX-License-Identifier: GPL-2.0
-static const char *__doc__ = "XDP sample packet\n";
-
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <linux/perf_event.h>
 #include <linux/bpf.h>
 #include <net/if.h>
 #include <errno.h>
-#include <assert.h>
-#include <sys/sysinfo.h>
-#include <sys/ioctl.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <signal.h>
 #include <bpf/libbpf.h>
 #include <xdp/libxdp.h>
 #include <bpf/bpf.h>
 #include <sys/resource.h>
-#include <libgen.h>
 #include <linux/if_link.h>
-#include <poll.h>
-#include <sys/mman.h>
-#define PCAP_DONT_INCLUDE_PCAP_BPF_H
-#include <pcap/pcap.h>
-#include <pcap/dlt.h>
 #include <time.h>
-#include <linux/perf_event.h>
-#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "../common/common_params.h"
 #include "../common/common_user_bpf_xdp.h"
+#include "../common/xdp_filter_user.h"
 
-#ifndef __packed
-#define __packed __attribute__((packed))
-#endif
+#include "common_kern_user.h"
 
-#define MAX_CPUS 128
+static const char *__doc__ = "XDP sample packet\n"
+	" - Stores 1 in --sample-rate packets, cut to --snaplen bytes, in a pcapng file\n"
+	" - An optional filter expression after the options selects the packets:\n"
+	XDP_FILTER_USAGE;
 
-static pcap_t* pd;
-static pcap_dumper_t* pdumper;
-static unsigned int pcap_pkts;
 static struct config cfg = {
 	.ifindex   = -1,
 };
+static struct sample_config sample_cfg = {
+	.sample_rate = 1,
+	.snaplen     = SAMPLE_SNAPLEN_MAX,
+};
+static struct xdp_filter_rule rules[XDP_FILTER_RULES_MAX];
 static struct xdp_program *prog;
-struct perf_buffer *pb;
+static int stats_map_fd = -1;
+static int nr_threads = 4;
+static __u32 ring_size = SAMPLE_RINGBUF_SIZE;
+static __u64 mono_to_real_ns;
+static volatile sig_atomic_t stop;
 
-static const char *default_filename = "samples.pcap";
-#define SAMPLE_SIZE 1024
-#define NANOSECS_PER_USEC 1000
+static const char *default_filename = "samples.pcapng";
+#define NANOSECS_PER_SEC  1000000000ULL
 
-static inline int
-sys_perf_event_open(struct perf_event_attr *attr,
-                  pid_t pid, int cpu, int group_fd,
-                   unsigned long flags)
+/* bpf_ktime_get_ns() is CLOCK_MONOTONIC, pcapng wants wall clock time */
+static int init_clock_offset(void)
 {
-       return syscall(__NR_perf_event_open, attr, pid, cpu, group_fd, flags);
+	struct timespec mono, real;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &mono) ||
+	    clock_gettime(CLOCK_REALTIME, &real))
+		return -1;
+
+	mono_to_real_ns = (real.tv_sec - mono.tv_sec) * NANOSECS_PER_SEC +
+			  real.tv_nsec - mono.tv_nsec;
+	return 0;
 }
 
-static void print_bpf_output(void *ctx, int cpu, void *data, __u32 size)
+static __u64 realtime_ns(void)
 {
-	struct {
-		__u16 cookie;
-		__u16 pkt_len;
-		__u8  pkt_data[SAMPLE_SIZE];
-	} __packed *e = data;
-	struct pcap_pkthdr h = {
-		.caplen	= e->pkt_len,
-		.len	= e->pkt_len,
-	};
 	struct timespec ts;
-	int i, err;
 
-	if (e->cookie != 0xdead)
-		printf("BUG cookie %x sized %d\n",
-		       e->cookie, size);
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * NANOSECS_PER_SEC + ts.tv_nsec;
+}
+
+/* pcapng block types and options, from the pcapng specification */
+#define PCAPNG_SHB		0x0A0D0D0A
+#define PCAPNG_IDB		0x00000001
+#define PCAPNG_ISB		0x00000005
+#define PCAPNG_EPB		0x00000006
+#define PCAPNG_BYTE_ORDER	0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET 1
+
+#define PCAPNG_OPT_END		0
+#define PCAPNG_IF_NAME		2
+#define PCAPNG_IF_TSRESOL	9
+#define PCAPNG_EPB_QUEUE	6
+#define PCAPNG_ISB_STARTTIME	2
+#define PCAPNG_ISB_ENDTIME	3
+#define PCAPNG_ISB_FILTERACCEPT	6
+#define PCAPNG_ISB_OSDROP	7
+#define PCAPNG_ISB_USRDELIV	8
+
+#define PCAPNG_ALIGN(len)	(((len) + 3) & ~3U)
+
+struct pcapng_shb {
+	__u32 type;
+	__u32 total_len;
+	__u32 byte_order;
+	__u16 major;
+	__u16 minor;
+	__s64 section_len;
+};
+
+struct pcapng_idb {
+	__u32 type;
+	__u32 total_len;
+	__u16 linktype;
+	__u16 reserved;
+	__u32 snaplen;
+};
+
+/* Also used for the ISB, which has the same layout up to ts_low */
+struct pcapng_epb {
+	__u32 type;
+	__u32 total_len;
+	__u32 if_id;
+	__u32 ts_high;
+	__u32 ts_low;
+	__u32 cap_len;
+	__u32 orig_len;
+};
+
+struct pcapng_opt {
+	__u16 code;
+	__u16 len;
+};
+
+/* Largest EPB: header, data, epb_queue, end of options and trailing length */
+#define PCAPNG_EPB_MAX		(sizeof(struct pcapng_epb) + SAMPLE_SNAPLEN_MAX + \
+				 2 * sizeof(struct pcapng_opt) + 2 * sizeof(__u32))
+
+/* Samples are gathered into blocks of this size before they are written */
+#define WRITE_BUF_SIZE		(1 << 20)
+
+/* Each writer thread drains the rings of a subset of the CPUs into its own
+ * buffer, and appends the buffer to the file when it fills up or the rings
+ * go idle. Whole pcapng blocks are written under out_lock, so the threads
+ * never interleave inside a block.
+ */
+struct sample_writer {
+	pthread_t thread;
+	struct ring_buffer *rb;
+	char *buf;
+	size_t len;
+	__u64 pending;		/* records in buf */
+	__u64 written;		/* records written to the file */
+	__u64 lost;		/* records lost to write errors */
+};
+
+static struct sample_writer *writers;
+static volatile int writers_exit;
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static int out_fd = -1;
+
+static char *put_opt(char *p, __u16 code, const void *val, __u16 len)
+{
+	struct pcapng_opt opt = { .code = code, .len = len };
+
+	memcpy(p, &opt, sizeof(opt));
+	p += sizeof(opt);
+	memset(p, 0, PCAPNG_ALIGN(len));
+	memcpy(p, val, len);
+	return p + PCAPNG_ALIGN(len);
+}
+
+/* Puts the end of options and the trailing total length, and fills in the
+ * total length at the start of the block
+ */
+static size_t end_block(char *block, char *p)
+{
+	struct pcapng_opt opt = { .code = PCAPNG_OPT_END };
+	__u32 total_len;
+
+	memcpy(p, &opt, sizeof(opt));
+	p += sizeof(opt);
+	total_len = p + sizeof(total_len) - block;
+	memcpy(p, &total_len, sizeof(total_len));
+	memcpy(block + sizeof(__u32), &total_len, sizeof(total_len));
+	return total_len;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static int write_locked(const char *buf, size_t len)
+{
+	int err;
+
+	pthread_mutex_lock(&out_lock);
+	err = write_all(out_fd, buf, len);
+	pthread_mutex_unlock(&out_lock);
+	return err;
+}
+
+/* Section header and the description of the one interface we capture on */
+static int write_file_header(void)
+{
+	char buf[256], *p;
+	struct pcapng_shb shb = {
+		.type = PCAPNG_SHB,
+		.total_len = sizeof(shb) + sizeof(__u32),
+		.byte_order = PCAPNG_BYTE_ORDER,
+		.major = 1,
+		.section_len = -1,
+	};
+	struct pcapng_idb idb = {
+		.type = PCAPNG_IDB,
+		.linktype = PCAPNG_LINKTYPE_ETHERNET,
+		.snaplen = sample_cfg.snaplen,
+	};
+	__u8 tsresol = 9; /* nanoseconds, as bpf_ktime_get_ns() */
+	size_t len;
+
+	memcpy(buf, &shb, sizeof(shb));
+	memcpy(buf + sizeof(shb), &shb.total_len, sizeof(__u32));
+	len = shb.total_len;
+
+	p = buf + len;
+	memcpy(p, &idb, sizeof(idb));
+	p += sizeof(idb);
+	p = put_opt(p, PCAPNG_IF_NAME, cfg.ifname, strlen(cfg.ifname));
+	p = put_opt(p, PCAPNG_IF_TSRESOL, &tsresol, sizeof(tsresol));
+	len += end_block(buf + len, p);
+
+	return write_all(out_fd, buf, len);
+}
+
+/* Statistics of the interface for the whole capture, at the end of it */
+static int write_file_stats(__u64 start_ns, struct sample_stats *stats,
+			    __u64 written)
+{
+	__u64 dropped = stats->ringbuf_full + stats->no_ring + stats->copy_failed;
+	struct pcapng_epb isb = { .type = PCAPNG_ISB };
+	__u64 end_ns = realtime_ns();
+	char buf[256], *p = buf;
+	__u32 ts[2];
+
+	isb.ts_high = end_ns >> 32;
+	isb.ts_low = end_ns;
+	memcpy(p, &isb, offsetof(struct pcapng_epb, cap_len));
+	p += offsetof(struct pcapng_epb, cap_len);
+
+	ts[0] = start_ns >> 32;
+	ts[1] = start_ns;
+	p = put_opt(p, PCAPNG_ISB_STARTTIME, ts, sizeof(ts));
+	ts[0] = isb.ts_high;
+	ts[1] = isb.ts_low;
+	p = put_opt(p, PCAPNG_ISB_ENDTIME, ts, sizeof(ts));
+	p = put_opt(p, PCAPNG_ISB_FILTERACCEPT, &stats->matched,
+		    sizeof(stats->matched));
+	p = put_opt(p, PCAPNG_ISB_OSDROP, &dropped, sizeof(dropped));
+	p = put_opt(p, PCAPNG_ISB_USRDELIV, &written, sizeof(written));
+
+	return write_all(out_fd, buf, end_block(buf, p));
+}
+
+static void writer_flush(struct sample_writer *w)
+{
+	if (!w->len)
+		return;
+
+	if (write_locked(w->buf, w->len))
+		w->lost += w->pending;
+	else
+		w->written += w->pending;
+	w->len = 0;
+	w->pending = 0;
+}
 
-	err = clock_gettime(CLOCK_MONOTONIC, &ts);
-	if (err < 0)
-		printf("Error with clock_gettime! (%i)\n", err);
+static int handle_sample(void *ctx, void *data, size_t size)
+{
+	struct sample_writer *w = ctx;
+	struct sample_hdr *hdr = data;
+	__u8 *pkt_data = (__u8 *)(hdr + 1);
+	struct pcapng_epb epb;
+	__u32 i, queue;
+	char *block, *p;
+	__u64 ts;
+
+	if (size < sizeof(*hdr) || hdr->cap_len > size - sizeof(*hdr) ||
+	    hdr->cap_len > SAMPLE_SNAPLEN_MAX) {
+		printf("BUG sample sized %zu\n", size);
+		return 0;
+	}
 
-	h.ts.tv_sec  = ts.tv_sec;
-	h.ts.tv_usec = ts.tv_nsec / NANOSECS_PER_USEC;
+	if (w->len + PCAPNG_EPB_MAX > WRITE_BUF_SIZE)
+		writer_flush(w);
+
+	ts = hdr->timestamp + mono_to_real_ns;
+	epb.type = PCAPNG_EPB;
+	epb.if_id = 0;
+	epb.ts_high = ts >> 32;
+	epb.ts_low = ts;
+	epb.cap_len = hdr->cap_len;
+	epb.orig_len = hdr->pkt_len;
+
+	block = w->buf + w->len;
+	memcpy(block, &epb, sizeof(epb));
+	p = block + sizeof(epb);
+	memcpy(p, pkt_data, hdr->cap_len);
+	memset(p + hdr->cap_len, 0,
+	       PCAPNG_ALIGN(hdr->cap_len) - hdr->cap_len);
+	p += PCAPNG_ALIGN(hdr->cap_len);
+	queue = hdr->rx_queue;
+	p = put_opt(p, PCAPNG_EPB_QUEUE, &queue, sizeof(queue));
+	w->len += end_block(block, p);
+	w->pending++;
 
 	if (verbose) {
-		printf("pkt len: %-5d bytes. hdr: ", e->pkt_len);
-		for (i = 0; i < e->pkt_len; i++)
-			printf("%02x ", e->pkt_data[i]);
+		flockfile(stdout);
+		printf("pkt len: %-5d bytes. hdr: ", hdr->pkt_len);
+		for (i = 0; i < hdr->cap_len; i++)
+			printf("%02x ", pkt_data[i]);
 		printf("\n");
+		funlockfile(stdout);
 	}
+	return 0;
+}
 
-	pcap_dump((u_char *) pdumper, &h, e->pkt_data);
-	pcap_pkts++;
+static void *writer_thread(void *arg)
+{
+	struct sample_writer *w = arg;
+	int err;
+
+	while (!writers_exit) {
+		err = ring_buffer__poll(w->rb, 100);
+		if (err < 0 && err != -EINTR)
+			break;
+		/* Nothing came in, so write out what we have */
+		if (err == 0)
+			writer_flush(w);
+	}
+
+	/* Drain what is left in the rings */
+	ring_buffer__consume(w->rb);
+	writer_flush(w);
+	return NULL;
 }
 
-static void sig_handler(int signo)
+/* Creates a ring buffer per CPU, stores them in sample_rbs and hands them out
+ * to the writer threads round-robin
+ */
+static int setup_writers(int rbs_fd, int nr_cpus)
+{
+	struct sample_writer *w;
+	int cpu, fd;
+
+	writers = calloc(nr_threads, sizeof(*writers));
+	if (!writers)
+		return -1;
+
+	for (cpu = 0; cpu < nr_cpus; cpu++) {
+		fd = bpf_map_create(BPF_MAP_TYPE_RINGBUF, "sample_rb", 0, 0,
+				    ring_size, NULL);
+		if (fd < 0) {
+			fprintf(stderr, "ERR: creating ring buffer: %s\n",
+				strerror(errno));
+			return -1;
+		}
+		if (bpf_map_update_elem(rbs_fd, &cpu, &fd, 0)) {
+			fprintf(stderr, "ERR: storing ring buffer: %s\n",
+				strerror(errno));
+			return -1;
+		}
+
+		w = &writers[cpu % nr_threads];
+		if (!w->rb) {
+			w->rb = ring_buffer__new(fd, handle_sample, w, NULL);
+			if (libbpf_get_error(w->rb)) {
+				w->rb = NULL;
+				fprintf(stderr, "ring_buffer setup failed\n");
+				return -1;
+			}
+		} else if (ring_buffer__add(w->rb, fd, handle_sample, w)) {
+			fprintf(stderr, "ring_buffer setup failed\n");
+			return -1;
+		}
+		/* The ring buffer manager has mapped it, and sample_rbs
+		 * holds a reference
+		 */
+		close(fd);
+	}
+
+	for (cpu = 0; cpu < nr_threads; cpu++) {
+		w = &writers[cpu];
+		if (posix_memalign((void **)&w->buf, 4096, WRITE_BUF_SIZE))
+			return -1;
+	}
+	return 0;
+}
+
+static int start_writers(void)
+{
+	sigset_t set, old;
+	int i, err = 0;
+
+	/* The threads inherit the blocked signals, leaving them to main() */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+
+	for (i = 0; i < nr_threads; i++) {
+		err = pthread_create(&writers[i].thread, NULL, writer_thread,
+				     &writers[i]);
+		if (err) {
+			fprintf(stderr, "ERR: pthread_create: %s\n",
+				strerror(err));
+			nr_threads = i;
+			break;
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return err ? -1 : 0;
+}
+
+static void stop_writers(__u64 *written, __u64 *lost)
+{
+	int i;
+
+	writers_exit = 1;
+	*written = *lost = 0;
+	if (!writers)
+		return;
+	for (i = 0; i < nr_threads; i++) {
+		if (writers[i].thread)
+			pthread_join(writers[i].thread, NULL);
+		ring_buffer__free(writers[i].rb);
+		free(writers[i].buf);
+		*written += writers[i].written;
+		*lost += writers[i].lost;
+	}
+}
+
+/* Sums the per-CPU counters of the BPF program, and reports the CPUs that
+ * lost samples
+ */
+static void get_sample_stats(struct sample_stats *sum)
 {
-	struct xdp_multiprog *mp = xdp_multiprog__get_from_ifindex(cfg.ifindex);
-	enum xdp_attach_mode m = xdp_multiprog__attach_mode(mp);
+	int i, nr_cpus = libbpf_num_possible_cpus();
+	struct sample_stats values[nr_cpus];
+	__u32 key = 0;
+
+	memset(sum, 0, sizeof(*sum));
+	if (nr_cpus < 0 || bpf_map_lookup_elem(stats_map_fd, &key, values))
+		return;
+
+	for (i = 0; i < nr_cpus; i++) {
+		sum->matched += values[i].matched;
+		sum->sampled += values[i].sampled;
+		sum->ringbuf_full += values[i].ringbuf_full;
+		sum->no_ring += values[i].no_ring;
+		sum->copy_failed += values[i].copy_failed;
+		if (values[i].ringbuf_full)
+			printf("  cpu %d: %llu samples lost to a full ring buffer\n",
+			       i, values[i].ringbuf_full);
+		if (values[i].no_ring)
+			printf("  cpu %d: %llu samples lost as it has no ring buffer\n",
+			       i, values[i].no_ring);
+	}
+}
 
-	printf("\n Cleaning up...");
-	xdp_program__detach(prog, cfg.ifindex, m, 0);
-	perf_buffer__free(pb);
-	pcap_dump_close(pdumper);
-	pcap_close(pd);
-	printf("\n%u packet samples stored in %s\n", pcap_pkts, cfg.filename);
-	exit(0);
+static void sig_handler(int signo)
+{
+	stop = 1;
 }
 
 static const struct option_wrapper long_options[] = {
@@ -118,44 +488,176 @@ static const struct option_wrapper long_options[] = {
 	{{"dev",         required_argument,	NULL, 'd' },
 	 "Operate on device <ifname>", "<ifname>", true},
 
+	{{"skb-mode",    no_argument,		NULL, 'S' },
+	 "Install XDP program in SKB (AKA generic) mode"},
+
 	{{"filename",    required_argument,	NULL,  1  },
 	 "Store packet sample into <file>", "<file>"},
 
+	{{"sample-rate", required_argument,	NULL, 'r' },
+	 "Sample 1 in <n> packets (default 1, all)", "<n>"},
+
+	{{"snaplen",     required_argument,	NULL, 's' },
+	 "Capture at most <len> bytes per packet (default 1024)", "<len>"},
+
+	{{"threads",     required_argument,	NULL, 't' },
+	 "Write samples with <n> threads (default 4)", "<n>"},
+
+	{{"ring-size",   required_argument,	NULL, 'R' },
+	 "Ring buffer of <KiB> per possible CPU (default 1024)", "<KiB>"},
+
 	{{"quiet",       no_argument,		NULL, 'q' },
 	 "Quiet mode (no output)"},
 
 	{{0, 0, NULL,  0 }, NULL, false}
 };
 
+static void parse_args(int argc, char **argv)
+{
+	struct option long_opts[sizeof(long_options) / sizeof(long_options[0])];
+	unsigned long size;
+	long page_size;
+	int i, opt;
+	char *end;
+
+	for (i = 0; long_options[i].option.name; i++)
+		long_opts[i] = long_options[i].option;
+	memset(&long_opts[i], 0, sizeof(long_opts[i]));
+
+	while ((opt = getopt_long(argc, argv, "hFd:Sr:s:t:R:q",
+				  long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'd':
+			if (strlen(optarg) >= IF_NAMESIZE) {
+				fprintf(stderr, "ERR: --dev name too long\n");
+				goto error;
+			}
+			cfg.ifname = cfg.ifname_buf;
+			strncpy(cfg.ifname, optarg, IF_NAMESIZE);
+			cfg.ifindex = if_nametoindex(cfg.ifname);
+			if (cfg.ifindex == 0) {
+				fprintf(stderr,
+					"ERR: --dev name unknown err(%d):%s\n",
+					errno, strerror(errno));
+				goto error;
+			}
+			break;
+		case 'F':
+			/* libxdp attaches next to existing programs */
+			break;
+		case 'S':
+			cfg.attach_mode = XDP_MODE_SKB;
+			break;
+		case 1: /* --filename */
+			strncpy(cfg.filename, optarg, sizeof(cfg.filename) - 1);
+			break;
+		case 'r':
+			sample_cfg.sample_rate = atoi(optarg);
+			if (!sample_cfg.sample_rate) {
+				fprintf(stderr, "ERR: bad --sample-rate %s\n", optarg);
+				goto error;
+			}
+			break;
+		case 's':
+			sample_cfg.snaplen = atoi(optarg);
+			if (!sample_cfg.snaplen ||
+			    sample_cfg.snaplen > SAMPLE_SNAPLEN_MAX) {
+				fprintf(stderr, "ERR: --snaplen must be 1-%d\n",
+					SAMPLE_SNAPLEN_MAX);
+				goto error;
+			}
+			break;
+		case 't':
+			nr_threads = atoi(optarg);
+			if (nr_threads < 1) {
+				fprintf(stderr, "ERR: bad --threads %s\n", optarg);
+				goto error;
+			}
+			break;
+		case 'R':
+			size = strtoul(optarg, &end, 10) * 1024;
+			page_size = sysconf(_SC_PAGESIZE);
+			if (*end || size < page_size || size > (1UL << 30) ||
+			    size & (size - 1)) {
+				fprintf(stderr, "ERR: --ring-size must be a power of 2, %ld-%lu KiB\n",
+					page_size / 1024, 1UL << 20);
+				goto error;
+			}
+			ring_size = size;
+			break;
+		case 'q':
+			verbose = false;
+			break;
+		case 'h':
+			usage(argv[0], __doc__, long_options, true);
+			exit(EXIT_OK);
+		default:
+			goto error;
+		}
+	}
+
+	if (cfg.ifindex == -1) {
+		fprintf(stderr, "ERR: required option --dev missing\n");
+		goto error;
+	}
+
+	sample_cfg.nr_rules = xdp_filter_compile(argv + optind, argc - optind,
+						 rules);
+	if ((int)sample_cfg.nr_rules < 0)
+		exit(EXIT_FAIL_OPTION);
+	return;
+
+error:
+	usage(argv[0], __doc__, long_options, (argc == 1));
+	exit(EXIT_FAIL_OPTION);
+}
+
 int main(int argc, char **argv)
 {
 	struct rlimit r = {RLIM_INFINITY, RLIM_INFINITY};
-	int map_fd;
-	struct bpf_map *map;
+	int rbs_fd, cfg_fd, filter_fd, nr_cpus;
+	struct sample_stats stats;
+	struct xdp_multiprog *mp;
+	__u64 start_ns, written, lost;
+	struct bpf_object *obj;
 	char filename[256];
 	int err;
 	DECLARE_LIBBPF_OPTS(bpf_object_open_opts, opts);
 	DECLARE_LIBXDP_OPTS(xdp_program_opts, xdp_opts, 0);
 	char progname[] = "xdp_sample_prog";
 	char errmsg[1024];
+	__u32 key = 0;
 
 	strncpy(cfg.filename, default_filename, sizeof(cfg.filename));
 
 	/* Cmdline options can change these */
-	parse_cmdline_args(argc, argv, long_options, &cfg, __doc__);
-
-	/* Required option */
-	if (cfg.ifindex == -1) {
-		fprintf(stderr, "ERR: required option --dev missing\n");
-		usage(argv[0], __doc__, long_options, (argc == 1));
-		return EXIT_FAIL_OPTION;
-	}
+	parse_args(argc, argv);
 
 	if (setrlimit(RLIMIT_MEMLOCK, &r)) {
 		perror("setrlimit(RLIMIT_MEMLOCK)");
 		return 1;
 	}
 
+	if (init_clock_offset()) {
+		fprintf(stderr, "ERR: clock_gettime failed\n");
+		return 1;
+	}
+
+	nr_cpus = libbpf_num_possible_cpus();
+	if (nr_cpus < 0 || nr_cpus > SAMPLE_MAX_CPUS) {
+		fprintf(stderr, "ERR: need 1-%d CPUs\n", SAMPLE_MAX_CPUS);
+		return 1;
+	}
+	if (nr_threads > nr_cpus)
+		nr_threads = nr_cpus;
+
+	out_fd = open(cfg.filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0 || write_file_header()) {
+		fprintf(stderr, "ERR: writing %s: %s\n", cfg.filename,
+			strerror(errno));
+		return 1;
+	}
+
 	snprintf(filename, sizeof(filename), "xdp_sample_pkts_kern.o");
 	xdp_opts.open_filename = filename;
 	xdp_opts.prog_name = progname;
@@ -176,43 +678,62 @@ int main(int argc, char **argv)
 		return err;
 	}
 
-	map = bpf_object__next_map(xdp_program__bpf_obj(prog), NULL);
-	if (!map) {
-		fprintf(stderr, "finding a map in obj file failed\n");
-		return 1;
+	obj = xdp_program__bpf_obj(prog);
+	rbs_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "sample_rbs"));
+	cfg_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "sample_config_map"));
+	stats_map_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "sample_stats_map"));
+	filter_fd = bpf_map__fd(bpf_object__find_map_by_name(obj, "xdp_filter_map"));
+	if (rbs_fd < 0 || cfg_fd < 0 || stats_map_fd < 0 || filter_fd < 0) {
+		fprintf(stderr, "finding the maps in obj file failed\n");
+		goto out;
 	}
-	map_fd = bpf_map__fd(map);
 
-	if (signal(SIGINT, sig_handler) ||
-	    signal(SIGHUP, sig_handler) ||
-	    signal(SIGTERM, sig_handler)) {
-		fprintf(stderr, "signal");
-		return 1;
-	}
-	pb = perf_buffer__new(map_fd, 8, print_bpf_output, NULL, NULL, NULL);
-	err = libbpf_get_error(pb);
-	if (err) {
-		fprintf(stderr, "perf_buffer setup failed");
-		return 1;
-	}
+	if (setup_writers(rbs_fd, nr_cpus) || start_writers())
+		goto out_writers;
 
-	pd = pcap_open_dead(DLT_EN10MB, 65535);
-	if (!pd) {
-		perf_buffer__free(pb);
-		goto out;
+	if (signal(SIGINT, sig_handler) == SIG_ERR ||
+	    signal(SIGHUP, sig_handler) == SIG_ERR ||
+	    signal(SIGTERM, sig_handler) == SIG_ERR) {
+		fprintf(stderr, "signal");
+		goto out_writers;
 	}
 
-	pdumper = pcap_dump_open(pd, cfg.filename);
-	if (!pdumper) {
-		perf_buffer__free(pb);
-	    pcap_close(pd);
-		goto out;
-	}
+	if (xdp_filter_load(filter_fd, rules, sample_cfg.nr_rules))
+		goto out_writers;
 
-	while ((err = perf_buffer__poll(pb, 1000)) >= 0) {
+	/* Sampling starts once the configuration is written */
+	start_ns = realtime_ns();
+	if (bpf_map_update_elem(cfg_fd, &key, &sample_cfg, 0)) {
+		fprintf(stderr, "ERR: writing sample config: %s\n",
+			strerror(errno));
+		goto out_writers;
 	}
 
+	while (!stop)
+		sleep(1);
+
+	/* Detach before the writers drain the rings for the last time, so
+	 * no sample is left behind
+	 */
+	printf("\n Cleaning up...\n");
+	mp = xdp_multiprog__get_from_ifindex(cfg.ifindex);
+	xdp_program__detach(prog, cfg.ifindex, xdp_multiprog__attach_mode(mp), 0);
+	stop_writers(&written, &lost);
+	get_sample_stats(&stats);
+
+	if (write_file_stats(start_ns, &stats, written))
+		fprintf(stderr, "ERR: writing %s: %s\n", cfg.filename,
+			strerror(errno));
+	close(out_fd);
+
+	printf("%llu packet samples stored in %s\n", written, cfg.filename);
+	printf("%llu packets matched, %llu samples taken, %llu lost to a full ring buffer, %llu lost to a missing ring buffer, %llu lost to failed copies, %llu lost to write errors\n",
+	       stats.matched, stats.sampled, stats.ringbuf_full,
+	       stats.no_ring, stats.copy_failed, lost);
 	return 0;
+
+out_writers:
+	stop_writers(&written, &lost);
 out:
 	xdp_program__detach(prog, cfg.ifindex, cfg.attach_mode, 0);
 	return -1;